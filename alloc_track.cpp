@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstddef>
+#include <cerrno>
+#include <atomic>
+#include "alloc_track.h"
+
+/* glibc's real allocator entry points, our malloc() wraps them. */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+static const char *subsystem_names[ALLOC_SUBSYSTEMS] = { "app", "serial", "transport", "mqtt" };
+static std::atomic<unsigned long> allocations[ALLOC_SUBSYSTEMS];
+static std::atomic<unsigned long> allocated_bytes[ALLOC_SUBSYSTEMS];
+static unsigned long marks[ALLOC_SUBSYSTEMS];
+static thread_local allocSubsystem_t current = ALLOC_APP;
+
+static inline void charge(size_t size) {
+    allocations[current].fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes[current].fetch_add(size, std::memory_order_relaxed);
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+    charge(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    charge(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    charge(size);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    charge(size);
+    *memptr = __libc_memalign(alignment, size);
+    return *memptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    charge(size);
+    return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+allocSubsystem_t allocTrackSwap(allocSubsystem_t subsystem) {
+    allocSubsystem_t previous = current;
+    current = subsystem;
+    return previous;
+}
+
+void allocTrackMark(void) {
+    for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+        marks[i] = allocations[i].load();
+    }
+}
+
+unsigned long allocTrackSinceMark(allocSubsystem_t subsystem) {
+    return allocations[subsystem].load() - marks[subsystem];
+}
+
+void allocTrackReport(void) {
+    for (int i = 0; i < ALLOC_SUBSYSTEMS; i++) {
+        fprintf(stderr, "alloc %-9s total %lu (%lu bytes), since mark %lu\n", subsystem_names[i],
+                allocations[i].load(), allocated_bytes[i].load(), allocTrackSinceMark((allocSubsystem_t) i));
+    }
+}
+
+} //extern "C"
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifndef ALLOC_TRACK_H
+#define ALLOC_TRACK_H
+
+/* Allocation accounting, built in with `make ALLOC_TRACKING=1`.
+ * malloc and friends (and so operator new) are interposed and every
+ * allocation is charged to the subsystem the calling thread is in, as set
+ * by ALLOC_SCOPE(). The goal is no heap use after startup: take a mark once
+ * the client is up, and allocTrackSinceMark() must stay at zero for the
+ * serial, transport and MQTT subsystems.
+ * Without ALLOC_TRACKING, ALLOC_SCOPE() compiles to nothing.
+ */
+
+#ifndef configALLOC_TRACKING
+    #define configALLOC_TRACKING 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum allocSubsystem {
+    ALLOC_APP = 0,     /**< Anything not inside a scope. */
+    ALLOC_SERIAL,
+    ALLOC_TRANSPORT,
+    ALLOC_MQTT,
+    ALLOC_SUBSYSTEMS
+} allocSubsystem_t;
+
+//Charge the calling thread's allocations to subsystem; returns the previous one.
+allocSubsystem_t allocTrackSwap(allocSubsystem_t subsystem);
+
+//Remember the current counters; allocTrackSinceMark() counts from here.
+void allocTrackMark(void);
+
+//Allocations charged to subsystem since the last allocTrackMark().
+unsigned long allocTrackSinceMark(allocSubsystem_t subsystem);
+
+//Print totals and since-mark counts per subsystem to stderr.
+void allocTrackReport(void);
+
+#ifdef __cplusplus
+}
+
+#if configALLOC_TRACKING
+class allocScope {
+public:
+    explicit allocScope(allocSubsystem_t subsystem) : previous(allocTrackSwap(subsystem)) {}
+    ~allocScope() { allocTrackSwap(previous); }
+private:
+    allocSubsystem_t previous;
+};
+#define ALLOC_SCOPE(subsystem) allocScope alloc_scope_(subsystem)
+#else
+#define ALLOC_SCOPE(subsystem)
+#endif
+
+#endif //__cplusplus
+
+#endif //ALLOC_TRACK_H
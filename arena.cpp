@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <atomic>
+#include <pthread.h>
+#include "arena.h"
+#include "metrics.h"
+
+//size, overridable at build time (see footprint.sh).
+#ifndef configARENA_SIZE
+    #define configARENA_SIZE 4096
+#endif
+
+//constants
+const size_t ARENA_ALIGN = alignof(max_align_t);
+const unsigned char ARENA_POISON = 0xa5;
+
+alignas(max_align_t) static unsigned char arena[configARENA_SIZE];
+static size_t arena_used = 0, arena_high = 0;
+static uint32_t allocations = 0, failures = 0;
+static std::atomic<uint32_t> generation(0);
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dump_arena(int fd);
+static const int arena_metrics = metricsRegister("arena", dump_arena);
+
+void *arenaAlloc(size_t size) {
+
+    size_t start;
+    void *p = NULL;
+
+    pthread_mutex_lock(&arena_lock);
+    start = (arena_used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (size <= sizeof(arena) - start) {
+        p = &arena[start];
+        memset(p, 0, size);
+        arena_used = start + size;
+        arena_high = arena_used > arena_high ? arena_used : arena_high;
+        allocations++;
+    }
+    else {
+        failures++;
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return p;
+}
+
+void arenaReset(void) {
+    pthread_mutex_lock(&arena_lock);
+    memset(arena, ARENA_POISON, arena_used);
+    arena_used = 0;
+    allocations = 0;
+    generation++;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+uint32_t arenaGeneration(void) {
+    return generation.load();
+}
+
+void dump_arena(int fd) {
+    (void) arena_metrics;
+    pthread_mutex_lock(&arena_lock);
+    dprintf(fd, "used %zu of %d bytes in %u allocations, high water %zu, failed %u, resets %u\n",
+            arena_used, configARENA_SIZE, allocations, arena_high, failures, generation.load());
+    pthread_mutex_unlock(&arena_lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Per-connection arena.
+ * Objects that live exactly as long as a broker connection (the coreMQTT
+ * publish records, the RPC table, ...) are bump-allocated from one static
+ * block when the connection is set up, and all released together by
+ * arenaReset() at disconnect. Nothing is freed one by one and nothing comes
+ * from the heap, so reconnecting costs no malloc/free traffic and cannot
+ * fragment anything. The block is configARENA_SIZE bytes; use, high water
+ * mark and failed allocations are listed under "arena" in metricsDump().
+ */
+
+//Zeroed memory for size bytes, aligned for any type. NULL when the arena is full.
+void *arenaAlloc(size_t size);
+
+//Release everything allocated since the last reset. Every pointer handed out
+//becomes invalid; the memory is poisoned so a stale use shows.
+void arenaReset(void);
+
+//Incremented by each reset: holders of arena memory compare it with the value
+//they saw when allocating, to tell whether their memory is still theirs.
+uint32_t arenaGeneration(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ARENA_H
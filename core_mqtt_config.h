@@ -170,6 +170,44 @@
     #error MQTT_SEND_RETRY_TIMEOUT_MS is deprecated. Instead use MQTT_SEND_TIMEOUT_MS.
 #endif
 
+/**
+ * @brief Full-duplex mode: 1 runs #MQTT_ReceiveLoop on a thread of its own
+ * while the demo publishes (see main.cpp). Set it here or with
+ * `make FULL_DUPLEX=1`, so that coreMQTT and the application agree.
+ */
+#ifndef configFULL_DUPLEX
+    #define configFULL_DUPLEX    0
+#endif
+
+/**
+ * @brief Hooks serialising sends and publish state updates, so that one
+ * thread may run #MQTT_ReceiveLoop while others publish on the same
+ * context. Implemented in mqtt_hooks.cpp. Single threaded, coreMQTT
+ * needs no locking, and the hooks are only installed in full-duplex mode.
+ */
+void vMQTTSendLock( void );
+void vMQTTSendUnlock( void );
+void vMQTTStateLock( void );
+void vMQTTStateUnlock( void );
+
+#if configFULL_DUPLEX
+    #ifndef MQTT_PRE_SEND_HOOK
+        #define MQTT_PRE_SEND_HOOK( pContext )            vMQTTSendLock()
+    #endif
+
+    #ifndef MQTT_POST_SEND_HOOK
+        #define MQTT_POST_SEND_HOOK( pContext )           vMQTTSendUnlock()
+    #endif
+
+    #ifndef MQTT_PRE_STATE_UPDATE_HOOK
+        #define MQTT_PRE_STATE_UPDATE_HOOK( pContext )    vMQTTStateLock()
+    #endif
+
+    #ifndef MQTT_POST_STATE_UPDATE_HOOK
+        #define MQTT_POST_STATE_UPDATE_HOOK( pContext )   vMQTTStateUnlock()
+    #endif
+#endif /* configFULL_DUPLEX */
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
     }
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* TCP echo server for the transport benchmark (test_transport.cpp). Run it
+ * on a host the module can reach:
+ *
+ *   echo_server [-p port] [-d]
+ *
+ * Every byte received is sent back on the same connection, or with -d
+ * discarded (flood mode). Several clients are served at once. When a
+ * client leaves, its byte counts are printed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+//constants
+const int CLIENTS_MAX = 8;
+const int BUFFER_LEN = 4096;
+
+struct echoClient {
+    int fd;
+    char peer[INET_ADDRSTRLEN + 8];
+    unsigned long long bytes_in, bytes_out;
+};
+
+static echoClient clients[CLIENTS_MAX];
+static bool discard = false;
+
+static int listen_on(int port);
+static void accept_client(int listen_fd);
+static void serve_client(echoClient *client);
+static void close_client(echoClient *client);
+static bool send_all(int fd, const char *data, ssize_t len);
+
+int main(int argc, char *argv[]) {
+
+    struct pollfd fds[CLIENTS_MAX + 1];
+    int port = 7007, listen_fd, opt, i;
+
+    while ((opt = getopt(argc, argv, "p:dh")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'd': discard = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-p port (7007)] [-d discard instead of echo]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0); //the log is read while the server runs
+    listen_fd = listen_on(port);
+    if (listen_fd < 0) {
+        perror("echo_server: listen");
+        return 1;
+    }
+    for (i = 0; i < CLIENTS_MAX; i++) {
+        clients[i].fd = -1;
+    }
+    printf("echo_server: %s on port %d\n", discard ? "discarding" : "echoing", port);
+
+    for (;;) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (i = 0; i < CLIENTS_MAX; i++) {
+            fds[i + 1].fd = clients[i].fd; //negative fds are ignored by poll()
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, CLIENTS_MAX + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("echo_server: poll");
+            return 1;
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_client(listen_fd);
+        }
+        for (i = 0; i < CLIENTS_MAX; i++) {
+            if (clients[i].fd >= 0 && fds[i + 1].fd == clients[i].fd && fds[i + 1].revents) {
+                serve_client(&clients[i]);
+            }
+        }
+    }
+}
+
+int listen_on(int port) {
+
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, CLIENTS_MAX)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void accept_client(int listen_fd) {
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd, one = 1, i;
+
+    fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_len);
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < CLIENTS_MAX && clients[i].fd >= 0; i++) {
+    }
+    if (i == CLIENTS_MAX) {
+        fprintf(stderr, "echo_server: %d clients already, connection refused\n", CLIENTS_MAX);
+        close(fd);
+        return;
+    }
+    //echoes go out as they come in, not coalesced behind Nagle.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    clients[i].fd = fd;
+    clients[i].bytes_in = clients[i].bytes_out = 0;
+    snprintf(clients[i].peer, sizeof(clients[i].peer), "%s:%u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    printf("echo_server: %s connected\n", clients[i].peer);
+}
+
+void serve_client(echoClient *client) {
+
+    char buffer[BUFFER_LEN];
+    ssize_t n;
+
+    n = read(client->fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+        close_client(client);
+        return;
+    }
+    client->bytes_in += n;
+    if (!discard) {
+        if (!send_all(client->fd, buffer, n)) {
+            close_client(client);
+            return;
+        }
+        client->bytes_out += n;
+    }
+}
+
+void close_client(echoClient *client) {
+
+    printf("echo_server: %s left, %llu bytes in, %llu bytes out\n", client->peer, client->bytes_in,
+           client->bytes_out);
+    close(client->fd);
+    client->fd = -1;
+}
+
+bool send_all(int fd, const char *data, ssize_t len) {
+
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <atomic>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "flight_recorder.h"
+
+#ifndef configFLIGHT_RECORDER_RECORDS
+    #define configFLIGHT_RECORDER_RECORDS 1024
+#endif
+
+//constants
+const unsigned int FR_RECORDS = configFLIGHT_RECORDER_RECORDS; //power of two
+static_assert((FR_RECORDS & (FR_RECORDS - 1)) == 0, "configFLIGHT_RECORDER_RECORDS must be a power of two");
+const unsigned int FR_DATA_LEN = 44;  //bytes of payload kept per record, a record is 64 bytes
+const int FR_PATH_LEN = 108;
+
+struct flightRecord_s {
+    std::atomic<uint32_t> seq; //index + 1 once the record is complete, 0 while written
+    uint8_t type;
+    uint8_t kept;
+    uint16_t len;
+    uint64_t timestamp_ns;
+    char data[FR_DATA_LEN];
+};
+
+static struct flightRecord_s records[FR_RECORDS];
+static std::atomic<uint32_t> next_index(0);
+static char dump_path[FR_PATH_LEN] = "/tmp/esp8266_flight_recorder.txt";
+static const char *event_names[] = { "SERIAL_RX", "SERIAL_TX", "AT", "STATE", "MQTT", "NOTE" };
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+static void signal_handler(int sig);
+
+void flightRecord(flightEvent_t type, const void *data, size_t len) {
+
+    struct timespec ts;
+    uint32_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+    struct flightRecord_s *r = &records[index & (FR_RECORDS - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->seq.store(0, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    r->type = (uint8_t) type;
+    r->len = len > 0xffff ? 0xffff : (uint16_t) len;
+    r->kept = len > FR_DATA_LEN ? FR_DATA_LEN : (uint8_t) len;
+    r->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy(r->data, data, r->kept);
+    r->seq.store(index + 1, std::memory_order_release);
+}
+
+void flightRecordf(flightEvent_t type, const char *format, ...) {
+
+    char text[FR_DATA_LEN + 1];
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n > 0) {
+        flightRecord(type, text, (size_t) n < sizeof(text) ? n : sizeof(text) - 1);
+    }
+}
+
+void flightRecorderInstall(const char *dumpPath) {
+
+    struct sigaction sa;
+
+    strncpy(dump_path, dumpPath, FR_PATH_LEN - 1);
+    dump_path[FR_PATH_LEN - 1] = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESETHAND; //second fault goes straight to the default action.
+    for (unsigned int i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        sigaction(crash_signals[i], &sa, NULL);
+    }
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* Below helpers only use async-signal-safe calls. */
+
+static char *put_str(char *p, const char *s) {
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char *put_uint(char *p, uint64_t v, int min_digits) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n < min_digits) {
+        tmp[n++] = '0';
+    }
+    while (n) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static char *put_escaped(char *p, const char *data, int len) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) data[i];
+        if (c == '\r') {
+            p = put_str(p, "\\r");
+        }
+        else if (c == '\n') {
+            p = put_str(p, "\\n");
+        }
+        else if (c < 0x20 || c >= 0x7f || c == '\\') {
+            *p++ = '\\';
+            *p++ = 'x';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 0xf];
+        }
+        else {
+            *p++ = (char) c;
+        }
+    }
+    return p;
+}
+
+void flightRecorderDump(const char *reason) {
+
+    char line[64 + FR_DATA_LEN * 4];
+    char *p;
+    uint32_t last = next_index.load(std::memory_order_acquire);
+    uint32_t first = last > FR_RECORDS ? last - FR_RECORDS : 0;
+    struct flightRecord_s *r;
+    int fd;
+
+    fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    p = put_str(line, "# flight recorder dump: ");
+    p = put_str(p, reason);
+    p = put_str(p, "\n# records ");
+    p = put_uint(p, last - first, 1);
+    p = put_str(p, " of ");
+    p = put_uint(p, last, 1);
+    p = put_str(p, "\n");
+    (void) !write(fd, line, p - line);
+
+    for (uint32_t index = first; index != last; index++) {
+        r = &records[index & (FR_RECORDS - 1)];
+        if (r->seq.load(std::memory_order_acquire) != index + 1) {
+            continue; //overwritten or still being written.
+        }
+        p = put_uint(line, r->timestamp_ns / 1000000000ULL, 1);
+        *p++ = '.';
+        p = put_uint(p, (r->timestamp_ns / 1000ULL) % 1000000ULL, 6);
+        *p++ = ' ';
+        p = put_str(p, r->type < sizeof(event_names) / sizeof(event_names[0]) ? event_names[r->type] : "?");
+        p = put_str(p, " len=");
+        p = put_uint(p, r->len, 1);
+        p = put_str(p, " \"");
+        p = put_escaped(p, r->data, r->kept);
+        p = put_str(p, r->kept < r->len ? "\"...\n" : "\"\n");
+        (void) !write(fd, line, p - line);
+    }
+    close(fd);
+}
+
+void signal_handler(int sig) {
+
+    int saved_errno = errno;
+
+    if (sig == SIGUSR1) {
+        flightRecord(FR_NOTE, "dump on demand", 14);
+        flightRecorderDump("SIGUSR1");
+        errno = saved_errno;
+        return;
+    }
+
+    char reason[24];
+    *put_uint(put_str(reason, "fatal signal "), sig, 1) = 0;
+    flightRecorderDump(reason);
+    raise(sig); //handler was reset, take the default action (core dump).
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* Always-on flight recorder.
+ * A fixed ring of the most recent serial chunks, AT events, transport state
+ * changes and MQTT packet summaries, with monotonic timestamps. Recording is
+ * a slot claim plus a short copy, so it can stay enabled at full link rate.
+ * The ring is written out as text on crash signals, on SIGUSR1, or when
+ * flightRecorderDump() is called (e.g. right before a fatal exit).
+ */
+
+typedef enum flightEvent {
+    FR_SERIAL_RX = 0,    /**< Chunk read from the serial device. */
+    FR_SERIAL_TX,        /**< Chunk written to the serial device. */
+    FR_AT_EVENT,         /**< AT level event, e.g. +IPD header, CIPSEND. */
+    FR_TRANSPORT_STATE,  /**< Transport status change. */
+    FR_MQTT_PACKET,      /**< MQTT packet summary. */
+    FR_NOTE              /**< Free text, e.g. the reason of a dump. */
+} flightEvent_t;
+
+//Record one event. Only the first bytes of data are kept, plus its full length.
+void flightRecord(flightEvent_t type, const void *data, size_t len);
+
+//Record a short formatted event (not for signal handlers).
+void flightRecordf(flightEvent_t type, const char *format, ...);
+
+//Install the crash and SIGUSR1 handlers; dumps go to dumpPath.
+void flightRecorderInstall(const char *dumpPath);
+
+//Write the ring to the dump path. Async-signal-safe.
+void flightRecorderDump(const char *reason);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FLIGHT_RECORDER_H
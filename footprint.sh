@@ -0,0 +1,131 @@
+#!/bin/sh
+#
+# Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+#
+# SPDX-License-Identifier: MIT
+#
+# Static footprint of the serial, transport and client objects, per build
+# configuration, checked against footprint.budget. Run through `make footprint`.
+#
+#   footprint.sh [--update]
+#
+# For every configuration below the objects are rebuilt in footprint/<config>/
+# with -fstack-usage, then reported:
+#   text   code + constants (flash)
+#   ram    .data + .bss (static RAM)
+#   stack  largest single frame in the object, from the .su files;
+#          '+' marks objects with a dynamically sized frame
+# Heap is not visible statically. Pass HEAP_LOG=<file> holding the output of
+# allocTrackReport() from a `make ALLOC_TRACKING=1` run of the client; since
+# the hot paths do not allocate, the per subsystem totals are the steady
+# state heap, and they are checked too.
+#
+# --update rewrites footprint.budget with the current numbers.
+#
+# Environment: CC, CXX, CFLAGS, SIZE, BUDGET, OUT, HEAP_LOG.
+
+CC=${CC:-cc}
+CXX=${CXX:-c++}
+SIZE=${SIZE:-size}
+CFLAGS=${CFLAGS:--g -I. -I./coreMQTT/source/include -I./coreMQTT/source/interface}
+BUDGET=${BUDGET:-footprint.budget}
+OUT=${OUT:-footprint}
+OPT=-Os
+
+# name|extra flags. Only configurations this tree actually has.
+CONFIGS='default|
+full-duplex|-DconfigFULL_DUPLEX=1
+alloc-tracking|-DconfigALLOC_TRACKING=1
+lock-stats|-DconfigLOCK_STATS=1
+small-buffers|-DconfigTRANSPORT_SERIAL_QUEUE_LEN=64 -DconfigTRANSPORT_CIPSEND_MAX=512 -DconfigTRANSPORT_RX_RING_LEN=512 -DconfigNETWORK_BUFFER_SIZE=64 -DconfigFLIGHT_RECORDER_RECORDS=128
+no-flight-recorder-history|-DconfigFLIGHT_RECORDER_RECORDS=1'
+
+SOURCES='serial.cpp transport_esp8266.cpp flight_recorder.cpp metrics.cpp thread_stats.cpp periodic.cpp arena.cpp topic_table.cpp mqtt_hooks.cpp handoff.cpp mqtt_rpc.cpp main.cpp'
+if [ -d coreMQTT/source ]; then
+    SOURCES="$SOURCES coreMQTT/source/core_mqtt.c coreMQTT/source/core_mqtt_state.c coreMQTT/source/core_mqtt_serializer.c"
+fi
+
+update=0
+[ "$1" = "--update" ] && update=1
+
+report=$OUT/report.txt
+mkdir -p "$OUT"
+: > "$report"
+
+# build <config dir> <flags> <source>: compile one object, echo its path.
+build() {
+    obj=$1/$(basename "$3" | sed 's/\.c.*$/.o/')
+    case $3 in
+    *.c)   $CC  $CFLAGS $OPT -fstack-usage $2 -c "$3" -o "$obj" ;;
+    *.cpp) $CXX $CFLAGS $OPT -fstack-usage -fpermissive -w $2 -c "$3" -o "$obj" ;;
+    esac || return 1
+    echo "$obj"
+}
+
+# measure <config> <object>: append "config object text ram stack" to the report.
+measure() {
+    set -- "$1" "$2" $($SIZE -B "$2" | awk 'NR == 2 { print $1, $2 + $3 }')
+    su=${2%.o}.su
+    stack=$(awk -F'\t' '$2 > max { max = $2 } $3 ~ /dynamic/ { dyn = "+" }
+                        END { print (max ? max : 0) dyn }' "$su" 2>/dev/null)
+    echo "$1 $(basename "$2") $3 $4 ${stack:-0}" >> "$report"
+}
+
+echo "$CONFIGS" | while IFS='|' read -r name flags; do
+    dir=$OUT/$name
+    mkdir -p "$dir"
+    srcs=$SOURCES
+    case $flags in *configALLOC_TRACKING=1*) srcs="$srcs alloc_track.cpp" ;; esac
+    case $flags in *configLOCK_STATS=1*) srcs="$srcs lock_stats.cpp" ;; esac
+    for src in $srcs; do
+        if obj=$(build "$dir" "$flags" "$src"); then
+            measure "$name" "$obj"
+        else
+            echo "footprint: $src does not build in '$name', skipped" >&2
+        fi
+    done
+    awk -v c="$name" '$1 == c { t += $3; r += $4 } END { print c, "TOTAL", t, r, "-" }' "$report" >> "$report"
+done
+
+if [ -n "$HEAP_LOG" ]; then
+    awk '$1 == "alloc" { gsub(/\(/, "", $5); print "heap", $2, "-", $5, "-" }' "$HEAP_LOG" >> "$report"
+fi
+
+printf '%-28s %-24s %8s %8s %8s\n' config object text ram stack
+awk '{ printf "%-28s %-24s %8s %8s %8s\n", $1, $2, $3, $4, $5 }' "$report"
+
+if [ $update -eq 1 ]; then
+    {
+        echo "# config object max_text max_ram max_stack; '-' is not checked."
+        echo "# Regenerate with: make footprint FOOTPRINT_FLAGS=--update"
+        cat "$report"
+    } > "$BUDGET"
+    echo "footprint: wrote $BUDGET"
+    exit 0
+fi
+
+if [ ! -f "$BUDGET" ]; then
+    echo "footprint: no $BUDGET, nothing to compare against" >&2
+    exit 0
+fi
+
+# Anything above its budget fails the target. Missing entries are only listed.
+awk '
+    FNR == NR { if ($1 !~ /^#/) budget[$1 " " $2] = $3 " " $4 " " $5; next }
+    {
+        key = $1 " " $2
+        if (!(key in budget)) { print "footprint: no budget for " key; next }
+        split(budget[key], b, " ")
+        split("text ram stack", what, " ")
+        for (i = 1; i <= 3; i++) {
+            have = $(i + 2); max = b[i]
+            sub(/\+$/, "", have); sub(/\+$/, "", max)
+            if (max != "-" && have != "-" && have + 0 > max + 0) {
+                print "footprint: " key " " what[i] " " have " over budget " max
+                over = 1
+            }
+        }
+    }
+    END { exit over }
+' "$BUDGET" "$report" || { echo "footprint: over budget" >&2; exit 1; }
+echo "footprint: within budget"
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+static bool make_address(const char *path, struct sockaddr_un *addr);
+
+int handoffListen(const char *path) {
+
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!make_address(path, &addr)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Could not create hand-off socket.");
+        return -1;
+    }
+
+    unlink(path); //stale socket from a previous run
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 1)) {
+        perror("Could not listen on hand-off socket.");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoffPoll(int listenFd) {
+
+    int sock;
+
+    if (listenFd == -1) {
+        return -1;
+    }
+    sock = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+        return -1; //EAGAIN: nobody is waiting.
+    }
+    //the transfer itself is blocking, both sides are local.
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    return sock;
+}
+
+bool handoffSend(int sock, int fd, const void *pState, size_t stateLen) {
+
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t rc;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = (void*) pState;
+    iov.iov_len = stateLen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (rc != (ssize_t) stateLen) {
+        perror("Hand-off send failed.");
+    }
+    close(sock);
+    return rc == (ssize_t) stateLen;
+}
+
+int handoffReceive(const char *path, int *pFd, void *pState, size_t stateLen) {
+
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(sizeof(int))];
+    size_t received = 0;
+    ssize_t rc;
+    int sock;
+
+    *pFd = -1;
+    if (!make_address(path, &addr)) {
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+        perror("Could not reach the running client for hand-off.");
+        if (sock != -1) {
+            close(sock);
+        }
+        return -1;
+    }
+
+    //the fd arrives with the first bytes; the rest of the state may follow.
+    while (received < stateLen) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (char*) pState + received;
+        iov.iov_len = stateLen - received;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            break;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(pFd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        received += rc;
+    }
+    close(sock);
+
+    if (*pFd == -1) {
+        errno = EBADF;
+        perror("Hand-off did not carry a file descriptor.");
+        return -1;
+    }
+    return (int) received;
+}
+
+void handoffClose(int listenFd, const char *path) {
+    if (listenFd != -1) {
+        close(listenFd);
+        unlink(path);
+    }
+}
+
+bool make_address(const char *path, struct sockaddr_un *addr) {
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        perror("Hand-off socket path too long.");
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
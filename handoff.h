@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Process hand-off over a UNIX socket.
+ * The running client listens on a socket path. Its replacement connects
+ * and receives the open serial device (SCM_RIGHTS) along with an opaque
+ * state blob, so it can carry on without reconnecting.
+ */
+
+//Old process: create a non-blocking listening socket at path. Returns -1 on failure.
+int handoffListen(const char *path);
+
+//Old process: returns a connected socket if a replacement is waiting, -1 otherwise.
+int handoffPoll(int listenFd);
+
+//Old process: pass fd and state over sock, then close sock.
+bool handoffSend(int sock, int fd, const void *pState, size_t stateLen);
+
+//New process: connect to path and receive fd and state (up to stateLen bytes).
+//Returns the state length received, or -1 on failure.
+int handoffReceive(const char *path, int *pFd, void *pState, size_t stateLen);
+
+//Close the listening socket and remove path.
+void handoffClose(int listenFd, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //HANDOFF_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <time.h>
+#include "lock_stats.h"
+#include "metrics.h"
+
+#if configLOCK_STATS
+
+static statMutex_t *locks = NULL; //every lock used so far, newest first
+static pthread_mutex_t locks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dump_locks(int fd);
+static const int provider_registered = metricsRegister("locks", dump_locks);
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int bucket(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < LOCK_STATS_BUCKETS ? b : LOCK_STATS_BUCKETS - 1;
+}
+
+//called with m held, so the counters need no atomics.
+static void acquired(statMutex_t *m, uint64_t wait_ns, bool contended) {
+
+    if (!m->registered) {
+        pthread_mutex_lock(&locks_lock);
+        m->next = locks;
+        locks = m;
+        pthread_mutex_unlock(&locks_lock);
+        m->registered = true;
+    }
+    m->acquisitions++;
+    if (contended) {
+        m->contended++;
+    }
+    m->wait_hist[bucket(wait_ns)]++;
+    m->acquired_ns = now_ns();
+}
+
+int statMutexLock(statMutex_t *m) {
+
+    uint64_t start;
+    int rc;
+
+    if (!pthread_mutex_trylock(&m->mutex)) {
+        acquired(m, 0, false);
+        return 0;
+    }
+    start = now_ns();
+    rc = pthread_mutex_lock(&m->mutex);
+    if (!rc) {
+        acquired(m, now_ns() - start, true);
+    }
+    return rc;
+}
+
+int statMutexTrylock(statMutex_t *m) {
+
+    int rc = pthread_mutex_trylock(&m->mutex);
+    if (!rc) {
+        acquired(m, 0, false);
+    }
+    return rc;
+}
+
+int statMutexUnlock(statMutex_t *m) {
+
+    m->hold_hist[bucket(now_ns() - m->acquired_ns)]++;
+    return pthread_mutex_unlock(&m->mutex);
+}
+
+static void dump_histogram(int fd, const char *what, const uint32_t *hist) {
+
+    dprintf(fd, "  %s", what);
+    for (int i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        if (hist[i]) {
+            dprintf(fd, " <2^%d:%u", i, hist[i]);
+        }
+    }
+    dprintf(fd, "  (ns)\n");
+}
+
+void dump_locks(int fd) {
+
+    (void) provider_registered;
+    pthread_mutex_lock(&locks_lock);
+    for (statMutex_t *m = locks; m; m = m->next) {
+        dprintf(fd, "%s acquisitions %llu contended %llu\n", m->name,
+                (unsigned long long) m->acquisitions, (unsigned long long) m->contended);
+        dump_histogram(fd, "wait", m->wait_hist);
+        dump_histogram(fd, "hold", m->hold_hist);
+    }
+    pthread_mutex_unlock(&locks_lock);
+}
+
+#endif //configLOCK_STATS
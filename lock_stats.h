@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Instrumented mutex, built in with `make LOCK_STATS=1`.
+ * statMutex_t wraps a pthread mutex. With configLOCK_STATS each lock counts
+ * acquisitions and contended acquisitions (the lock was already held) and
+ * keeps log2 histograms of the time spent waiting for it and holding it.
+ * Locks show up under "locks" in metricsDump() after their first use.
+ * Without LOCK_STATS the wrappers are plain pthread calls.
+ * Use &lock.mutex where a raw mutex is needed, e.g. pthread_cond_wait();
+ * time spent in the wait is then counted as hold time.
+ */
+
+#ifndef configLOCK_STATS
+    #define configLOCK_STATS 0
+#endif
+
+#define LOCK_STATS_BUCKETS 32 //bucket i counts times below 2^i ns
+
+typedef struct statMutex {
+    pthread_mutex_t mutex;
+#if configLOCK_STATS
+    const char *name;
+    struct statMutex *next;
+    bool registered;
+    uint64_t acquired_ns;  //when the current holder got the lock
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint32_t wait_hist[LOCK_STATS_BUCKETS];
+    uint32_t hold_hist[LOCK_STATS_BUCKETS];
+#endif
+} statMutex_t;
+
+#if configLOCK_STATS
+
+#define STAT_MUTEX_INITIALIZER(lockName) { PTHREAD_MUTEX_INITIALIZER, lockName }
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int statMutexLock(statMutex_t *m);
+int statMutexTrylock(statMutex_t *m);
+int statMutexUnlock(statMutex_t *m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+
+#define STAT_MUTEX_INITIALIZER(lockName) { PTHREAD_MUTEX_INITIALIZER }
+
+static inline int statMutexLock(statMutex_t *m) { return pthread_mutex_lock(&m->mutex); }
+static inline int statMutexTrylock(statMutex_t *m) { return pthread_mutex_trylock(&m->mutex); }
+static inline int statMutexUnlock(statMutex_t *m) { return pthread_mutex_unlock(&m->mutex); }
+
+#endif //configLOCK_STATS
+
+#endif //LOCK_STATS_H
@@ -27,8 +27,8 @@
  *
  * The example shown below uses this API to create MQTT messages and
  * send them over the connection established using transport_esp8266
- * transport layer. The example is single threaded and uses statically
- * allocated memory;
+ * transport layer. The example is single threaded, unless configFULL_DUPLEX
+ * is set (see core_mqtt_config.h), and uses statically allocated memory;
  *
  * !!! NOTE !!!
  * This MQTT demo does not authenticate the server nor the client.
@@ -55,12 +55,34 @@
 #include <pthread.h>
 
 #include "core_mqtt.h"
+#include "core_mqtt_state.h"
 #include "transport_esp8266.h"
+#include "handoff.h"
+#include "flight_recorder.h"
+#include "alloc_track.h"
+#include "metrics.h"
+#include "thread_stats.h"
+#include "periodic.h"
+#include "mqtt_rpc.h"
+#include "arena.h"
+#include "topic_table.h"
 
 //MQTT Client configuration:
-#define configMQTT_BROKER_ENDPOINT                "192.168.0.235"
-#define configMQTT_BROKER_PORT                    "1883"
-#define configNETWORK_BUFFER_SIZE                 128U
+#define configMQTT_BROKER_ENDPOINTS               { "192.168.0.235" } /* Probed at start-up, the fastest is used. */
+#define configMQTT_BROKER_STANDBY                 0     /* 1 keeps a TCP link to the next best broker open, for failover. */
+#define configMQTT_BROKER_TLS                     0     /* 1 connects over TLS, the module does the handshake. */
+#if configMQTT_BROKER_TLS
+  #define configMQTT_BROKER_PORT                  "8883"
+#else
+  #define configMQTT_BROKER_PORT                  "1883"
+#endif
+#define configTLS_BUFFER_SIZE                     4096U /* Module TLS buffer, 2048 to 4096. */
+#if configMQTT_BROKER_STANDBY && configMQTT_BROKER_TLS
+  #error "The module has a single SSL link, no standby link over TLS."
+#endif
+#ifndef configNETWORK_BUFFER_SIZE                 /* Overridable, see footprint.sh. */
+  #define configNETWORK_BUFFER_SIZE               128U
+#endif
 #define configCLIENT_IDENTIFIER                   "esp8266-linux_client"
 #define configRETRY_MAX_ATTEMPTS                  5U
 #define configRETRY_MAX_BACKOFF_DELAY_MS          1000U
@@ -73,9 +95,24 @@
 #define configOUTGOING_PUBLISH_RECORD_LEN         10U
 #define configINCOMING_PUBLISH_RECORD_LEN         10U
 #define configPROCESS_LOOP_TIMEOUT_MS             5000U
-#define configDELAY_BETWEEN_PUBLISHES_S           1
+#define configPROCESS_LOOP_MIN_MS                 200U  /* Least receive processing after each publish, even if the next is due. */
+#define configPUBLISH_PERIOD_MS                   1000U /* Every topic publishes on this period, phases spread over it. */
 #define configDELAY_BETWEEN_DEMO_ITERATIONS_S     5
+#define configDRAIN_DEADLINE_MS                   5000U /* On exit, time allowed for in-flight QoS exchanges to complete. */
 #define configCONNACK_RECV_TIMEOUT_MS             2000U
+#define configTRANSPORT_SEND_LINGER_MS            0U    /* 0 disables send coalescing. */
+#define configTRANSPORT_ACK_HOLD_MS               0U    /* 0 sends each ack on its own. */
+#define configTRANSPORT_FRAMED_RECV               true  /* Hand coreMQTT whole packets. */
+#define configTRANSPORT_CALIBRATE                 0     /* 1 measures the link after CONNACK and tunes sends. */
+#define configTRANSPORT_CALIBRATION_CACHE         "/tmp/esp8266_link.cal"
+#define configRPC_REQUEST_TOPIC                   configTOPIC_PREFIX "/rpc/request"
+#define configRPC_REPLY_TOPIC                     configTOPIC_PREFIX "/rpc/reply/" configCLIENT_IDENTIFIER
+#define configRPC_DEMO_CALLS                      0U    /* RPCs to ourselves per iteration, all in flight at once; 0 skips. */
+#define configRPC_TIMEOUT_MS                      5000U
+#define configRECEIVE_IDLE_DELAY_US               1000U /* Receive thread back-off when idle. */
+#define configHANDOFF_SOCKET_PATH                 "/tmp/esp8266_mqtt_client.sock"
+#define configFLIGHT_RECORDER_PATH                "/tmp/esp8266_mqtt_client.flight"
+#define configMETRICS_SOCKET_PATH                 "/tmp/esp8266_mqtt_client.metrics" /* Read by `monitor`. */
 
 /* Not needed for transport_esp8266...
  *
@@ -87,8 +124,96 @@
  *
  */
 
-/* Varible to control run_thread */
-static bool stop = false;
+/* Varible to control run_thread. Once set, the demo publishes nothing new,
+ * drains what is in flight and disconnects, see prvDrain(). */
+static volatile bool stop = false;
+
+/**
+ * @brief Broker endpoints, all on #configMQTT_BROKER_PORT, and how each did
+ * in the last probe, see prvProbeBrokers(). ulBrokerRank lists them fastest
+ * first, unreachable ones last. lStandbyBroker is where the standby link
+ * goes, -1 without one.
+ */
+typedef struct brokerProbe {
+  uint32_t ulTcpMs;     /* CIPSTART */
+  uint32_t ulConnAckMs; /* CONNECT to CONNACK */
+  bool xReachable;
+} brokerProbe_t;
+
+static const char *const pcBrokerHosts[] = configMQTT_BROKER_ENDPOINTS;
+#define brokerCOUNT    ( sizeof( pcBrokerHosts ) / sizeof( pcBrokerHosts[ 0 ] ) )
+static brokerProbe_t xBrokerProbes[brokerCOUNT];
+static uint32_t ulBrokerRank[brokerCOUNT];
+static bool xBrokersRanked = false;
+static uint32_t ulActiveBroker = 0;
+static int32_t lStandbyBroker = -1;
+static uint32_t ulFailovers = 0, ulStandbyFailovers = 0;
+
+/**
+ * @brief Process hand-off. A replacement started with --takeover connects to
+ * #configHANDOFF_SOCKET_PATH; the running client passes it the serial device,
+ * the transport state and the MQTT session state between two publish cycles,
+ * then exits. The replacement resumes the demo without reconnecting.
+ */
+static bool xTakeover = false;
+static int iHandoffListenFd = -1;
+
+typedef struct demoHandoffState {
+  uint8_t ucTransportState[ESP8266_HANDOFF_STATE_LEN];
+  size_t xTransportStateLen;
+  uint32_t ulPublishCount;
+  uint16_t usNextPacketId;
+  uint16_t usKeepAliveIntervalSec;
+  bool xWaitingForPingResp;
+  MQTTPubAckInfo_t xOutgoingPublishRecords[configOUTGOING_PUBLISH_RECORD_LEN];
+  MQTTPubAckInfo_t xIncomingPublishRecords[configINCOMING_PUBLISH_RECORD_LEN];
+  MQTTSubAckStatus_t xSubAckStatus[configTOPIC_COUNT];
+  brokerProbe_t xBrokerProbes[brokerCOUNT];
+  uint32_t ulBrokerRank[brokerCOUNT];
+  uint32_t ulActiveBroker;
+  int32_t lStandbyBroker;
+  size_t xBufferIndex;
+  uint8_t ucBuffer[configNETWORK_BUFFER_SIZE];
+} demoHandoffState_t;
+
+/**
+ * @brief Full-duplex mode: the thread running #MQTT_ReceiveLoop, and the
+ * number of responses (SUBACK, UNSUBACK, publish echoes) the demo is still
+ * waiting for. The event callback signals #xResponseCond on every packet.
+ */
+#if configFULL_DUPLEX
+static pthread_t xReceiveThread;
+static volatile bool xReceiveRun = false;
+#endif
+static pthread_mutex_t xResponseMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xResponseCond = PTHREAD_COND_INITIALIZER;
+static uint32_t ulResponsesOutstanding = 0;
+
+/**
+ * @brief Packets handed to the event callback, tells the receive loops
+ * whether a pass found work. Only written by the thread running the loop.
+ */
+static volatile uint32_t ulPacketsReceived = 0;
+static threadStats_t *pxDemoThreadStats = NULL; /* run_thread, see thread_stats.h */
+
+/**
+ * @brief MQTT connections made, fresh or taken over, since start-up; every
+ * one after the first is a reconnect. Reported by prvDumpSession().
+ */
+static uint32_t ulConnections = 0;
+
+/**
+ * @brief Publishes skipped because every outgoing publish record was still
+ * in use, the broker not keeping up. Reported by prvDumpSession().
+ */
+static uint32_t ulPublishesSkipped = 0;
+
+/**
+ * @brief Publish to echo latency per iteration, in milliseconds. Measured in
+ * both modes so the effect of configFULL_DUPLEX can be compared.
+ */
+static uint32_t ulPublishSentMs[configTOPIC_COUNT];
+static uint32_t ulLatencyMinMs, ulLatencyMaxMs, ulLatencySumMs, ulLatencySamples;
 
 /**
  * @brief Static buffer used to hold MQTT messages being sent and received.
@@ -123,10 +248,19 @@ static uint16_t usSubscribePacketIdentifier;
 static uint16_t usUnsubscribePacketIdentifier;
 
 /**
- * @brief A pair containing a topic filter and its SUBACK status.
+ * @brief Packet Identifiers of the RPC demo's subscribe and unsubscribe
+ * requests, see #prvRpcDemo; their acks are not for the demo topics.
+ */
+static uint16_t usRpcSubscribePacketIdentifier;
+static uint16_t usRpcUnsubscribePacketIdentifier;
+
+/**
+ * @brief A pair containing a topic filter and its SUBACK status. The filter
+ * is interned, see topic_table.h; the demo topics have ids 0 to
+ * configTOPIC_COUNT - 1, so an id indexes the arrays below.
  */
 typedef struct topicFilterContext {
-  uint8_t pcTopicFilter[configTOPIC_BUFFER_SIZE];
+  topicId_t usTopicId;
   MQTTSubAckStatus_t xSubAckStatus;
 } topicFilterContext_t;
 
@@ -136,6 +270,12 @@ typedef struct topicFilterContext {
  */
 static topicFilterContext_t xTopicFilterContext[configTOPIC_COUNT];
 
+/**
+ * @brief Interned RPC topics, incoming publishes are routed by id.
+ */
+static topicId_t usRpcRequestTopicId = TOPIC_ID_NONE;
+static topicId_t usRpcReplyTopicId = TOPIC_ID_NONE;
+
 /** @brief Static buffer used to hold MQTT messages being sent and received. */
 static MQTTFixedBuffer_t xBuffer = {
   ucSharedBuffer,
@@ -146,19 +286,29 @@ static MQTTFixedBuffer_t xBuffer = {
  * @brief Array to track the outgoing publish records for outgoing publishes
  * with QoS > 0.
  *
- * This is passed into #MQTT_InitStatefulQoS to allow for QoS > 0.
+ * This is passed into #MQTT_InitStatefulQoS to allow for QoS > 0. It lives
+ * in the connection arena, see prvInitializeMQTTContext().
  *
  */
-static MQTTPubAckInfo_t pOutgoingPublishRecords[configOUTGOING_PUBLISH_RECORD_LEN];
+static MQTTPubAckInfo_t *pOutgoingPublishRecords;
 
 /**
  * @brief Array to track the incoming publish records for incoming publishes
  * with QoS > 0.
  *
- * This is passed into #MQTT_InitStatefulQoS to allow for QoS > 0.
+ * This is passed into #MQTT_InitStatefulQoS to allow for QoS > 0. It lives
+ * in the connection arena, see prvInitializeMQTTContext().
+ *
+ */
+static MQTTPubAckInfo_t *pIncomingPublishRecords;
+
+/**
+ * @brief Initialize the MQTT context with the esp8266 transport and the
+ * static buffers of this demo.
  *
+ * @param[in, out] pxMQTTContext MQTT context pointer.
  */
-static MQTTPubAckInfo_t pIncomingPublishRecords[configINCOMING_PUBLISH_RECORD_LEN];
+static void prvInitializeMQTTContext(MQTTContext_t *pxMQTTContext);
 
 /**
  * @brief Sends an MQTT Connect packet over the already connected TLS over TCP connection.
@@ -166,8 +316,16 @@ static MQTTPubAckInfo_t pIncomingPublishRecords[configINCOMING_PUBLISH_RECORD_LE
  * @param[in, out] pxMQTTContext MQTT context pointer.
  * @param[in] xNetworkContext network context.
  */
-static void prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext,
-                                              NetworkContext_t *pxNetworkContext);
+static MQTTStatus_t prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext,
+                                                      NetworkContext_t *pxNetworkContext);
+
+/**
+ * @brief Fill in the CONNECT fields of this demo: clean session, client
+ * identifier and keep-alive.
+ *
+ * @param[out] pxConnectInfo Connect info to fill in.
+ */
+static void prvInitializeConnectInfo(MQTTConnectInfo_t *pxConnectInfo);
 
 /**
  * @brief Function to update variable #Context with status
@@ -188,11 +346,14 @@ static void prvUpdateSubAckStatus(MQTTPacketInfo_t *pxPacketInfo);
 static void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext);
 
 /**
- * @brief Publishes a message configMESSAGE on mqttexampleTOPIC topic.
+ * @brief Publishes a message configMESSAGE on one of the topics.
  *
  * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] ulTopicCount Index of the topic in xTopicFilterContext.
+ *
+ * @return MQTTSuccess, or MQTTSendFailed if the link went down.
  */
-static void prvMQTTPublishToTopics(MQTTContext_t *pxMQTTContext);
+static MQTTStatus_t prvMQTTPublishToTopic(MQTTContext_t *pxMQTTContext, uint32_t ulTopicCount);
 
 /**
  * @brief Unsubscribes from the previously subscribed topic as specified
@@ -226,8 +387,9 @@ static void prvMQTTProcessResponse(MQTTPacketInfo_t *pxIncomingPacket,
  *
  * @param[in] pxPublishInfo is a pointer to structure containing deserialized
  * Publish message.
+ * @param[in] usTopicId Interned id of its topic, #TOPIC_ID_NONE if unknown.
  */
-static void prvMQTTProcessIncomingPublish(MQTTPublishInfo_t *pxPublishInfo);
+static void prvMQTTProcessIncomingPublish(MQTTPublishInfo_t *pxPublishInfo, topicId_t usTopicId);
 
 /**
  * @brief The application callback function for getting the incoming publishes,
@@ -254,10 +416,158 @@ static MQTTStatus_t prvProcessLoopWithTimeout(MQTTContext_t *pMqttContext,
                                               uint32_t ulTimeoutMs);
 
 /**
- * @brief Initialize the topic filter string and SUBACK buffers.
+ * @brief Intern the demo and RPC topics, and initialize the SUBACK statuses.
  */
 static void prvInitializeTopicBuffers(void);
 
+/**
+ * @brief Start and stop the full-duplex receive thread. The receive thread
+ * drives #MQTT_ReceiveLoop and keeps the connection alive, while the demo
+ * thread publishes concurrently.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+#if configFULL_DUPLEX
+static void prvStartReceiveThread(MQTTContext_t *pxMQTTContext);
+static void prvStopReceiveThread(void);
+static void *prvReceiveTask(void *args);
+#endif
+
+/**
+ * @brief Account for responses the demo expects from the broker, and for
+ * one that has arrived.
+ */
+static void prvExpectResponses(uint32_t ulCount);
+static void prvResponseReceived(void);
+
+/**
+ * @brief Print and reset the publish to echo latency statistics.
+ */
+static void prvReportLatency(void);
+
+/**
+ * @brief Answer an RPC request on #configRPC_REQUEST_TOPIC, see mqtt_rpc.h.
+ *
+ * @param[in] pxPublishInfo Incoming publish on that topic.
+ *
+ * @return true if it was a well-formed request.
+ */
+static bool prvServeRpcRequest(MQTTPublishInfo_t *pxPublishInfo);
+
+#if configRPC_DEMO_CALLS
+/**
+ * @brief Send #configRPC_DEMO_CALLS requests to our own request topic, all
+ * in flight at once, then collect the replies.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvRpcDemo(MQTTContext_t *pxMQTTContext);
+#endif
+
+/**
+ * @brief Shutdown drain. With no new publishes, push out everything the
+ * transport holds and process the link until every outgoing and incoming QoS
+ * exchange has completed, or until the deadline. Whatever is left is
+ * reported as undelivered.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] ulDeadlineMs Time allowed, in milliseconds.
+ *
+ * @return Number of QoS exchanges left undelivered.
+ */
+static uint32_t prvDrain(MQTTContext_t *pxMQTTContext, uint32_t ulDeadlineMs);
+
+/**
+ * @brief Count the publish records holding a QoS exchange in flight.
+ * Caller must hold the MQTT state lock.
+ *
+ * @param[in] pxRecords Outgoing or incoming publish records.
+ * @param[in] ulLength Number of records.
+ *
+ * @return Records in use.
+ */
+static uint32_t prvCountRecordsInUse(const MQTTPubAckInfo_t *pxRecords, uint32_t ulLength);
+
+/**
+ * @brief Metrics provider for the session: connections made and the QoS
+ * window in use, see metrics.h.
+ *
+ * @param[in] fd File descriptor to write to.
+ */
+static void prvDumpSession(int fd);
+static const int iSessionMetrics = metricsRegister("session", prvDumpSession);
+
+/**
+ * @brief Give the connection's session state back to the arena. Every
+ * record pointer is cleared first, so the metrics see no stale records.
+ */
+static void prvReleaseSession(void);
+
+/**
+ * @brief Probe every broker endpoint: open the link, send CONNECT and time
+ * the CONNACK, then DISCONNECT. Ranks them by the sum, prints the timings.
+ * The serial port and module setup stay up from one probe to the next. With
+ * a single endpoint there is nothing to choose, and nothing is probed.
+ */
+static void prvProbeBrokers(void);
+
+/**
+ * @brief Connect the link and MQTT to the best ranked broker that accepts,
+ * skipping ulSkipBroker.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] ulSkipBroker Broker not to try, brokerCOUNT tries them all.
+ *
+ * @return true once connected, false if no broker could be reached.
+ */
+static bool prvConnectToBestBroker(MQTTContext_t *pxMQTTContext, uint32_t ulSkipBroker);
+
+/**
+ * @brief Move a broker that failed to the end of the ranking and mark it
+ * unreachable, keeping the order of the others. It is still tried last.
+ *
+ * @param[in] ulBroker Index of the broker in pcBrokerHosts.
+ */
+static void prvDemoteBroker(uint32_t ulBroker);
+
+#if configMQTT_BROKER_STANDBY
+/**
+ * @brief Open the standby link to the next best broker, or to the same
+ * broker if it is the only one reachable.
+ */
+static void prvOpenStandby(void);
+#endif
+
+/**
+ * @brief The broker or the link to it is gone: connect to the standby
+ * link's broker, without the TCP connect if the standby link is still
+ * open, else to the next best broker from scratch, and subscribe again.
+ * QoS exchanges in flight with the old broker are lost with its session.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvFailover(MQTTContext_t *pxMQTTContext);
+
+/**
+ * @brief If a replacement process is waiting on the hand-off socket, pass
+ * it the connection and exit. Returns if nobody is waiting, or the hand-off
+ * failed and this process keeps the connection.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] ulPublishCount Publish cycles already completed.
+ */
+static void prvHandoffIfRequested(MQTTContext_t *pxMQTTContext, uint32_t ulPublishCount);
+
+/**
+ * @brief Take over the connection from the running client.
+ *
+ * @param[out] pxMQTTContext MQTT context pointer.
+ * @param[out] pulPublishCount Publish cycles already completed.
+ *
+ * @return true if the session was resumed.
+ */
+static bool prvResumeFromHandoff(MQTTContext_t *pxMQTTContext, uint32_t *pulPublishCount);
+
 /* Initialization function */
 static void initialize();
 
@@ -269,6 +579,7 @@ static void *run_thread(void *args);
 
 int main(int argc, char * argv[]) {
 
+  xTakeover = (argc > 1) && (strcmp(argv[1], "--takeover") == 0);
   initialize();
   pthread_t run_thread_id;
   if (pthread_create(&run_thread_id, NULL, &run_thread, NULL)) {
@@ -280,18 +591,36 @@ int main(int argc, char * argv[]) {
   getchar();
   stop = true;
   pthread_join(run_thread_id, NULL);
+  metricsServeStop();
   return 0;
 }
 
 void *run_thread(void *args) {
+  pxDemoThreadStats = threadStatsRegister("demo");
   while (!stop) {
     loop();
   }
+  threadStatsUnregister(pxDemoThreadStats);
   return NULL;
 }
 
 void initialize() {
   ulGlobalEntryTimeMs = std::chrono::system_clock::now();
+  /* Dumped on crashes and asserts, and on demand with SIGUSR1. */
+  flightRecorderInstall(configFLIGHT_RECORDER_PATH);
+  /* Live counters for `monitor`, see README. */
+  (void) metricsServe(configMETRICS_SOCKET_PATH);
+  esp8266AT_SetSendLinger(configTRANSPORT_SEND_LINGER_MS);
+  esp8266AT_SetAckHold(configTRANSPORT_ACK_HOLD_MS);
+  esp8266AT_SetFramedRecv(configTRANSPORT_FRAMED_RECV);
+  (void) esp8266AT_SetSSL(configMQTT_BROKER_TLS, configTLS_BUFFER_SIZE);
+  (void) esp8266AT_SetStandby(configMQTT_BROKER_STANDBY);
+
+  /* One periodic release per topic, in topic order, named by the interned topic. */
+  prvInitializeTopicBuffers();
+  for (uint32_t ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
+    (void) periodicAdd(topicName(xTopicFilterContext[ulTopicCount].usTopicId, NULL), configPUBLISH_PERIOD_MS);
+  }
 }
 
 void loop() {
@@ -299,65 +628,143 @@ void loop() {
   static const uint32_t ulMaxPublishCount = configMAX_PUBLUSH_COUNT;
   static MQTTContext_t xMQTTContext = {0};
   static MQTTStatus_t xMQTTStatus;
-  static esp8266TransportStatus_t xNetworkStatus;
+  uint32_t ulSliceMs;
 
   std::cout << "----------STARTING DEMO----------" << std::endl;
   prvInitializeTopicBuffers();
-  xNetworkStatus = esp8266AT_Connect(configMQTT_BROKER_ENDPOINT, configMQTT_BROKER_PORT);
-  if (xNetworkStatus != ESP8266_TRANSPORT_SUCCESS) {
-    std::cerr << "Failed to initialise network." << std::endl;
-    exit(-1);
-  }
+  ulResponsesOutstanding = 0;
+  ulPublishCount = 0;
 
-  std::cout << "Creating an MQTT connection to " << configMQTT_BROKER_ENDPOINT "." << std::endl;
-  prvCreateMQTTConnectionWithBroker(&xMQTTContext, NULL);
-
-  /**************************** Subscribe. ******************************/
+  if (!xTakeover || !prvResumeFromHandoff(&xMQTTContext, &ulPublishCount)) {
+    /* Probed once; failovers only move the failed broker down the ranking. */
+    if (!xBrokersRanked) {
+      prvProbeBrokers();
+    }
+    if (!prvConnectToBestBroker(&xMQTTContext, brokerCOUNT)) {
+      std::cerr << "Failed to initialise network." << std::endl;
+      exit(-1);
+    }
+#if configTRANSPORT_CALIBRATE
+    /* Before anything else reads the link, the PINGRESPs are consumed by the transport. */
+    (void) esp8266AT_Calibrate(configTRANSPORT_CALIBRATION_CACHE, false);
+#endif
+#if configFULL_DUPLEX
+    prvStartReceiveThread(&xMQTTContext);
+#endif
+#if configMQTT_BROKER_STANDBY
+    prvOpenStandby();
+#endif
+
+    /**************************** Subscribe. ******************************/
+
+    /* If the server rejected the subscription request, attempt to resubscribe to the
+     * topic. Attempts are made according to the exponential backoff retry strategy
+     * implemented in BackoffAlgorithm. */
+    prvMQTTSubscribeWithBackoffRetries(&xMQTTContext);
+  }
+  xTakeover = false;
+  ulConnections++;
 
-  /* If the server rejected the subscription request, attempt to resubscribe to the
-   * topic. Attempts are made according to the exponential backoff retry strategy
-   * implemented in BackoffAlgorithm. */
-  prvMQTTSubscribeWithBackoffRetries(&xMQTTContext);
+  /* From here on a replacement process may take the connection over. */
+  iHandoffListenFd = handoffListen(configHANDOFF_SOCKET_PATH);
 
   /**************************** Publish and Keep-Alive Loop. ******************************/
 
-  /* Publish messages with QoS2, and send and process keep-alive messages. */
-  for (ulPublishCount = 0; ulPublishCount < ulMaxPublishCount; ulPublishCount++) {
-    prvMQTTPublishToTopics(&xMQTTContext);
+  /* Publish messages with QoS2, and send and process keep-alive messages.
+   * Each topic is published on its own absolute schedule, configPUBLISH_PERIOD_MS
+   * apart, so the time spent on the link does not shift the next publish. */
+  periodicStart();
+  for (; (ulPublishCount < ulMaxPublishCount) && !stop; ulPublishCount++) {
+    for (ulTopicCount = 0; (ulTopicCount < configTOPIC_COUNT) && !stop; ulTopicCount++) {
+      xMQTTStatus = prvMQTTPublishToTopic(&xMQTTContext, (uint32_t) periodicWait());
+
+      /* Process incoming publish echo, until the next topic is due. Since the
+       * application subscribed and published to the same topic, the broker will
+       * send the incoming publish message back to the application. A release
+       * that is already due still gets configPROCESS_LOOP_MIN_MS, so on a slow
+       * link the echoes and QoS handshakes are not starved by the publishes;
+       * the releases this delays are counted as late by the scheduler. */
+      if ((xMQTTStatus == MQTTSuccess) || (xMQTTStatus == MQTTNoMemory)) {
+        std::cout << "Attempt to receive publishes from broker" << std::endl;
+        ulSliceMs = periodicTimeToNextMs();
+        if (ulSliceMs < configPROCESS_LOOP_MIN_MS) {
+          ulSliceMs = configPROCESS_LOOP_MIN_MS;
+        }
+        xMQTTStatus = prvProcessLoopWithTimeout(&xMQTTContext, ulSliceMs);
+      }
+      if ((xMQTTStatus == MQTTSendFailed) || (xMQTTStatus == MQTTRecvFailed) || !esp8266AT_LinkUp()) {
+        prvFailover(&xMQTTContext);
+        continue;
+      }
+      assert(xMQTTStatus == MQTTSuccess);
+    }
 
-    /* Process incoming publish echo. Since the application subscribed and published
-     * to the same topic, the broker will send the incoming publish message back
-     * to the application. */
-    std::cout << "Attempt to receive publishes from broker" << std::endl;
-    xMQTTStatus = prvProcessLoopWithTimeout(&xMQTTContext, configPROCESS_LOOP_TIMEOUT_MS);
-    assert(xMQTTStatus == MQTTSuccess);
+    prvHandoffIfRequested(&xMQTTContext, ulPublishCount + 1);
+#if configMQTT_BROKER_STANDBY
+    /* Brokers drop links that send no CONNECT for a while; keep one open. */
+    if (!esp8266AT_StandbyUp()) {
+      prvOpenStandby();
+    }
+#endif
 
-    /* Leave connection idle for some time. */
-    std::cout << "Keeping Connection Idle..." << std::endl;
-    sleep(configDELAY_BETWEEN_PUBLISHES_S);
+#if configALLOC_TRACKING
+    /* Everything has run once; from here on the hot paths must not allocate. */
+    if (ulPublishCount == 0) {
+      allocTrackMark();
+    }
+#endif
   }
+  prvReportLatency();
+  if (stop) {
+    /* Exiting: deliver what is in flight before the link goes down. */
+    (void) prvDrain(&xMQTTContext, configDRAIN_DEADLINE_MS);
+  }
+#if configRPC_DEMO_CALLS
+  else {
+    prvRpcDemo(&xMQTTContext);
+  }
+#endif
+  metricsDump(STDOUT_FILENO);
+#if configALLOC_TRACKING
+  allocTrackReport();
+  assert(allocTrackSinceMark(ALLOC_SERIAL) == 0);
+  assert(allocTrackSinceMark(ALLOC_TRANSPORT) == 0);
+  assert(allocTrackSinceMark(ALLOC_MQTT) == 0);
+#endif
+  handoffClose(iHandoffListenFd, configHANDOFF_SOCKET_PATH);
+  iHandoffListenFd = -1;
 
   /************************ Unsubscribe from the topic. **************************/
 
-  prvMQTTUnsubscribeFromTopics(&xMQTTContext);
+  /* The session is clean, so on exit the broker drops the subscriptions with
+   * the connection and the UNSUBSCRIBE round trip is skipped. */
+  if (!stop) {
+    prvMQTTUnsubscribeFromTopics(&xMQTTContext);
 
-  /* Process incoming UNSUBACK packet from the broker. */
-  xMQTTStatus = prvProcessLoopWithTimeout(&xMQTTContext, configPROCESS_LOOP_TIMEOUT_MS);
-  assert(xMQTTStatus == MQTTSuccess);
+    /* Process incoming UNSUBACK packet from the broker. */
+    xMQTTStatus = prvProcessLoopWithTimeout(&xMQTTContext, configPROCESS_LOOP_TIMEOUT_MS);
+    assert(xMQTTStatus == MQTTSuccess);
+  }
 
   /**************************** Disconnect. ******************************/
 
   /* Send an MQTT DISCONNECT packet over the already-connected TLS over TCP connection.
    * There is no corresponding response expected from the broker. After sending the
    * disconnect request, the client must close the network connection. */
-  std::cout << "Disconnecting the MQTT connection with " << configMQTT_BROKER_ENDPOINT \
+  std::cout << "Disconnecting the MQTT connection with " << pcBrokerHosts[ulActiveBroker] \
     << "." << std::endl;
+#if configFULL_DUPLEX
+  prvStopReceiveThread();
+#endif
   xMQTTStatus = MQTT_Disconnect(&xMQTTContext);
   assert(xMQTTStatus == MQTTSuccess);
 
   /* Close the network connection.  */
   esp8266AT_Disconnect();
 
+  /* The connection's state goes with it. */
+  prvReleaseSession();
+
   /* Reset SUBACK status for each topic filter after completion of the subscription request cycle. */
   for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
       xTopicFilterContext[ulTopicCount].xSubAckStatus = MQTTSubAckFailure;
@@ -368,14 +775,14 @@ void loop() {
   std::cout << "prvMQTTDemoTask() completed an iteration successfully." << std::endl;
   std::cout << "Demo completed successfully." << std::endl;
   std::cout << "-------DEMO FINISHED-------"  << std::endl;
-  std::cout << "Short delay before starting the next iteration...." << std::endl;
-  sleep(configDELAY_BETWEEN_DEMO_ITERATIONS_S);
+  if (!stop) {
+    std::cout << "Short delay before starting the next iteration...." << std::endl;
+    sleep(configDELAY_BETWEEN_DEMO_ITERATIONS_S);
+  }
 }
 
-void prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext, NetworkContext_t *pxNetworkContext) {
+void prvInitializeMQTTContext(MQTTContext_t *pxMQTTContext) {
   MQTTStatus_t xResult;
-  MQTTConnectInfo_t xConnectInfo;
-  bool xSessionPresent;
   TransportInterface_t xTransport;
 
   /* Fill in Transport Interface send and receive function pointers. */
@@ -384,6 +791,12 @@ void prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext, NetworkCont
   xTransport.recv = esp8266AT_recv;
   xTransport.writev = NULL;
 
+  /* Session state lasts as long as the connection: it comes from the
+   * connection arena, released in one go at disconnect. */
+  pOutgoingPublishRecords = (MQTTPubAckInfo_t *) arenaAlloc(configOUTGOING_PUBLISH_RECORD_LEN * sizeof(MQTTPubAckInfo_t));
+  pIncomingPublishRecords = (MQTTPubAckInfo_t *) arenaAlloc(configINCOMING_PUBLISH_RECORD_LEN * sizeof(MQTTPubAckInfo_t));
+  assert(pOutgoingPublishRecords && pIncomingPublishRecords);
+
   /* Initialize MQTT library. */
   xResult = MQTT_Init(pxMQTTContext, &xTransport, prvGetTimeMs, prvEventCallback, &xBuffer);
   assert(xResult == MQTTSuccess);
@@ -394,6 +807,43 @@ void prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext, NetworkCont
                                  configINCOMING_PUBLISH_RECORD_LEN);
   assert(xResult == MQTTSuccess);
 
+  /* Without a receive thread, waiting for an RPC reply runs the process loop. */
+  if (!mqttRpcInit(pxMQTTContext, usRpcReplyTopicId, configFULL_DUPLEX ? NULL : prvProcessLoopWithTimeout)) {
+    std::cerr << "No room for the RPC table in the connection arena, RPC disabled." << std::endl;
+  }
+}
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext, NetworkContext_t *pxNetworkContext) {
+  MQTTStatus_t xResult;
+  MQTTConnectInfo_t xConnectInfo;
+  bool xSessionPresent;
+
+  prvInitializeMQTTContext(pxMQTTContext);
+  prvInitializeConnectInfo(&xConnectInfo);
+
+  /* Send MQTT CONNECT packet to broker. LWT is not used in this demo, so it
+   * is passed as NULL. */
+  xResult = MQTT_Connect(pxMQTTContext,
+                         &xConnectInfo,
+                         NULL,
+                         configCONNACK_RECV_TIMEOUT_MS,
+                         &xSessionPresent);
+  if (xResult != MQTTSuccess) {
+    std::cerr << "MQTT connection with " << pcBrokerHosts[ulActiveBroker] << " failed with status " \
+      << xResult << "." << std::endl;
+    return xResult;
+  }
+
+  /* Successfully established and MQTT connection with the broker. */
+  std::cout << "An MQTT connection is established with " << pcBrokerHosts[ulActiveBroker] \
+        << "." << std::endl;
+  return MQTTSuccess;
+}
+
+void prvInitializeConnectInfo(MQTTConnectInfo_t *pxConnectInfo) {
+  MQTTConnectInfo_t xConnectInfo;
+
   /* Some fields are not used in this demo so start with everything at 0. */
   (void) memset((void *) &xConnectInfo, 0x00, sizeof(xConnectInfo));
 
@@ -412,19 +862,7 @@ void prvCreateMQTTConnectionWithBroker(MQTTContext_t *pxMQTTContext, NetworkCont
   /* Set MQTT keep-alive period. If the application does not send packets at an interval less than
    * the keep-alive period, the MQTT library will send PINGREQ packets. */
   xConnectInfo.keepAliveSeconds = configKEEP_ALIVE_TIMEOUT_S;
-
-  /* Send MQTT CONNECT packet to broker. LWT is not used in this demo, so it
-   * is passed as NULL. */
-  xResult = MQTT_Connect(pxMQTTContext,
-                         &xConnectInfo,
-                         NULL,
-                         configCONNACK_RECV_TIMEOUT_MS,
-                         &xSessionPresent);
-  assert(xResult == MQTTSuccess);
-
-  /* Successfully established and MQTT connection with the broker. */
-  std::cout << "An MQTT connection is established with " << configMQTT_BROKER_ENDPOINT \
-        << "." << std::endl;
+  *pxConnectInfo = xConnectInfo;
 }
 /*-----------------------------------------------------------*/
 
@@ -462,9 +900,9 @@ void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext) {
 
   /* Populate subscription list. */
   for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-    xMQTTSubscription[ulTopicCount].qos = MQTTQoS2;
-    xMQTTSubscription[ulTopicCount].pTopicFilter = xTopicFilterContext[ulTopicCount].pcTopicFilter;
-    xMQTTSubscription[ulTopicCount].topicFilterLength = (uint16_t) strlen(xTopicFilterContext[ulTopicCount].pcTopicFilter);
+    xMQTTSubscription[ulTopicCount].qos = (MQTTQoS_t) topicQoS(xTopicFilterContext[ulTopicCount].usTopicId);
+    xMQTTSubscription[ulTopicCount].pTopicFilter = topicName(xTopicFilterContext[ulTopicCount].usTopicId,
+                                                             &xMQTTSubscription[ulTopicCount].topicFilterLength);
   }
 
   do {
@@ -475,6 +913,7 @@ void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext) {
      * will expect all the messages it sends to the broker to be sent back to it
      * from the broker. This demo uses QOS2 in Subscribe, therefore, the Publish
      * messages received from the broker will have QOS2. */
+    prvExpectResponses(1);
     xResult = MQTT_Subscribe(pxMQTTContext,
                              xMQTTSubscription,
                              sizeof(xMQTTSubscription) / sizeof(MQTTSubscribeInfo_t),
@@ -482,7 +921,7 @@ void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext) {
     assert(xResult == MQTTSuccess);
 
     for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-      std::cout << "SUBSCRIBE sent for topic " << xTopicFilterContext[ulTopicCount].pcTopicFilter \
+      std::cout << "SUBSCRIBE sent for topic " << topicName(xTopicFilterContext[ulTopicCount].usTopicId, NULL) \
         << " to broker." << std::endl;
     }
 
@@ -516,11 +955,11 @@ void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext) {
         counter--;
         if (!counter) {
           std::cout << "Server rejected subscription request. All retry attempts have exhausted. Topic=" \
-            << xTopicFilterContext[ulTopicCount].pcTopicFilter << "." << std::endl;
+            << topicName(xTopicFilterContext[ulTopicCount].usTopicId, NULL) << "." << std::endl;
         }
         else {
           std::cout << "Server rejected subscription request. Attempting to re-subscribe to topic" \
-            << xTopicFilterContext[ulTopicCount].pcTopicFilter << "." << std::endl;
+            << topicName(xTopicFilterContext[ulTopicCount].usTopicId, NULL) << "." << std::endl;
           /* Backoff before the next re-subscribe attempt. */
           usleep(1000 * usNextRetryBackOff);
         }
@@ -533,38 +972,55 @@ void prvMQTTSubscribeWithBackoffRetries(MQTTContext_t *pxMQTTContext) {
 }
 /*-----------------------------------------------------------*/
 
-void prvMQTTPublishToTopics(MQTTContext_t *pxMQTTContext) {
+MQTTStatus_t prvMQTTPublishToTopic(MQTTContext_t *pxMQTTContext, uint32_t ulTopicCount) {
   MQTTStatus_t xResult;
   MQTTPublishInfo_t xMQTTPublishInfo;
-  uint32_t ulTopicCount;
 
   /***
    * For readability, error handling in this function is restricted to the use of
    * asserts().
    ***/
 
-  for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-    /* Some fields are not used by this demo so start with everything at 0. */
-    (void) memset((void *) &xMQTTPublishInfo, 0x00, sizeof(xMQTTPublishInfo));
+  assert(ulTopicCount < configTOPIC_COUNT);
 
-    /* This demo uses QoS2 */
-    xMQTTPublishInfo.qos = MQTTQoS2;
-    xMQTTPublishInfo.retain = false;
-    xMQTTPublishInfo.pTopicName = xTopicFilterContext[ulTopicCount].pcTopicFilter;
-    xMQTTPublishInfo.topicNameLength = (uint16_t) strlen(xTopicFilterContext[ulTopicCount].pcTopicFilter);
-    xMQTTPublishInfo.pPayload = configMESSAGE;
-    xMQTTPublishInfo.payloadLength = strlen(configMESSAGE);
+  /* Some fields are not used by this demo so start with everything at 0. */
+  (void) memset((void *) &xMQTTPublishInfo, 0x00, sizeof(xMQTTPublishInfo));
 
-    /* Get a unique packet id. */
-    usPublishPacketIdentifier = MQTT_GetPacketId(pxMQTTContext);
+  /* The QoS is the topic's, QoS2 for the demo topics. */
+  xMQTTPublishInfo.qos = (MQTTQoS_t) topicQoS(xTopicFilterContext[ulTopicCount].usTopicId);
+  xMQTTPublishInfo.retain = false;
+  xMQTTPublishInfo.pTopicName = topicName(xTopicFilterContext[ulTopicCount].usTopicId, &xMQTTPublishInfo.topicNameLength);
+  xMQTTPublishInfo.pPayload = configMESSAGE;
+  xMQTTPublishInfo.payloadLength = sizeof(configMESSAGE) - 1;
 
-    std::cout << "Publishing to the MQTT topic " << xTopicFilterContext[ulTopicCount].pcTopicFilter \
-      << "." << std::endl;
+  /* Get a unique packet id. */
+  usPublishPacketIdentifier = MQTT_GetPacketId(pxMQTTContext);
+
+  std::cout << "Publishing to the MQTT topic " << xMQTTPublishInfo.pTopicName \
+    << "." << std::endl;
 
-    /* Send PUBLISH packet. */
+  /* Send PUBLISH packet. The broker echoes it back, as we are subscribed. */
+  prvExpectResponses(1);
+  ulPublishSentMs[ulTopicCount] = prvGetTimeMs();
+  {
+    ALLOC_SCOPE(ALLOC_MQTT);
     xResult = MQTT_Publish(pxMQTTContext, &xMQTTPublishInfo, usPublishPacketIdentifier);
-    assert(xResult == MQTTSuccess);
   }
+  /* A lost link is for the caller to deal with, see prvFailover(). With
+   * every outgoing record in use this release is skipped, the window frees
+   * up as the broker completes the exchanges in flight. */
+  assert((xResult == MQTTSuccess) || (xResult == MQTTSendFailed) || (xResult == MQTTNoMemory));
+  if (xResult == MQTTNoMemory) {
+    prvResponseReceived();
+    ulPublishesSkipped++;
+    std::cout << "Publish to " << xMQTTPublishInfo.pTopicName << " skipped, " \
+      << configOUTGOING_PUBLISH_RECORD_LEN << " publishes in flight." << std::endl;
+    flightRecordf(FR_NOTE, "publish skipped, outgoing records full");
+  }
+  if (xResult == MQTTSuccess) {
+    topicCountOut(xTopicFilterContext[ulTopicCount].usTopicId, xMQTTPublishInfo.payloadLength);
+  }
+  return xResult;
 }
 /*-----------------------------------------------------------*/
 
@@ -578,11 +1034,11 @@ void prvMQTTUnsubscribeFromTopics(MQTTContext_t *pxMQTTContext) {
 
   /* Populate subscription list. */
   for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-    xMQTTSubscription[ulTopicCount].qos = MQTTQoS2;
-    xMQTTSubscription[ulTopicCount].pTopicFilter = xTopicFilterContext[ulTopicCount].pcTopicFilter;
-    xMQTTSubscription[ulTopicCount].topicFilterLength = (uint16_t) strlen(xTopicFilterContext[ulTopicCount].pcTopicFilter);
+    xMQTTSubscription[ulTopicCount].qos = (MQTTQoS_t) topicQoS(xTopicFilterContext[ulTopicCount].usTopicId);
+    xMQTTSubscription[ulTopicCount].pTopicFilter = topicName(xTopicFilterContext[ulTopicCount].usTopicId,
+                                                             &xMQTTSubscription[ulTopicCount].topicFilterLength);
 
-    std::cout << "Unsubscribing from topic " << xTopicFilterContext[ ulTopicCount ].pcTopicFilter \
+    std::cout << "Unsubscribing from topic " << xMQTTSubscription[ulTopicCount].pTopicFilter \
       << "." << std::endl;
   }
 
@@ -592,6 +1048,7 @@ void prvMQTTUnsubscribeFromTopics(MQTTContext_t *pxMQTTContext) {
   assert(usUnsubscribePacketIdentifier != 0);
 
   /* Send UNSUBSCRIBE packet. */
+  prvExpectResponses(1);
   xResult = MQTT_Unsubscribe(pxMQTTContext,
                              xMQTTSubscription,
                              sizeof(xMQTTSubscription) / sizeof(MQTTSubscribeInfo_t),
@@ -611,16 +1068,20 @@ void prvMQTTProcessResponse(MQTTPacketInfo_t *pxIncomingPacket, uint16_t usPacke
 
       case MQTT_PACKET_TYPE_SUBACK:
         std::cout << "SUBACK received for packet ID: " <<  usPacketId << std::endl;
+        if (usPacketId == usRpcSubscribePacketIdentifier) {
+          break;
+        }
 
         /* A SUBACK from the broker, containing the server response to our subscription request, has been received.
          * It contains the status code indicating server approval/rejection for the subscription to the single topic
          * requested. The SUBACK will be parsed to obtain the status code, and this status code will be stored in global
          * variable #xTopicFilterContext. */
         prvUpdateSubAckStatus(pxIncomingPacket);
+        prvResponseReceived();
 
         for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
           if (xTopicFilterContext[ulTopicCount].xSubAckStatus != MQTTSubAckFailure) {
-            std::cout << "Subscribed to the topic " << xTopicFilterContext[ulTopicCount].pcTopicFilter \
+            std::cout << "Subscribed to the topic " << topicName(xTopicFilterContext[ulTopicCount].usTopicId, NULL) \
               << " with maximum QoS " <<  xTopicFilterContext[ulTopicCount].xSubAckStatus << "." << std::endl;
           }
         }
@@ -631,6 +1092,10 @@ void prvMQTTProcessResponse(MQTTPacketInfo_t *pxIncomingPacket, uint16_t usPacke
 
       case MQTT_PACKET_TYPE_UNSUBACK:
         std::cout << "UNSUBACK received for packet ID " << usPacketId << "." << std::endl;
+        if (usPacketId == usRpcUnsubscribePacketIdentifier) {
+          break;
+        }
+        prvResponseReceived();
         /* Make sure ACK packet identifier matches with Request packet identifier. */
         assert(usUnsubscribePacketIdentifier == usPacketId);
         break;
@@ -666,27 +1131,30 @@ void prvMQTTProcessResponse(MQTTPacketInfo_t *pxIncomingPacket, uint16_t usPacke
 }
 /*-----------------------------------------------------------*/
 
-void prvMQTTProcessIncomingPublish(MQTTPublishInfo_t *pxPublishInfo) {
-  uint32_t ulTopicCount;
-  bool xTopicFound = false;
+void prvMQTTProcessIncomingPublish(MQTTPublishInfo_t *pxPublishInfo, topicId_t usTopicId) {
+  uint32_t ulLatencyMs;
 
   assert(pxPublishInfo != NULL);
 
   /* Process incoming Publish. */
   std::cout << "Incoming QoS: " << pxPublishInfo->qos << "." << std::endl;
 
-  /* Verify the received publish is for one of the topics that's been subscribed to. */
-  for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-    if ((pxPublishInfo->topicNameLength == strlen(xTopicFilterContext[ulTopicCount].pcTopicFilter)) &&
-        (strncmp(xTopicFilterContext[ulTopicCount].pcTopicFilter, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength) == 0)) {
-      xTopicFound = true;
-      break;
-    }
-  }
-
-  if (xTopicFound == true) {
-    std::cout << "Incoming Publish Topic Name: " << pxPublishInfo->pTopicName \
+  /* Verify the received publish is for one of the topics that's been subscribed to:
+   * the demo topics have the lowest ids. */
+  if (usTopicId < configTOPIC_COUNT) {
+    std::cout << "Incoming Publish Topic Name: " << topicName(usTopicId, NULL) \
       << " matches a subscribed topic." << std::endl;
+
+    /* This is the echo of our own publish on that topic. */
+    ulLatencyMs = prvGetTimeMs() - ulPublishSentMs[usTopicId];
+    if (!ulLatencySamples || ulLatencyMs < ulLatencyMinMs) {
+      ulLatencyMinMs = ulLatencyMs;
+    }
+    if (ulLatencyMs > ulLatencyMaxMs) {
+      ulLatencyMaxMs = ulLatencyMs;
+    }
+    ulLatencySumMs += ulLatencyMs;
+    ulLatencySamples++;
   }
   else {
     std::cout << "Incoming Publish Topic Name: " << pxPublishInfo->pTopicName \
@@ -707,13 +1175,39 @@ void prvEventCallback(MQTTContext_t *pxMQTTContext,
   /* The MQTT context is not used in this function. */
   (void) pxMQTTContext;
 
+  /* Application code, even when called from inside coreMQTT. */
+  ALLOC_SCOPE(ALLOC_APP);
+  ulPacketsReceived++;
+
+  flightRecordf(FR_MQTT_PACKET, "rx type 0x%02x id %u len %u", pxPacketInfo->type,
+                pxDeserializedInfo->packetIdentifier, (unsigned int) pxPacketInfo->remainingLength);
+
   if ((pxPacketInfo->type & 0xF0U) == MQTT_PACKET_TYPE_PUBLISH) {
-    std::cout << "PUBLISH received for packet id " << pxDeserializedInfo->packetIdentifier << "." << std::endl;
-    prvMQTTProcessIncomingPublish( pxDeserializedInfo->pPublishInfo );
+    /* The only string lookup for an incoming publish; routing is by id. */
+    MQTTPublishInfo_t *pxPublishInfo = pxDeserializedInfo->pPublishInfo;
+    topicId_t usTopicId = topicLookup(pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength);
+
+    topicCountIn(usTopicId, pxPublishInfo->payloadLength);
+    if (usTopicId == usRpcReplyTopicId) {
+      (void) mqttRpcHandlePublish(pxPublishInfo, usTopicId);
+    }
+    else if (usTopicId == usRpcRequestTopicId) {
+      (void) prvServeRpcRequest(pxPublishInfo);
+    }
+    else {
+      std::cout << "PUBLISH received for packet id " << pxDeserializedInfo->packetIdentifier << "." << std::endl;
+      prvMQTTProcessIncomingPublish(pxPublishInfo, usTopicId);
+      prvResponseReceived();
+    }
   }
   else {
     prvMQTTProcessResponse( pxPacketInfo, pxDeserializedInfo->packetIdentifier );
   }
+
+  /* Wake the demo thread; in full-duplex mode it waits for this. */
+  pthread_mutex_lock(&xResponseMutex);
+  pthread_cond_broadcast(&xResponseCond);
+  pthread_mutex_unlock(&xResponseMutex);
 }
 /*-----------------------------------------------------------*/
 
@@ -744,36 +1238,635 @@ MQTTStatus_t prvProcessLoopWithTimeout(MQTTContext_t *pMqttContext, uint32_t ulT
   ulCurrentTime = pMqttContext->getTime();
   ulMqttProcessLoopTimeoutTime = ulCurrentTime + ulTimeoutMs;
 
+#if configFULL_DUPLEX
+  /* The receive thread processes incoming packets, just wait until every
+   * expected response arrived and no QoS exchange is left in flight. */
+  struct timespec xDeadline;
+  bool xInFlight;
+  uint32_t ulRecord;
+
+  clock_gettime(CLOCK_REALTIME, &xDeadline);
+  xDeadline.tv_sec += ulTimeoutMs / 1000U;
+  xDeadline.tv_nsec += (long) (ulTimeoutMs % 1000U) * 1000000L;
+  if (xDeadline.tv_nsec >= 1000000000L) {
+    xDeadline.tv_sec++;
+    xDeadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&xResponseMutex);
+  do {
+    vMQTTStateLock();
+    xInFlight = false;
+    for (ulRecord = 0; ulRecord < configOUTGOING_PUBLISH_RECORD_LEN; ulRecord++) {
+      xInFlight = xInFlight || (pOutgoingPublishRecords[ulRecord].packetId != MQTT_PACKET_ID_INVALID);
+    }
+    vMQTTStateUnlock();
+    if (!ulResponsesOutstanding && !xInFlight) {
+      break;
+    }
+  } while (pthread_cond_timedwait(&xResponseCond, &xResponseMutex, &xDeadline) == 0);
+  pthread_mutex_unlock(&xResponseMutex);
+  (void) ulMqttProcessLoopTimeoutTime;
+#else
   /* Call MQTT_ProcessLoop multiple times a timeout happens, or
    * MQTT_ProcessLoop fails. */
   while ((ulCurrentTime < ulMqttProcessLoopTimeoutTime) &&
          (eMqttStatus == MQTTSuccess || eMqttStatus == MQTTNeedMoreBytes)) {
+    ALLOC_SCOPE(ALLOC_MQTT);
+    uint32_t ulPackets = ulPacketsReceived;
     eMqttStatus = MQTT_ProcessLoop(pMqttContext);
+    threadStatsWakeup(pxDemoThreadStats, ulPackets != ulPacketsReceived);
     ulCurrentTime = pMqttContext->getTime();
   }
 
   if (eMqttStatus == MQTTNeedMoreBytes) {
     eMqttStatus = MQTTSuccess;
   }
+#endif
 
   return eMqttStatus;
 }
 /*-----------------------------------------------------------*/
 
+#if configFULL_DUPLEX
+void prvStartReceiveThread(MQTTContext_t *pxMQTTContext) {
+  xReceiveRun = true;
+  if (pthread_create(&xReceiveThread, NULL, &prvReceiveTask, pxMQTTContext)) {
+    perror("Not able to spawn receive thread.");
+    exit(errno);
+  }
+}
+/*-----------------------------------------------------------*/
+
+void prvStopReceiveThread() {
+  xReceiveRun = false;
+  pthread_join(xReceiveThread, NULL);
+}
+/*-----------------------------------------------------------*/
+
+void *prvReceiveTask(void *args) {
+  MQTTContext_t *pxMQTTContext = (MQTTContext_t *) args;
+  MQTTStatus_t xStatus;
+  uint32_t ulIdleMs, ulPackets;
+  threadStats_t *pxStats = threadStatsRegister("mqtt receive");
+
+  while (xReceiveRun) {
+    ALLOC_SCOPE(ALLOC_MQTT);
+    if (!esp8266AT_LinkUp()) {
+      /* The demo thread fails over, see prvFailover(). */
+      usleep(configRECEIVE_IDLE_DELAY_US);
+      continue;
+    }
+    ulPackets = ulPacketsReceived;
+    xStatus = MQTT_ReceiveLoop(pxMQTTContext);
+    threadStatsWakeup(pxStats, ulPackets != ulPacketsReceived);
+    if ((xStatus != MQTTSuccess) && (xStatus != MQTTNeedMoreBytes)) {
+      std::cerr << "MQTT_ReceiveLoop failed with status " << xStatus << "." << std::endl;
+      flightRecordf(FR_NOTE, "MQTT_ReceiveLoop status %d", xStatus);
+    }
+
+    /* MQTT_ReceiveLoop does not manage keep-alive, so ping when idle. */
+    ulIdleMs = pxMQTTContext->getTime() - pxMQTTContext->lastPacketTxTime;
+    if (ulIdleMs > (configKEEP_ALIVE_TIMEOUT_S * 1000U) / 2U) {
+      (void) MQTT_Ping(pxMQTTContext);
+    }
+    usleep(configRECEIVE_IDLE_DELAY_US);
+  }
+  threadStatsUnregister(pxStats);
+  return NULL;
+}
+/*-----------------------------------------------------------*/
+#endif /* configFULL_DUPLEX */
+
+void prvExpectResponses(uint32_t ulCount) {
+  pthread_mutex_lock(&xResponseMutex);
+  ulResponsesOutstanding += ulCount;
+  pthread_mutex_unlock(&xResponseMutex);
+}
+/*-----------------------------------------------------------*/
+
+void prvResponseReceived() {
+  pthread_mutex_lock(&xResponseMutex);
+  if (ulResponsesOutstanding) {
+    ulResponsesOutstanding--;
+  }
+  pthread_mutex_unlock(&xResponseMutex);
+}
+/*-----------------------------------------------------------*/
+
+void prvReportLatency() {
+  if (ulLatencySamples) {
+    std::cout << "Publish to echo latency (" << (configFULL_DUPLEX ? "full" : "half") << " duplex): min " \
+      << ulLatencyMinMs << " ms, avg " << ulLatencySumMs / ulLatencySamples << " ms, max " \
+      << ulLatencyMaxMs << " ms over " << ulLatencySamples << " publishes." << std::endl;
+  }
+  ulLatencyMinMs = ulLatencyMaxMs = ulLatencySumMs = ulLatencySamples = 0;
+}
+/*-----------------------------------------------------------*/
+
+bool prvServeRpcRequest(MQTTPublishInfo_t *pxPublishInfo) {
+  uint32_t ulId;
+  const char *pcReplyTopic;
+  uint16_t usReplyTopicLength;
+  const void *pvBody;
+  size_t xBodyLength;
+  char cReply[64];
+  int iReplyLength;
+
+  if (!mqttRpcParseRequest(pxPublishInfo, &ulId, &pcReplyTopic, &usReplyTopicLength, &pvBody, &xBodyLength)) {
+    return false;
+  }
+
+  /* The demo service answers "pong" followed by the request. */
+  iReplyLength = snprintf(cReply, sizeof(cReply), "pong %.*s", (int) xBodyLength, (const char *) pvBody);
+  if (iReplyLength >= (int) sizeof(cReply)) {
+    iReplyLength = sizeof(cReply) - 1;
+  }
+  if (mqttRpcReply(ulId, pcReplyTopic, usReplyTopicLength, MQTTQoS1, cReply, iReplyLength) != MQTT_RPC_OK) {
+    std::cerr << "RPC reply to " << ulId << " not sent." << std::endl;
+  }
+  return true;
+}
+/*-----------------------------------------------------------*/
+
+#if configRPC_DEMO_CALLS
+void prvRpcDemo(MQTTContext_t *pxMQTTContext) {
+  MQTTSubscribeInfo_t xRpcSubscription[2];
+  MQTTStatus_t xResult;
+  mqttRpcStatus_t xStatus;
+  uint32_t ulIds[configRPC_DEMO_CALLS];
+  static char cReplies[configRPC_DEMO_CALLS][32];
+  char cRequest[16];
+  uint32_t ulCall, ulReplies = 0, ulStartMs;
+  size_t xReplyLength;
+  int iRequestLength;
+
+  (void) memset((void *) xRpcSubscription, 0x00, sizeof(xRpcSubscription));
+  xRpcSubscription[0].qos = (MQTTQoS_t) topicQoS(usRpcRequestTopicId);
+  xRpcSubscription[0].pTopicFilter = topicName(usRpcRequestTopicId, &xRpcSubscription[0].topicFilterLength);
+  xRpcSubscription[1].qos = (MQTTQoS_t) topicQoS(usRpcReplyTopicId);
+  xRpcSubscription[1].pTopicFilter = topicName(usRpcReplyTopicId, &xRpcSubscription[1].topicFilterLength);
+
+  /* The broker handles packets in order, so requests sent after the SUBSCRIBE
+   * are seen by the subscription; waiting for the replies processes the SUBACK. */
+  usRpcSubscribePacketIdentifier = MQTT_GetPacketId(pxMQTTContext);
+  xResult = MQTT_Subscribe(pxMQTTContext, xRpcSubscription, 2, usRpcSubscribePacketIdentifier);
+  assert(xResult == MQTTSuccess);
+
+  ulStartMs = prvGetTimeMs();
+  for (ulCall = 0; ulCall < configRPC_DEMO_CALLS; ulCall++) {
+    iRequestLength = snprintf(cRequest, sizeof(cRequest), "ping %u", (unsigned int) ulCall);
+    xStatus = mqttRpcSend(topicName(usRpcRequestTopicId, NULL), (MQTTQoS_t) topicQoS(usRpcRequestTopicId), cRequest, iRequestLength,
+                          cReplies[ulCall], sizeof(cReplies[ulCall]), configRPC_TIMEOUT_MS, &ulIds[ulCall]);
+    if (xStatus != MQTT_RPC_OK) {
+      std::cerr << "RPC request " << ulCall << " not sent, status " << xStatus << "." << std::endl;
+      ulIds[ulCall] = 0;
+    }
+    else {
+      topicCountOut(usRpcRequestTopicId, iRequestLength);
+    }
+  }
+  for (ulCall = 0; ulCall < configRPC_DEMO_CALLS; ulCall++) {
+    if (ulIds[ulCall] && (mqttRpcWait(ulIds[ulCall], &xReplyLength) == MQTT_RPC_OK)) {
+      ulReplies++;
+    }
+  }
+  std::cout << "RPC: " << ulReplies << " of " << configRPC_DEMO_CALLS << " replies, all requests in flight at once, in " \
+    << prvGetTimeMs() - ulStartMs << " ms." << std::endl;
+
+  usRpcUnsubscribePacketIdentifier = MQTT_GetPacketId(pxMQTTContext);
+  xResult = MQTT_Unsubscribe(pxMQTTContext, xRpcSubscription, 2, usRpcUnsubscribePacketIdentifier);
+  assert(xResult == MQTTSuccess);
+}
+/*-----------------------------------------------------------*/
+#endif
+
+uint32_t prvDrain(MQTTContext_t *pxMQTTContext, uint32_t ulDeadlineMs) {
+  uint32_t ulStartMs = prvGetTimeMs();
+  uint32_t ulElapsedMs = 0, ulSliceMs, ulLeft, ulRecord;
+  MQTTStatus_t xMQTTStatus;
+
+  /* Full link speed: no coalescing delay and no held acks while draining. */
+  esp8266AT_SetSendLinger(0);
+  esp8266AT_SetAckHold(0);
+
+  for (;;) {
+    (void) esp8266AT_Flush();
+
+    vMQTTStateLock();
+    ulLeft = prvCountRecordsInUse(pOutgoingPublishRecords, configOUTGOING_PUBLISH_RECORD_LEN) +
+             prvCountRecordsInUse(pIncomingPublishRecords, configINCOMING_PUBLISH_RECORD_LEN);
+    vMQTTStateUnlock();
+
+    ulElapsedMs = prvGetTimeMs() - ulStartMs;
+    if ((ulLeft == 0) || (ulElapsedMs >= ulDeadlineMs)) {
+      break;
+    }
+
+    /* Short slices, so held bytes are flushed as soon as a response frees them. */
+    ulSliceMs = ulDeadlineMs - ulElapsedMs;
+    xMQTTStatus = prvProcessLoopWithTimeout(pxMQTTContext, (ulSliceMs < 10U) ? ulSliceMs : 10U);
+    if (xMQTTStatus != MQTTSuccess) {
+      std::cerr << "Drain stopped, MQTT_ProcessLoop failed with status " << xMQTTStatus << "." << std::endl;
+      break;
+    }
+  }
+
+  if (ulLeft == 0) {
+    std::cout << "Drained in " << ulElapsedMs << " ms, nothing left undelivered." << std::endl;
+    return 0;
+  }
+
+  std::cout << "Drain gave up after " << ulElapsedMs << " ms, " << ulLeft << " QoS exchanges undelivered:" << std::endl;
+  vMQTTStateLock();
+  for (ulRecord = 0; ulRecord < configOUTGOING_PUBLISH_RECORD_LEN; ulRecord++) {
+    if (pOutgoingPublishRecords[ulRecord].packetId != MQTT_PACKET_ID_INVALID) {
+      std::cout << "  outgoing id " << pOutgoingPublishRecords[ulRecord].packetId << " QoS" \
+        << pOutgoingPublishRecords[ulRecord].qos << ", " << MQTT_State_strerror(pOutgoingPublishRecords[ulRecord].publishState) << std::endl;
+    }
+  }
+  for (ulRecord = 0; ulRecord < configINCOMING_PUBLISH_RECORD_LEN; ulRecord++) {
+    if (pIncomingPublishRecords[ulRecord].packetId != MQTT_PACKET_ID_INVALID) {
+      std::cout << "  incoming id " << pIncomingPublishRecords[ulRecord].packetId << " QoS" \
+        << pIncomingPublishRecords[ulRecord].qos << ", " << MQTT_State_strerror(pIncomingPublishRecords[ulRecord].publishState) << std::endl;
+    }
+  }
+  vMQTTStateUnlock();
+  flightRecordf(FR_NOTE, "drain: %u undelivered after %u ms", (unsigned int) ulLeft, (unsigned int) ulElapsedMs);
+  return ulLeft;
+}
+/*-----------------------------------------------------------*/
+
+void prvHandoffIfRequested(MQTTContext_t *pxMQTTContext, uint32_t ulPublishCount) {
+  static demoHandoffState_t xState;
+  uint32_t ulTopicCount;
+  int iSock, iSerialFd;
+
+  iSock = handoffPoll(iHandoffListenFd);
+  if (iSock == -1) {
+    return;
+  }
+
+  std::cout << "Handing the connection off to a new process..." << std::endl;
+#if configFULL_DUPLEX
+  prvStopReceiveThread();
+#endif
+
+  (void) memset((void *) &xState, 0x00, sizeof(xState));
+  iSerialFd = esp8266AT_Detach(xState.ucTransportState, &xState.xTransportStateLen);
+  if (iSerialFd == -1) {
+    std::cerr << "Transport cannot be handed off." << std::endl;
+    close(iSock);
+#if configFULL_DUPLEX
+    prvStartReceiveThread(pxMQTTContext);
+#endif
+    return;
+  }
+
+  xState.ulPublishCount = ulPublishCount;
+  xState.usNextPacketId = pxMQTTContext->nextPacketId;
+  xState.usKeepAliveIntervalSec = pxMQTTContext->keepAliveIntervalSec;
+  xState.xWaitingForPingResp = pxMQTTContext->waitingForPingResp;
+  memcpy(xState.xOutgoingPublishRecords, pOutgoingPublishRecords, sizeof(xState.xOutgoingPublishRecords));
+  memcpy(xState.xIncomingPublishRecords, pIncomingPublishRecords, sizeof(xState.xIncomingPublishRecords));
+  for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
+    xState.xSubAckStatus[ulTopicCount] = xTopicFilterContext[ulTopicCount].xSubAckStatus;
+  }
+  memcpy(xState.xBrokerProbes, xBrokerProbes, sizeof(xState.xBrokerProbes));
+  memcpy(xState.ulBrokerRank, ulBrokerRank, sizeof(xState.ulBrokerRank));
+  xState.ulActiveBroker = ulActiveBroker;
+  xState.lStandbyBroker = lStandbyBroker;
+  xState.xBufferIndex = pxMQTTContext->index;
+  memcpy(xState.ucBuffer, ucSharedBuffer, pxMQTTContext->index);
+
+  if (!handoffSend(iSock, iSerialFd, &xState, sizeof(xState))) {
+    /* The replacement did not get it, carry on ourselves. */
+    std::cerr << "Hand-off failed, keeping the connection." << std::endl;
+    if (esp8266AT_Attach(iSerialFd, xState.ucTransportState, xState.xTransportStateLen) != ESP8266_TRANSPORT_SUCCESS) {
+      std::cerr << "Could not resume the transport either." << std::endl;
+      exit(-1);
+    }
+#if configFULL_DUPLEX
+    prvStartReceiveThread(pxMQTTContext);
+#endif
+    return;
+  }
+
+  close(iSerialFd); /* The replacement holds its own reference. */
+  handoffClose(iHandoffListenFd, configHANDOFF_SOCKET_PATH);
+  std::cout << "Hand-off complete after " << ulPublishCount << " publish cycles, exiting." << std::endl;
+  exit(0);
+}
+/*-----------------------------------------------------------*/
+
+bool prvResumeFromHandoff(MQTTContext_t *pxMQTTContext, uint32_t *pulPublishCount) {
+  static demoHandoffState_t xState;
+  uint32_t ulTopicCount;
+  int iSerialFd;
+
+  if (handoffReceive(configHANDOFF_SOCKET_PATH, &iSerialFd, &xState, sizeof(xState)) != (int) sizeof(xState)) {
+    std::cerr << "Hand-off not received, connecting from scratch." << std::endl;
+    if (iSerialFd != -1) {
+      close(iSerialFd);
+    }
+    return false;
+  }
+
+  if (esp8266AT_Attach(iSerialFd, xState.ucTransportState, xState.xTransportStateLen) != ESP8266_TRANSPORT_SUCCESS) {
+    std::cerr << "Hand-off transport state rejected, connecting from scratch." << std::endl;
+    close(iSerialFd);
+    return false;
+  }
+
+  prvInitializeMQTTContext(pxMQTTContext);
+  memcpy(pOutgoingPublishRecords, xState.xOutgoingPublishRecords, sizeof(xState.xOutgoingPublishRecords));
+  memcpy(pIncomingPublishRecords, xState.xIncomingPublishRecords, sizeof(xState.xIncomingPublishRecords));
+  memcpy(ucSharedBuffer, xState.ucBuffer, xState.xBufferIndex);
+  pxMQTTContext->index = xState.xBufferIndex;
+  pxMQTTContext->nextPacketId = xState.usNextPacketId;
+  pxMQTTContext->keepAliveIntervalSec = xState.usKeepAliveIntervalSec;
+  pxMQTTContext->connectStatus = MQTTConnected;
+  /* Timestamps don't survive the process change; restart the keep-alive clock. */
+  pxMQTTContext->lastPacketTxTime = pxMQTTContext->getTime();
+  pxMQTTContext->lastPacketRxTime = pxMQTTContext->lastPacketTxTime;
+  pxMQTTContext->waitingForPingResp = xState.xWaitingForPingResp;
+  pxMQTTContext->pingReqSendTimeMs = pxMQTTContext->lastPacketTxTime;
+  for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
+    xTopicFilterContext[ulTopicCount].xSubAckStatus = xState.xSubAckStatus[ulTopicCount];
+  }
+  *pulPublishCount = xState.ulPublishCount;
+  memcpy(xBrokerProbes, xState.xBrokerProbes, sizeof(xBrokerProbes));
+  memcpy(ulBrokerRank, xState.ulBrokerRank, sizeof(ulBrokerRank));
+  xBrokersRanked = true;
+  ulActiveBroker = xState.ulActiveBroker;
+  lStandbyBroker = xState.lStandbyBroker;
+
+#if configFULL_DUPLEX
+  prvStartReceiveThread(pxMQTTContext);
+#endif
+  std::cout << "Resumed the MQTT session from the previous process after " \
+    << xState.ulPublishCount << " publish cycles." << std::endl;
+  return true;
+}
+/*-----------------------------------------------------------*/
+
+uint32_t prvCountRecordsInUse(const MQTTPubAckInfo_t *pxRecords, uint32_t ulLength) {
+  uint32_t ulRecord, ulInUse = 0;
+
+  /* Outside a connection the records are back in the arena. */
+  if (pxRecords == NULL) {
+    return 0;
+  }
+  for (ulRecord = 0; ulRecord < ulLength; ulRecord++) {
+    ulInUse += (pxRecords[ulRecord].packetId != MQTT_PACKET_ID_INVALID);
+  }
+  return ulInUse;
+}
+
+void prvDumpSession(int fd) {
+  uint32_t ulOutgoing, ulIncoming;
+
+  (void) iSessionMetrics;
+  vMQTTStateLock();
+  ulOutgoing = prvCountRecordsInUse(pOutgoingPublishRecords, configOUTGOING_PUBLISH_RECORD_LEN);
+  ulIncoming = prvCountRecordsInUse(pIncomingPublishRecords, configINCOMING_PUBLISH_RECORD_LEN);
+  vMQTTStateUnlock();
+  dprintf(fd, "connections %u (reconnects %u), in flight out %u of %u, in %u of %u, responses awaited %u, "
+          "publishes skipped %u\n",
+          (unsigned int) ulConnections, (unsigned int) (ulConnections ? ulConnections - 1 : 0),
+          (unsigned int) ulOutgoing, (unsigned int) configOUTGOING_PUBLISH_RECORD_LEN,
+          (unsigned int) ulIncoming, (unsigned int) configINCOMING_PUBLISH_RECORD_LEN,
+          (unsigned int) ulResponsesOutstanding, (unsigned int) ulPublishesSkipped);
+  dprintf(fd, "broker %s, standby %s, failovers %u (standby link %u)\n", pcBrokerHosts[ulActiveBroker],
+          (lStandbyBroker >= 0) ? pcBrokerHosts[lStandbyBroker] : "none",
+          (unsigned int) ulFailovers, (unsigned int) ulStandbyFailovers);
+}
+
+void prvReleaseSession() {
+  vMQTTStateLock();
+  pOutgoingPublishRecords = NULL;
+  pIncomingPublishRecords = NULL;
+  vMQTTStateUnlock();
+  arenaReset();
+}
+
+void prvProbeBrokers() {
+  MQTTContext_t xProbeContext;
+  TransportInterface_t xTransport;
+  MQTTConnectInfo_t xConnectInfo;
+  brokerProbe_t *pxProbe;
+  bool xSessionPresent;
+  uint32_t ulBroker, ulRank, ulCost, ulStartMs, ulProbeStartMs = prvGetTimeMs();
+
+  if (brokerCOUNT == 1) {
+    ulBrokerRank[0] = 0;
+    xBrokerProbes[0].xReachable = true;
+    xBrokersRanked = true;
+    return;
+  }
+
+  xTransport.pNetworkContext = NULL;
+  xTransport.send = esp8266AT_send;
+  xTransport.recv = esp8266AT_recv;
+  xTransport.writev = NULL;
+  prvInitializeConnectInfo(&xConnectInfo);
+
+  for (ulBroker = 0; ulBroker < brokerCOUNT; ulBroker++) {
+    pxProbe = &xBrokerProbes[ulBroker];
+    (void) memset((void *) pxProbe, 0x00, sizeof(*pxProbe));
+    if (esp8266AT_Connect(pcBrokerHosts[ulBroker], configMQTT_BROKER_PORT) == ESP8266_TRANSPORT_SUCCESS) {
+      pxProbe->ulTcpMs = esp8266AT_ConnectTime();
+
+      /* No QoS state: nothing but the CONNACK is expected. */
+      (void) MQTT_Init(&xProbeContext, &xTransport, prvGetTimeMs, prvEventCallback, &xBuffer);
+      ulStartMs = prvGetTimeMs();
+      if (MQTT_Connect(&xProbeContext, &xConnectInfo, NULL, configCONNACK_RECV_TIMEOUT_MS, &xSessionPresent) == MQTTSuccess) {
+        pxProbe->ulConnAckMs = prvGetTimeMs() - ulStartMs;
+        pxProbe->xReachable = true;
+        (void) MQTT_Disconnect(&xProbeContext);
+      }
+      (void) esp8266AT_CloseLink();
+    }
+
+    if (pxProbe->xReachable) {
+      std::cout << "Broker " << pcBrokerHosts[ulBroker] << ": link up in " << pxProbe->ulTcpMs \
+        << " ms, CONNACK after " << pxProbe->ulConnAckMs << " ms." << std::endl;
+    }
+    else {
+      std::cout << "Broker " << pcBrokerHosts[ulBroker] << ": unreachable." << std::endl;
+    }
+
+    /* Insert into the ranking, fastest first and unreachable last. */
+    ulCost = pxProbe->xReachable ? pxProbe->ulTcpMs + pxProbe->ulConnAckMs : UINT32_MAX;
+    for (ulRank = ulBroker; ulRank > 0; ulRank--) {
+      pxProbe = &xBrokerProbes[ulBrokerRank[ulRank - 1]];
+      if ((pxProbe->xReachable ? pxProbe->ulTcpMs + pxProbe->ulConnAckMs : UINT32_MAX) <= ulCost) {
+        break;
+      }
+      ulBrokerRank[ulRank] = ulBrokerRank[ulRank - 1];
+    }
+    ulBrokerRank[ulRank] = ulBroker;
+  }
+
+  xBrokersRanked = true;
+  std::cout << "Probed " << brokerCOUNT << " brokers in " << prvGetTimeMs() - ulProbeStartMs << " ms, " \
+    << pcBrokerHosts[ulBrokerRank[0]] << " is the fastest." << std::endl;
+  flightRecordf(FR_NOTE, "broker probe: %s fastest, %u ms", pcBrokerHosts[ulBrokerRank[0]],
+                (unsigned int) (prvGetTimeMs() - ulProbeStartMs));
+}
+
+bool prvConnectToBestBroker(MQTTContext_t *pxMQTTContext, uint32_t ulSkipBroker) {
+  uint32_t ulRank, ulBroker, ulStartMs;
+
+  for (ulRank = 0; ulRank <= brokerCOUNT; ulRank++) {
+    if (ulRank < brokerCOUNT) {
+      ulBroker = ulBrokerRank[ulRank];
+      if (ulBroker == ulSkipBroker) {
+        continue;
+      }
+    }
+    else if (ulSkipBroker < brokerCOUNT) {
+      /* The skipped broker comes last, it may be back by now. */
+      ulBroker = ulSkipBroker;
+    }
+    else {
+      break;
+    }
+
+    ulActiveBroker = ulBroker;
+    ulStartMs = prvGetTimeMs();
+    if (esp8266AT_Connect(pcBrokerHosts[ulBroker], configMQTT_BROKER_PORT) == ESP8266_TRANSPORT_SUCCESS) {
+      std::cout << (configMQTT_BROKER_TLS ? "TLS" : "TCP") << " link up in " << esp8266AT_ConnectTime() << " ms." << std::endl;
+      std::cout << "Creating an MQTT connection to " << pcBrokerHosts[ulBroker] << "." << std::endl;
+      if (prvCreateMQTTConnectionWithBroker(pxMQTTContext, NULL) == MQTTSuccess) {
+        std::cout << "Connected to " << pcBrokerHosts[ulBroker] << " in " << prvGetTimeMs() - ulStartMs \
+          << " ms." << std::endl;
+        xBrokerProbes[ulBroker].xReachable = true;
+        return true;
+      }
+      prvReleaseSession();
+      (void) esp8266AT_CloseLink();
+    }
+  }
+  return false;
+}
+
+void prvDemoteBroker(uint32_t ulBroker) {
+  uint32_t ulRank, ulLast = 0;
+
+  for (ulRank = 0; ulRank < brokerCOUNT; ulRank++) {
+    if (ulBrokerRank[ulRank] != ulBroker) {
+      ulBrokerRank[ulLast++] = ulBrokerRank[ulRank];
+    }
+  }
+  ulBrokerRank[ulLast] = ulBroker;
+  xBrokerProbes[ulBroker].xReachable = false;
+}
+
+#if configMQTT_BROKER_STANDBY
+void prvOpenStandby() {
+  uint32_t ulRank, ulBroker = ulActiveBroker, ulStartMs;
+
+  /* The next best reachable broker, else a second link to this one. */
+  for (ulRank = 0; ulRank < brokerCOUNT; ulRank++) {
+    if ((ulBrokerRank[ulRank] != ulActiveBroker) && xBrokerProbes[ulBrokerRank[ulRank]].xReachable) {
+      ulBroker = ulBrokerRank[ulRank];
+      break;
+    }
+  }
+
+  ulStartMs = prvGetTimeMs();
+  if (esp8266AT_OpenStandby(pcBrokerHosts[ulBroker], configMQTT_BROKER_PORT) == ESP8266_TRANSPORT_SUCCESS) {
+    lStandbyBroker = (int32_t) ulBroker;
+    std::cout << "Standby link to " << pcBrokerHosts[ulBroker] << " open in " << prvGetTimeMs() - ulStartMs \
+      << " ms." << std::endl;
+  }
+  else {
+    lStandbyBroker = -1;
+    std::cerr << "Could not open a standby link to " << pcBrokerHosts[ulBroker] << "." << std::endl;
+  }
+}
+#endif
+
+void prvFailover(MQTTContext_t *pxMQTTContext) {
+  uint32_t ulStartMs = prvGetTimeMs(), ulFailedBroker = ulActiveBroker, ulTopicCount, ulElapsedMs;
+  bool xConnected = false, xOnStandby = false;
+
+  std::cout << "Lost the connection with " << pcBrokerHosts[ulFailedBroker] << ", failing over." << std::endl;
+#if configFULL_DUPLEX
+  prvStopReceiveThread();
+#endif
+
+  /* Clean sessions: what was in flight with the old broker is gone with it. */
+  prvReleaseSession();
+  ulResponsesOutstanding = 0;
+
+  if ((lStandbyBroker >= 0) && (esp8266AT_Failover() == ESP8266_TRANSPORT_SUCCESS)) {
+    ulActiveBroker = (uint32_t) lStandbyBroker;
+    xConnected = xOnStandby = (prvCreateMQTTConnectionWithBroker(pxMQTTContext, NULL) == MQTTSuccess);
+    if (!xConnected) {
+      prvReleaseSession();
+    }
+  }
+  lStandbyBroker = -1;
+
+  /* The rest of the ranking still stands, the failed broker goes last. */
+  prvDemoteBroker(ulFailedBroker);
+  if (!xConnected) {
+    (void) esp8266AT_CloseLink();
+    xConnected = prvConnectToBestBroker(pxMQTTContext, ulFailedBroker);
+  }
+  if (!xConnected) {
+    std::cerr << "No broker reachable after losing " << pcBrokerHosts[ulFailedBroker] << "." << std::endl;
+    exit(-1);
+  }
+
+  ulElapsedMs = prvGetTimeMs() - ulStartMs;
+  ulConnections++;
+  ulFailovers++;
+  ulStandbyFailovers += xOnStandby ? 1U : 0U;
+  std::cout << "Failed over from " << pcBrokerHosts[ulFailedBroker] << " to " << pcBrokerHosts[ulActiveBroker] \
+    << (xOnStandby ? " on the standby link" : " with a new connect") << " in " << ulElapsedMs << " ms." << std::endl;
+  flightRecordf(FR_NOTE, "failover %s -> %s %s in %u ms", pcBrokerHosts[ulFailedBroker], pcBrokerHosts[ulActiveBroker],
+                xOnStandby ? "standby" : "connect", (unsigned int) ulElapsedMs);
+
+#if configFULL_DUPLEX
+  prvStartReceiveThread(pxMQTTContext);
+#endif
+#if configMQTT_BROKER_STANDBY
+  prvOpenStandby();
+#endif
+  for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
+    xTopicFilterContext[ulTopicCount].xSubAckStatus = MQTTSubAckFailure;
+  }
+  prvMQTTSubscribeWithBackoffRetries(pxMQTTContext);
+}
+/*-----------------------------------------------------------*/
+
 void prvInitializeTopicBuffers() {
   uint32_t ulTopicCount;
   int xCharactersWritten;
+  char cTopicFilter[configTOPIC_BUFFER_SIZE];
 
   for (ulTopicCount = 0; ulTopicCount < configTOPIC_COUNT; ulTopicCount++) {
-    /* Write topic strings into buffers. */
-    xCharactersWritten = snprintf(xTopicFilterContext[ulTopicCount].pcTopicFilter,
-                                  configTOPIC_BUFFER_SIZE,
+    /* Write the topic string, then intern it. Interned first, the demo topics
+     * get the ids 0 to configTOPIC_COUNT - 1; interning again returns the same id. */
+    xCharactersWritten = snprintf(cTopicFilter, configTOPIC_BUFFER_SIZE,
                                   "%s%d", configTOPIC_PREFIX, (int) ulTopicCount);
 
     assert(xCharactersWritten >= 0 && xCharactersWritten < configTOPIC_BUFFER_SIZE);
+    xTopicFilterContext[ulTopicCount].usTopicId = topicIntern(cTopicFilter, xCharactersWritten);
+    assert(xTopicFilterContext[ulTopicCount].usTopicId == ulTopicCount);
+    topicSetQoS(xTopicFilterContext[ulTopicCount].usTopicId, MQTTQoS2);
 
     /* Assign topic string to its corresponding SUBACK code initialized as a failure. */
     xTopicFilterContext[ulTopicCount].xSubAckStatus = MQTTSubAckFailure;
   }
+
+  usRpcRequestTopicId = topicIntern(configRPC_REQUEST_TOPIC, sizeof(configRPC_REQUEST_TOPIC) - 1);
+  usRpcReplyTopicId = topicIntern(configRPC_REPLY_TOPIC, sizeof(configRPC_REPLY_TOPIC) - 1);
+  assert((usRpcRequestTopicId != TOPIC_ID_NONE) && (usRpcReplyTopicId != TOPIC_ID_NONE));
+  topicSetQoS(usRpcRequestTopicId, MQTTQoS1);
+  topicSetQoS(usRpcReplyTopicId, MQTTQoS1);
 }
 /*-----------------------------------------------------------*/
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+//constants
+const int METRICS_PROVIDERS_MAX = 16;
+
+struct metricsEntry_s {
+    const char *name;
+    metricsProvider_t provider;
+};
+
+static struct metricsEntry_s providers[METRICS_PROVIDERS_MAX];
+static int provider_count = 0;
+static pthread_mutex_t providers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sockaddr_un serve_addr;
+static struct stat serve_stat; //of the socket file, to leave a successor's alone
+static int serve_fd = -1;
+static volatile bool serve_stop = false;
+static pthread_t serve_thread_id;
+
+static void *serve_thread(void *args);
+
+int metricsRegister(const char *name, metricsProvider_t provider) {
+
+    int rc = -1;
+
+    pthread_mutex_lock(&providers_lock);
+    if (provider_count < METRICS_PROVIDERS_MAX) {
+        providers[provider_count].name = name;
+        providers[provider_count].provider = provider;
+        provider_count++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&providers_lock);
+    return rc;
+}
+
+void metricsDump(int fd) {
+
+    pthread_mutex_lock(&providers_lock);
+    for (int i = 0; i < provider_count; i++) {
+        dprintf(fd, "# %s\n", providers[i].name);
+        providers[i].provider(fd);
+    }
+    pthread_mutex_unlock(&providers_lock);
+}
+
+int metricsServe(const char *path) {
+
+    if (serve_fd != -1) {
+        return 0;
+    }
+    memset(&serve_addr, 0, sizeof(serve_addr));
+    serve_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(serve_addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        perror("Metrics socket path too long.");
+        return -1;
+    }
+    strcpy(serve_addr.sun_path, path);
+
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_fd == -1) {
+        perror("Could not create metrics socket.");
+        return -1;
+    }
+    unlink(path); //stale socket from a previous run
+    if (bind(serve_fd, (struct sockaddr*) &serve_addr, sizeof(serve_addr)) || listen(serve_fd, 4)) {
+        perror("Could not listen on metrics socket.");
+        close(serve_fd);
+        serve_fd = -1;
+        return -1;
+    }
+    stat(path, &serve_stat);
+
+    serve_stop = false;
+    if (pthread_create(&serve_thread_id, NULL, serve_thread, NULL)) {
+        perror("Not able to spawn metrics thread.");
+        close(serve_fd);
+        unlink(path);
+        serve_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void metricsServeStop(void) {
+
+    struct stat now;
+
+    if (serve_fd == -1) {
+        return;
+    }
+    serve_stop = true;
+    pthread_join(serve_thread_id, NULL);
+    close(serve_fd);
+    //a process that took over may have bound the path since.
+    if (!stat(serve_addr.sun_path, &now) && now.st_ino == serve_stat.st_ino && now.st_dev == serve_stat.st_dev) {
+        unlink(serve_addr.sun_path);
+    }
+    serve_fd = -1;
+}
+
+void *serve_thread(void *args) {
+
+    struct pollfd pfd = { serve_fd, POLLIN, 0 };
+    sigset_t pipe_set;
+    int sock;
+
+    (void) args;
+    //a monitor that hangs up mid-dump must not kill the client.
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+    while (!serve_stop) {
+        //wake up now and then to notice serve_stop.
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        sock = accept4(serve_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            continue;
+        }
+        metricsDump(sock);
+        close(sock);
+    }
+    return NULL;
+}
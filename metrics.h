@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Metrics registry.
+ * Modules register a provider that writes its counters as text lines to a
+ * file descriptor. metricsDump() runs every provider in registration order,
+ * each under a "# <name>" heading. The registry is a fixed table filled at
+ * start-up, so registering and dumping never allocate.
+ */
+
+typedef void (*metricsProvider_t)(int fd);
+
+//Add a provider. Returns 0, or -1 when the table is full.
+int metricsRegister(const char *name, metricsProvider_t provider);
+
+//Write every provider's metrics to fd.
+void metricsDump(int fd);
+
+/* Serve the dump on a local socket at path, for monitors attached to a
+ * running client: every connection accepted gets one metricsDump() and is
+ * closed. Runs on its own thread. Returns 0, or -1 if the socket could not
+ * be set up.
+ */
+int metricsServe(const char *path);
+
+//Stop serving and remove the socket.
+void metricsServeStop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //METRICS_H
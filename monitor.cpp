@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Live view of a running client, like top:
+ *
+ *   monitor [-s socket] [-i interval ms]
+ *
+ * Once per interval the client's metrics socket (configMETRICS_SOCKET_PATH
+ * in main.cpp) is read, and the differences to the previous read are shown
+ * as rates: link goodput both ways, CIPSEND round-trip percentiles, queue
+ * depths, the QoS window in use, per-topic message rates, CPU use per
+ * thread and reconnects. Ctrl-C quits. While the client is not running the
+ * monitor waits for it.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//constants
+const int DUMP_LEN = 65536;
+const int RTT_BUCKETS = 100; //as in transport_esp8266.cpp
+const int THREADS_MAX = 32;
+const int TOPICS_MAX = 64;
+const int NAME_LEN = 96;
+
+struct threadSample {
+    char name[NAME_LEN];
+    double cpu_ms;
+    bool live;
+};
+
+struct topicSample {
+    char name[NAME_LEN];
+    unsigned qos, msgs_out, msgs_in;
+    unsigned long long bytes_out, bytes_in;
+};
+
+//one read of the metrics socket
+struct sample {
+    uint64_t at_us;
+    char link[8];
+    int chunk;
+    unsigned long long tx_bytes, rx_bytes;
+    unsigned cipsends;
+    int rx_ring, rx_ring_max, rx_ring_len, staged;
+    unsigned rtt[RTT_BUCKETS];
+    unsigned connections, reconnects, out, out_len, in, in_len, awaited, skipped;
+    unsigned rpc_calls, rpc_replies, rpc_timeouts;
+    int threads, topics;
+    threadSample thread[THREADS_MAX];
+    topicSample topic[TOPICS_MAX];
+};
+
+static char dump[DUMP_LEN];
+static sample samples[2];
+
+static bool read_dump(const char *path);
+static void parse(sample *s);
+static void parse_rtt(sample *s, const char *line);
+static int rtt_bucket_of(unsigned floor_us);
+static unsigned rtt_bucket_floor(int bucket);
+static unsigned percentile(const unsigned *hist, unsigned total, double p);
+static void show(const char *path, const sample *now, const sample *before);
+static uint64_t now_us(void);
+
+int main(int argc, char *argv[]) {
+
+    const char *path = "/tmp/esp8266_mqtt_client.metrics";
+    int interval_ms = 1000, opt, cur = 0;
+    bool have_before = false;
+
+    while ((opt = getopt(argc, argv, "s:i:h")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'i': interval_ms = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket (%s)] [-i interval ms (1000)]\n", argv[0], path);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (interval_ms < 100) {
+        interval_ms = 100;
+    }
+
+    for (;;) {
+        if (read_dump(path)) {
+            parse(&samples[cur]);
+            show(path, &samples[cur], have_before ? &samples[cur ^ 1] : NULL);
+            have_before = true;
+            cur ^= 1;
+        }
+        else {
+            printf("\033[H\033[2Jwaiting for a client on %s...\n", path);
+            fflush(stdout);
+            have_before = false; //a new client starts its counters over
+        }
+        usleep(interval_ms * 1000);
+    }
+}
+
+bool read_dump(const char *path) {
+
+    struct sockaddr_un addr;
+    int fd, used = 0;
+    ssize_t n;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return false;
+    }
+    while (used < DUMP_LEN - 1 && (n = read(fd, &dump[used], DUMP_LEN - 1 - used)) > 0) {
+        used += n;
+    }
+    close(fd);
+    dump[used] = 0;
+    return used > 0;
+}
+
+//Parse dump into s. Sections the client does not have stay zero.
+void parse(sample *s) {
+
+    char section[32] = "";
+    char *line, *next, *cpu;
+    unsigned long long ms, us;
+    topicSample *t;
+
+    memset(s, 0, sizeof(*s));
+    s->at_us = now_us();
+    for (line = dump; *line; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = 0;
+        }
+        else {
+            next = line + strlen(line);
+        }
+
+        if (line[0] == '#') {
+            snprintf(section, sizeof(section), "%s", line + 2);
+        }
+        else if (!strcmp(section, "transport")) {
+            if (!strncmp(line, "chunk ", 6)) {
+                sscanf(line, "chunk %d", &s->chunk);
+            }
+            else if (strstr(line, " link, ")) {
+                sscanf(line, "%7s", s->link);
+            }
+            else if (!strncmp(line, "bytes ", 6)) {
+                sscanf(line, "bytes tx %llu rx %llu, cipsend %u, rx ring %d (max %d) of %d, staged %d",
+                       &s->tx_bytes, &s->rx_bytes, &s->cipsends, &s->rx_ring, &s->rx_ring_max,
+                       &s->rx_ring_len, &s->staged);
+            }
+            else if (!strncmp(line, "cipsend rtt us", 14)) {
+                parse_rtt(s, line + 14);
+            }
+        }
+        else if (!strcmp(section, "session")) {
+            sscanf(line, "connections %u (reconnects %u), in flight out %u of %u, in %u of %u, responses awaited %u, "
+                   "publishes skipped %u", &s->connections, &s->reconnects, &s->out, &s->out_len, &s->in, &s->in_len,
+                   &s->awaited, &s->skipped);
+        }
+        else if (!strcmp(section, "rpc")) {
+            sscanf(line, "calls %u replies %u timeouts %u", &s->rpc_calls, &s->rpc_replies, &s->rpc_timeouts);
+        }
+        else if (!strcmp(section, "threads") && s->threads < THREADS_MAX) {
+            //names may hold spaces: "<name> cpu <ms> ms ..."
+            cpu = strstr(line, " cpu ");
+            if (cpu && sscanf(cpu, " cpu %llu.%llu", &ms, &us) == 2) {
+                snprintf(s->thread[s->threads].name, NAME_LEN, "%.*s", (int) (cpu - line), line);
+                s->thread[s->threads].cpu_ms = ms + us / 1000.0;
+                s->thread[s->threads].live = !strstr(cpu, " exited");
+                s->threads++;
+            }
+        }
+        else if (!strcmp(section, "topics") && s->topics < TOPICS_MAX) {
+            t = &s->topic[s->topics];
+            if (sscanf(line, "%*u %95s QoS%u out %u msgs %llu bytes, in %u msgs %llu bytes", t->name, &t->qos,
+                       &t->msgs_out, &t->bytes_out, &t->msgs_in, &t->bytes_in) == 6) {
+                s->topics++;
+            }
+        }
+    }
+}
+
+//" <floor us>:<count>" pairs, see dump_transport().
+void parse_rtt(sample *s, const char *line) {
+
+    unsigned floor_us, count;
+    int used, bucket;
+
+    while (sscanf(line, " %u:%u%n", &floor_us, &count, &used) == 2) {
+        bucket = rtt_bucket_of(floor_us);
+        if (bucket >= 0) {
+            s->rtt[bucket] = count;
+        }
+        line += used;
+    }
+}
+
+int rtt_bucket_of(unsigned floor_us) {
+    for (int i = 0; i < RTT_BUCKETS; i++) {
+        if (rtt_bucket_floor(i) == floor_us) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//four buckets per power of two, as rtt_bucket_floor() in transport_esp8266.cpp.
+unsigned rtt_bucket_floor(int bucket) {
+    if (bucket < 4) {
+        return (unsigned) bucket;
+    }
+    return (unsigned) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+//Floor of the bucket holding percentile p of total samples.
+unsigned percentile(const unsigned *hist, unsigned total, double p) {
+
+    unsigned seen = 0, rank = (unsigned) (total * p);
+
+    for (int i = 0; i < RTT_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return rtt_bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+void show(const char *path, const sample *now, const sample *before) {
+
+    unsigned rtt[RTT_BUCKETS], rtt_total = 0, max_bucket = 0;
+    double secs;
+    const threadSample *th, *was;
+    static const topicSample unseen = {}; //new topics count from zero
+    const topicSample *t, *tw;
+    time_t wall = time(NULL);
+    char clock[16];
+
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&wall));
+    printf("\033[H\033[2J%s  %s  %s link\n\n", clock, path, now->link[0] ? now->link : "no");
+    //counters going back means the client was restarted in between.
+    if (!before || now->tx_bytes < before->tx_bytes || now->rx_bytes < before->rx_bytes) {
+        printf("first sample, rates follow...\n");
+        fflush(stdout);
+        return;
+    }
+    secs = (now->at_us - before->at_us) / 1e6;
+
+    printf("link      tx %8.0f B/s   rx %8.0f B/s   cipsend %6.1f/s   chunk %d\n",
+           (now->tx_bytes - before->tx_bytes) / secs, (now->rx_bytes - before->rx_bytes) / secs,
+           (now->cipsends - before->cipsends) / secs, now->chunk);
+
+    for (int i = 0; i < RTT_BUCKETS; i++) {
+        rtt[i] = now->rtt[i] - before->rtt[i];
+        rtt_total += rtt[i];
+        if (rtt[i]) {
+            max_bucket = i;
+        }
+    }
+    if (rtt_total) {
+        printf("cipsend   rtt p50 %6.1f  p90 %6.1f  p99 %6.1f  max %6.1f ms  (%u sends, bucket floors)\n",
+               percentile(rtt, rtt_total, 0.50) / 1000.0, percentile(rtt, rtt_total, 0.90) / 1000.0,
+               percentile(rtt, rtt_total, 0.99) / 1000.0, rtt_bucket_floor(max_bucket) / 1000.0, rtt_total);
+    }
+    else {
+        printf("cipsend   rtt -, no sends this interval\n");
+    }
+
+    printf("queues    rx ring %d of %d (max %d)   tx staged %d\n",
+           now->rx_ring, now->rx_ring_len, now->rx_ring_max, now->staged);
+    printf("qos       in flight out %u of %u   in %u of %u   responses awaited %u   skipped %u\n",
+           now->out, now->out_len, now->in, now->in_len, now->awaited, now->skipped - before->skipped);
+    printf("session   connections %u   reconnects %u%s\n", now->connections, now->reconnects,
+           now->reconnects != before->reconnects ? "  (reconnected)" : "");
+    if (now->rpc_calls) {
+        printf("rpc       calls %5.1f/s   replies %5.1f/s   timeouts %u\n",
+               (now->rpc_calls - before->rpc_calls) / secs, (now->rpc_replies - before->rpc_replies) / secs,
+               now->rpc_timeouts - before->rpc_timeouts);
+    }
+
+    printf("\n%-24s %6s\n", "thread", "cpu%");
+    for (int i = 0; i < now->threads; i++) {
+        th = &now->thread[i];
+        was = i < before->threads && !strcmp(before->thread[i].name, th->name) ? &before->thread[i] : NULL;
+        if (th->live) {
+            printf("%-24s %6.1f\n", th->name, was ? (th->cpu_ms - was->cpu_ms) / 10.0 / secs : 0.0);
+        }
+    }
+
+    printf("\n%-32s %4s %9s %9s %9s %9s\n", "topic", "qos", "out msg/s", "out B/s", "in msg/s", "in B/s");
+    for (int i = 0; i < now->topics; i++) {
+        t = &now->topic[i];
+        tw = i < before->topics && !strcmp(before->topic[i].name, t->name) ? &before->topic[i] : &unseen;
+        printf("%-32s %4u %9.1f %9.0f %9.1f %9.0f\n", t->name, t->qos,
+               (t->msgs_out - tw->msgs_out) / secs, (t->bytes_out - tw->bytes_out) / secs,
+               (t->msgs_in - tw->msgs_in) / secs, (t->bytes_in - tw->bytes_in) / secs);
+    }
+    fflush(stdout);
+}
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+//The coreMQTT send and state update hooks (see core_mqtt_config.h), in a
+//module of their own so every program linking coreMQTT gets them: the
+//client, and the simulator. The client takes the state lock itself too.
+
+#include "core_mqtt_config.h"
+#include "lock_stats.h"
+
+static statMutex_t send_lock = STAT_MUTEX_INITIALIZER("mqtt send");
+static statMutex_t state_lock = STAT_MUTEX_INITIALIZER("mqtt state");
+
+void vMQTTSendLock(void) {
+    statMutexLock(&send_lock);
+}
+
+void vMQTTSendUnlock(void) {
+    statMutexUnlock(&send_lock);
+}
+
+void vMQTTStateLock(void) {
+    statMutexLock(&state_lock);
+}
+
+void vMQTTStateUnlock(void) {
+    statMutexUnlock(&state_lock);
+}
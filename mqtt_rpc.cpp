@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <time.h>
+#include "mqtt_rpc.h"
+#include "arena.h"
+#include "metrics.h"
+
+//sizes, overridable at build time (see footprint.sh).
+#ifndef configMQTT_RPC_INFLIGHT
+    #define configMQTT_RPC_INFLIGHT 16
+#endif
+#ifndef configMQTT_RPC_PAYLOAD_MAX
+    #define configMQTT_RPC_PAYLOAD_MAX 256
+#endif
+
+//constants
+const int RPC_SLOTS = 2 * configMQTT_RPC_INFLIGHT; //keeps the table at most half full
+const int RPC_ID_LEN = 8;
+const uint32_t RPC_PUMP_SLICE_MS = 10;
+static_assert((RPC_SLOTS & (RPC_SLOTS - 1)) == 0, "configMQTT_RPC_INFLIGHT must be a power of two");
+
+enum rpcState {
+    RPC_PENDING,
+    RPC_DONE
+};
+
+//id 0 marks a free slot.
+struct rpcSlot {
+    uint32_t id;
+    char state;
+    bool truncated;
+    uint32_t deadline_ms;
+    char *reply;
+    size_t reply_cap;
+    size_t reply_len;
+};
+
+static struct rpcSlot *slots = NULL;  //RPC_SLOTS of them, in the connection arena
+static uint32_t slots_generation = 0;
+static int inflight = 0, inflight_max = 0;
+static uint32_t next_id = 1;
+static pthread_mutex_t rpc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rpc_cond;
+static pthread_once_t rpc_cond_once = PTHREAD_ONCE_INIT;
+static MQTTContext_t *rpc_context = NULL;
+static topicId_t reply_topic_id = TOPIC_ID_NONE;
+static const char *reply_topic = NULL;
+static mqttRpcPump_t rpc_pump = NULL;
+static uint32_t calls = 0, replies = 0, timeouts = 0, stale = 0, truncated = 0;
+
+static void cond_init(void);
+static bool ready(void);
+static int slot_home(uint32_t id);
+static int slot_find(uint32_t id);
+static int slot_insert(uint32_t id);
+static void slot_remove(int i);
+static bool parse_id(const char *text, size_t len, uint32_t *pId);
+static mqttRpcStatus_t publish(const char *topic, uint16_t topic_len, MQTTQoS_t qos, const char *payload, size_t len);
+static uint32_t now_ms(void);
+static void dump_rpc(int fd);
+static const int rpc_metrics = metricsRegister("rpc", dump_rpc);
+
+bool mqttRpcInit(MQTTContext_t *pContext, topicId_t replyTopicId, mqttRpcPump_t pump) {
+
+    //once per process: a waiter from the previous connection may still be on it.
+    pthread_once(&rpc_cond_once, cond_init);
+
+    pthread_mutex_lock(&rpc_lock);
+    //zeroed: all free. Without a reply topic there is nothing to match replies on.
+    slots = replyTopicId == TOPIC_ID_NONE ? NULL : (struct rpcSlot *) arenaAlloc(RPC_SLOTS * sizeof(struct rpcSlot));
+    slots_generation = arenaGeneration();
+    inflight = 0;
+    rpc_context = pContext;
+    reply_topic_id = replyTopicId;
+    reply_topic = topicName(replyTopicId, NULL);
+    rpc_pump = pump;
+    pthread_cond_broadcast(&rpc_cond); //waiters on the old table give up now
+    pthread_mutex_unlock(&rpc_lock);
+    return slots != NULL;
+}
+
+mqttRpcStatus_t mqttRpcSend(const char *pTopic, MQTTQoS_t qos, const void *pRequest, size_t requestLen,
+                            void *pReply, size_t replyLen, uint32_t timeoutMs, uint32_t *pId) {
+
+    char payload[configMQTT_RPC_PAYLOAD_MAX];
+    mqttRpcStatus_t status;
+    uint32_t id;
+    int header, i;
+
+    if (!pTopic || !pId || (!pRequest && requestLen) || (!pReply && replyLen)) {
+        return MQTT_RPC_BAD_PARAMETER;
+    }
+
+    pthread_mutex_lock(&rpc_lock);
+    if (!ready()) {
+        pthread_mutex_unlock(&rpc_lock);
+        return MQTT_RPC_BAD_PARAMETER;
+    }
+    if (inflight == configMQTT_RPC_INFLIGHT) {
+        pthread_mutex_unlock(&rpc_lock);
+        return MQTT_RPC_FULL;
+    }
+    do { //ids wrap after 2^32 requests, skip 0 and any still outstanding.
+        id = next_id++;
+    } while (!id || slot_find(id) >= 0);
+    i = slot_insert(id);
+    slots[i].state = RPC_PENDING;
+    slots[i].truncated = false;
+    slots[i].deadline_ms = now_ms() + timeoutMs;
+    slots[i].reply = (char *) pReply;
+    slots[i].reply_cap = replyLen;
+    slots[i].reply_len = 0;
+    inflight++;
+    inflight_max = inflight > inflight_max ? inflight : inflight_max;
+    calls++;
+    pthread_mutex_unlock(&rpc_lock);
+
+    //registered before it goes out: the reply may come back before MQTT_Publish() returns.
+    header = snprintf(payload, sizeof(payload), "%08x:%s\n", id, reply_topic);
+    if (header < 0 || (size_t) header + requestLen > sizeof(payload)) {
+        status = MQTT_RPC_BAD_PARAMETER;
+    }
+    else {
+        memcpy(&payload[header], pRequest, requestLen);
+        status = publish(pTopic, (uint16_t) strlen(pTopic), qos, payload, header + requestLen);
+    }
+    if (status != MQTT_RPC_OK) {
+        pthread_mutex_lock(&rpc_lock);
+        //the table may have been reset while the lock was dropped, as in mqttRpcWait().
+        if (ready() && (i = slot_find(id)) >= 0) {
+            slot_remove(i);
+            inflight--;
+        }
+        pthread_mutex_unlock(&rpc_lock);
+        return status;
+    }
+    *pId = id;
+    return MQTT_RPC_OK;
+}
+
+mqttRpcStatus_t mqttRpcWait(uint32_t id, size_t *pReplyLen) {
+
+    mqttRpcStatus_t status;
+    struct timespec ts;
+    uint32_t left;
+    int i;
+
+    pthread_mutex_lock(&rpc_lock);
+    for (;;) {
+        //looked up again after every wait: removing other requests may have moved
+        //it, and an arena reset or mqttRpcInit() in between takes the table away.
+        i = ready() ? slot_find(id) : -1;
+        if (i < 0) {
+            pthread_mutex_unlock(&rpc_lock);
+            return MQTT_RPC_UNKNOWN;
+        }
+        if (slots[i].state != RPC_PENDING || (int32_t) (slots[i].deadline_ms - now_ms()) <= 0) {
+            break;
+        }
+        left = slots[i].deadline_ms - now_ms();
+        if (rpc_pump) {
+            pthread_mutex_unlock(&rpc_lock);
+            rpc_pump(rpc_context, left < RPC_PUMP_SLICE_MS ? left : RPC_PUMP_SLICE_MS);
+            pthread_mutex_lock(&rpc_lock);
+        }
+        else {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += left / 1000;
+            ts.tv_nsec += (long) (left % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&rpc_cond, &rpc_lock, &ts);
+        }
+    }
+
+    if (slots[i].state == RPC_DONE) {
+        status = slots[i].truncated ? MQTT_RPC_TRUNCATED : MQTT_RPC_OK;
+        replies++;
+    }
+    else {
+        status = MQTT_RPC_TIMEOUT;
+        timeouts++;
+    }
+    if (pReplyLen) {
+        *pReplyLen = slots[i].reply_len;
+    }
+    slot_remove(i);
+    inflight--;
+    pthread_mutex_unlock(&rpc_lock);
+    return status;
+}
+
+mqttRpcStatus_t mqttRpcCall(const char *pTopic, MQTTQoS_t qos, const void *pRequest, size_t requestLen,
+                            void *pReply, size_t replyLen, uint32_t timeoutMs, size_t *pReplyLen) {
+
+    uint32_t id;
+    mqttRpcStatus_t status = mqttRpcSend(pTopic, qos, pRequest, requestLen, pReply, replyLen, timeoutMs, &id);
+
+    return status == MQTT_RPC_OK ? mqttRpcWait(id, pReplyLen) : status;
+}
+
+bool mqttRpcHandlePublish(const MQTTPublishInfo_t *pPublishInfo, topicId_t topicId) {
+
+    const char *payload = (const char *) pPublishInfo->pPayload;
+    size_t len = pPublishInfo->payloadLength, n;
+    uint32_t id;
+    int i;
+
+    if (topicId == TOPIC_ID_NONE || topicId != reply_topic_id) {
+        return false;
+    }
+
+    pthread_mutex_lock(&rpc_lock);
+    if (!ready() || len <= RPC_ID_LEN || payload[RPC_ID_LEN] != '\n' || !parse_id(payload, RPC_ID_LEN, &id) ||
+        (i = slot_find(id)) < 0 || slots[i].state != RPC_PENDING) {
+        stale++; //malformed, or the request timed out already
+        pthread_mutex_unlock(&rpc_lock);
+        return true;
+    }
+    payload += RPC_ID_LEN + 1;
+    len -= RPC_ID_LEN + 1;
+    n = len < slots[i].reply_cap ? len : slots[i].reply_cap;
+    memcpy(slots[i].reply, payload, n);
+    slots[i].reply_len = len;
+    slots[i].truncated = n < len;
+    truncated += n < len;
+    slots[i].state = RPC_DONE;
+    pthread_cond_broadcast(&rpc_cond);
+    pthread_mutex_unlock(&rpc_lock);
+    return true;
+}
+
+bool mqttRpcParseRequest(const MQTTPublishInfo_t *pPublishInfo, uint32_t *pId,
+                         const char **ppReplyTopic, uint16_t *pReplyTopicLen,
+                         const void **ppBody, size_t *pBodyLen) {
+
+    const char *payload = (const char *) pPublishInfo->pPayload;
+    const char *end;
+    size_t len = pPublishInfo->payloadLength;
+
+    if (len <= RPC_ID_LEN + 1 || payload[RPC_ID_LEN] != ':' || !parse_id(payload, RPC_ID_LEN, pId)) {
+        return false;
+    }
+    end = (const char *) memchr(&payload[RPC_ID_LEN + 1], '\n', len - RPC_ID_LEN - 1);
+    if (!end || end == &payload[RPC_ID_LEN + 1]) {
+        return false;
+    }
+    *ppReplyTopic = &payload[RPC_ID_LEN + 1];
+    *pReplyTopicLen = (uint16_t) (end - *ppReplyTopic);
+    *ppBody = end + 1;
+    *pBodyLen = len - (end + 1 - payload);
+    return true;
+}
+
+mqttRpcStatus_t mqttRpcReply(uint32_t id, const char *pReplyTopic, uint16_t replyTopicLen, MQTTQoS_t qos,
+                             const void *pBody, size_t bodyLen) {
+
+    char payload[configMQTT_RPC_PAYLOAD_MAX];
+
+    if (!ready() || !pReplyTopic || !replyTopicLen || (!pBody && bodyLen) ||
+        RPC_ID_LEN + 1 + bodyLen > sizeof(payload)) {
+        return MQTT_RPC_BAD_PARAMETER;
+    }
+    snprintf(payload, sizeof(payload), "%08x\n", id);
+    memcpy(&payload[RPC_ID_LEN + 1], pBody, bodyLen);
+    return publish(pReplyTopic, replyTopicLen, qos, payload, RPC_ID_LEN + 1 + bodyLen);
+}
+
+mqttRpcStatus_t publish(const char *topic, uint16_t topic_len, MQTTQoS_t qos, const char *payload, size_t len) {
+
+    MQTTPublishInfo_t info;
+
+    memset(&info, 0, sizeof(info));
+    info.qos = qos;
+    info.pTopicName = topic;
+    info.topicNameLength = topic_len;
+    info.pPayload = payload;
+    info.payloadLength = len;
+    if (MQTT_Publish(rpc_context, &info, qos == MQTTQoS0 ? 0 : MQTT_GetPacketId(rpc_context)) != MQTTSuccess) {
+        return MQTT_RPC_SEND_FAILED;
+    }
+    return MQTT_RPC_OK;
+}
+
+void cond_init(void) {
+
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rpc_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//the table is gone once the arena it came from was reset.
+bool ready(void) {
+    return rpc_context && slots && slots_generation == arenaGeneration();
+}
+
+/* Open addressing with linear probing. Removal shifts the following
+ * entries of the probe run back instead of leaving tombstones, so lookups
+ * never walk over dead slots. Callers hold rpc_lock. */
+
+int slot_home(uint32_t id) {
+    return (int) ((id * 2654435761U) & (RPC_SLOTS - 1));
+}
+
+int slot_find(uint32_t id) {
+    for (int i = slot_home(id); slots[i].id; i = (i + 1) & (RPC_SLOTS - 1)) {
+        if (slots[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int slot_insert(uint32_t id) {
+
+    int i = slot_home(id);
+
+    while (slots[i].id) {
+        i = (i + 1) & (RPC_SLOTS - 1);
+    }
+    slots[i].id = id;
+    return i;
+}
+
+void slot_remove(int i) {
+
+    int j = i, home;
+
+    slots[i].id = 0;
+    for (;;) {
+        j = (j + 1) & (RPC_SLOTS - 1);
+        if (!slots[j].id) {
+            return;
+        }
+        home = slot_home(slots[j].id);
+        //an entry whose home lies cyclically in (i, j] is still reachable.
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        slots[i] = slots[j];
+        slots[j].id = 0;
+        i = j;
+    }
+}
+
+bool parse_id(const char *text, size_t len, uint32_t *pId) {
+
+    uint32_t id = 0;
+
+    for (size_t k = 0; k < len; k++) {
+        char c = text[k];
+        if (c >= '0' && c <= '9') {
+            id = id << 4 | (c - '0');
+        }
+        else if (c >= 'a' && c <= 'f') {
+            id = id << 4 | (c - 'a' + 10);
+        }
+        else {
+            return false;
+        }
+    }
+    *pId = id;
+    return id != 0;
+}
+
+uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void dump_rpc(int fd) {
+    (void) rpc_metrics;
+    pthread_mutex_lock(&rpc_lock);
+    dprintf(fd, "calls %u replies %u timeouts %u stale %u truncated %u, in flight %d (max %d of %d)\n",
+            calls, replies, timeouts, stale, truncated, inflight, inflight_max, configMQTT_RPC_INFLIGHT);
+    pthread_mutex_unlock(&rpc_lock);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef MQTT_RPC_H
+#define MQTT_RPC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "core_mqtt.h"
+#include "topic_table.h"
+
+/* Request/response over MQTT.
+ * MQTT 3.1.1 has no correlation data or response topic properties, so both
+ * travel in front of the payload, <id> being eight hex digits:
+ *   request  "<id>:<reply topic>\n<body>"
+ *   reply    "<id>\n<body>"
+ * Outstanding requests live in a fixed open addressing table keyed by id,
+ * so up to configMQTT_RPC_INFLIGHT of them can be in flight on one session
+ * and a reply is matched in O(1). The table is taken from the connection
+ * arena (arena.h) and goes with it at disconnect. Listed under "rpc" in
+ * metricsDump().
+ *
+ * The application interns and subscribes to the reply topic, and its event
+ * callback hands every incoming PUBLISH to mqttRpcHandlePublish() first,
+ * with the topic id it looked up (topic_table.h).
+ */
+
+typedef enum mqttRpcStatus {
+    MQTT_RPC_OK = 0,
+    MQTT_RPC_TRUNCATED,     //reply longer than the caller's buffer, the start was kept
+    MQTT_RPC_TIMEOUT,
+    MQTT_RPC_FULL,          //configMQTT_RPC_INFLIGHT requests outstanding already
+    MQTT_RPC_SEND_FAILED,
+    MQTT_RPC_BAD_PARAMETER,
+    MQTT_RPC_UNKNOWN        //no such request outstanding
+} mqttRpcStatus_t;
+
+//Runs the receive side for up to timeoutMs, for callers without a receive
+//thread. Same signature as the demo's process loop helper.
+typedef MQTTStatus_t (*mqttRpcPump_t)(MQTTContext_t *pContext, uint32_t timeoutMs);
+
+//Call for every connection, after the arena reset of the previous one.
+//Replies are expected on the interned topic replyTopicId. With a NULL
+//pump a receive thread is assumed to run the event callback, and waiting
+//blocks; otherwise waiting runs pump. Returns false if the arena had no
+//room for the table, or replyTopicId is TOPIC_ID_NONE; every call then
+//fails with MQTT_RPC_BAD_PARAMETER.
+bool mqttRpcInit(MQTTContext_t *pContext, topicId_t replyTopicId, mqttRpcPump_t pump);
+
+//Publish a request to pTopic and return at once, its id in *pId. The reply
+//goes to pReply, up to replyLen bytes; pReply must stay valid until
+//mqttRpcWait() for this id returns, and every request must be waited for.
+mqttRpcStatus_t mqttRpcSend(const char *pTopic, MQTTQoS_t qos, const void *pRequest, size_t requestLen,
+                            void *pReply, size_t replyLen, uint32_t timeoutMs, uint32_t *pId);
+
+//Wait for the reply to request id, until the timeout given to mqttRpcSend().
+//The reply length (before truncation) goes to *pReplyLen, if not NULL.
+//MQTT_RPC_UNKNOWN if the connection, and the request with it, went away.
+mqttRpcStatus_t mqttRpcWait(uint32_t id, size_t *pReplyLen);
+
+//mqttRpcSend() and mqttRpcWait() in one.
+mqttRpcStatus_t mqttRpcCall(const char *pTopic, MQTTQoS_t qos, const void *pRequest, size_t requestLen,
+                            void *pReply, size_t replyLen, uint32_t timeoutMs, size_t *pReplyLen);
+
+//From the event callback, with the id of the publish's topic. True if it
+//was the reply topic; the publish then completes its request, and the
+//application should ignore it. No string compare, the id decides.
+bool mqttRpcHandlePublish(const MQTTPublishInfo_t *pPublishInfo, topicId_t topicId);
+
+//Responder side. Split a request into its id, reply topic and body; the
+//pointers refer into the publish. False if it is not a request.
+bool mqttRpcParseRequest(const MQTTPublishInfo_t *pPublishInfo, uint32_t *pId,
+                         const char **ppReplyTopic, uint16_t *pReplyTopicLen,
+                         const void **ppBody, size_t *pBodyLen);
+
+//Responder side. Publish the reply to request id on its reply topic.
+mqttRpcStatus_t mqttRpcReply(uint32_t id, const char *pReplyTopic, uint16_t replyTopicLen, MQTTQoS_t qos,
+                             const void *pBody, size_t bodyLen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //MQTT_RPC_H
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <time.h>
+#include "periodic.h"
+#include "metrics.h"
+
+//constants
+const int PERIODIC_TASKS_MAX = 8;
+
+struct periodicTask {
+    const char *name;
+    uint64_t period_ns;
+    uint64_t release_ns;      //next release on the grid
+    uint64_t last_ns;         //when the previous release happened, 0 before the first
+    uint64_t releases;
+    uint64_t missed;
+    uint64_t late_sum_ns;
+    uint64_t late_max_ns;
+    int64_t interval_min_ns;  //interval between releases, minus the period
+    int64_t interval_max_ns;
+};
+
+static struct periodicTask tasks[PERIODIC_TASKS_MAX];
+static int task_count = 0;
+
+static uint64_t now_ns(void);
+static int next_task(void);
+static void dump_periodic(int fd);
+static const int periodic_metrics = metricsRegister("periodic", dump_periodic);
+
+int periodicAdd(const char *name, uint32_t periodMs) {
+
+    if (task_count == PERIODIC_TASKS_MAX || !periodMs) {
+        return -1;
+    }
+    memset(&tasks[task_count], 0, sizeof(tasks[task_count]));
+    tasks[task_count].name = name;
+    tasks[task_count].period_ns = periodMs * 1000000ULL;
+    return task_count++;
+}
+
+void periodicStart(void) {
+
+    uint64_t start = now_ns(), slot = UINT64_MAX;
+
+    for (int i = 0; i < task_count; i++) {
+        slot = tasks[i].period_ns < slot ? tasks[i].period_ns : slot;
+    }
+    slot = task_count ? slot / task_count : 0;
+    for (int i = 0; i < task_count; i++) {
+        tasks[i].release_ns = start + i * slot;
+        tasks[i].last_ns = 0;
+    }
+}
+
+int periodicWait(void) {
+
+    int i = next_task();
+    struct periodicTask *t;
+    struct timespec ts;
+    uint64_t now, late;
+    int64_t interval;
+
+    if (i < 0) {
+        return -1;
+    }
+    t = &tasks[i];
+    ts.tv_sec = t->release_ns / 1000000000ULL;
+    ts.tv_nsec = t->release_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+    now = now_ns();
+    late = now > t->release_ns ? now - t->release_ns : 0;
+    t->late_sum_ns += late;
+    t->late_max_ns = late > t->late_max_ns ? late : t->late_max_ns;
+    if (t->last_ns) {
+        interval = (int64_t) (now - t->last_ns) - (int64_t) t->period_ns;
+        if (t->releases == 1 || interval < t->interval_min_ns) {
+            t->interval_min_ns = interval;
+        }
+        if (t->releases == 1 || interval > t->interval_max_ns) {
+            t->interval_max_ns = interval;
+        }
+    }
+    t->last_ns = now;
+    t->releases++;
+
+    //stay on the grid; releases already overdue are dropped, not bunched up.
+    t->release_ns += t->period_ns;
+    while (t->release_ns <= now) {
+        t->release_ns += t->period_ns;
+        t->missed++;
+    }
+    return i;
+}
+
+uint32_t periodicTimeToNextMs(void) {
+
+    int i = next_task();
+    uint64_t now = now_ns();
+
+    if (i < 0 || tasks[i].release_ns <= now) {
+        return 0;
+    }
+    return (uint32_t) ((tasks[i].release_ns - now) / 1000000ULL);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//earliest release; ties go to the lower index.
+int next_task(void) {
+
+    int next = -1;
+
+    for (int i = 0; i < task_count; i++) {
+        if (next < 0 || tasks[i].release_ns < tasks[next].release_ns) {
+            next = i;
+        }
+    }
+    return next;
+}
+
+void dump_periodic(int fd) {
+    (void) periodic_metrics;
+    for (int i = 0; i < task_count; i++) {
+        struct periodicTask *t = &tasks[i];
+        dprintf(fd, "%s period %llu ms released %llu missed %llu late avg %llu us max %llu us"
+                " interval %+lld..%+lld us\n", t->name, (unsigned long long) t->period_ns / 1000000,
+                (unsigned long long) t->releases, (unsigned long long) t->missed,
+                (unsigned long long) (t->releases ? t->late_sum_ns / t->releases / 1000 : 0),
+                (unsigned long long) t->late_max_ns / 1000,
+                (long long) t->interval_min_ns / 1000, (long long) t->interval_max_ns / 1000);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PERIODIC_H
+#define PERIODIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Periodic release scheduler.
+ * Tasks are released on a fixed grid: start + phase + k * period, on
+ * CLOCK_MONOTONIC, and periodicWait() sleeps to the next release with an
+ * absolute deadline. However long the work after a release takes, the
+ * following release does not move. Phases spread the tasks evenly over the
+ * shortest period, so tasks of equal period never come due together. A
+ * release more than a period late skips the grid points already passed,
+ * counted as missed. Per task release lateness and the spread of the
+ * intervals between releases are listed under "periodic" in metricsDump().
+ * The table is fixed, nothing allocates; use from one thread.
+ */
+
+//Add a task released every periodMs. Returns its index, -1 when the table is full.
+int periodicAdd(const char *name, uint32_t periodMs);
+
+//Start the grid now, every task at its phase. Also restarts a running schedule.
+void periodicStart(void);
+
+//Sleep until the next release and return the index of the task released.
+int periodicWait(void);
+
+//Time left until the next release, in ms; 0 if one is due.
+uint32_t periodicTimeToNextMs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PERIODIC_H
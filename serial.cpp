@@ -26,14 +26,27 @@
 #include <cstdio>
 #include <cassert>
 #include <cerrno>
+#include <cstring>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 #include "serial.h"
+#include "flight_recorder.h"
+#include "alloc_track.h"
+#include "lock_stats.h"
+#include "thread_stats.h"
 
 //constants
 const char *serialPortName = "/dev/ttyUSB0";
-const char new_line = '\n';
+const int RX_CHUNK_LEN = 64; //bytes taken from the device per read() call
+const int RX_POLL_MS = 100; //how often rxThread checks run while the line is idle
+const int SYSFS_PATH_LEN = 128;
+#ifndef configSERIAL_LATENCY_TIMER_MS
+    #define configSERIAL_LATENCY_TIMER_MS 1 //FTDI defaults to 16 ms, each small read waits that long
+#endif
 
 //global variables
 static int serial_fd = 0;
@@ -42,57 +55,74 @@ static char *rxBuffer;
 static char *txBuffer;
 static unsigned int rxPos = 0;
 static unsigned int txPos = 0;
-static pthread_mutex_t rxBufferLock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t txBufferLock = PTHREAD_MUTEX_INITIALIZER;
+static statMutex_t rxBufferLock = STAT_MUTEX_INITIALIZER("serial rxBufferLock");
+static statMutex_t txBufferLock = STAT_MUTEX_INITIALIZER("serial txBufferLock");
 static pthread_t comThreads[2]; //rx and tx threads respectivelly
 static int run = 0; //threads will run while run != 0
+static xSerialRxCallback rxCallback = NULL; //protected by rxBufferLock
+static const char *sysfsRoot = "/sys";
 
 static void *rxThread(void *args);
 static void *txThread(void *args);
+static void start_threads(unsigned portBASE_TYPE uxQueueLength);
+static void stop_threads(void);
+static void tune_adapter(void);
 
 xComPortHandle xSerialPortInitMinimal(unsigned long ulWantedBaud, unsigned portBASE_TYPE uxQueueLength) {
 
-    int rc;
     serial_fd = open(serialPortName, O_RDWR);
 
     if (!serial_fd) {
         perror("Could not open '/dev/ttyUSB0'");
+        flightRecorderDump("serial open failed");
         exit(-1);
     }
 
-    bufferLen = uxQueueLength;
-    rxBuffer = (char*) malloc(bufferLen);
-    assert(rxBuffer);
-    txBuffer = (char*) malloc(bufferLen);
-    assert(txBuffer);
+    tune_adapter();
+    start_threads(uxQueueLength);
+    return NULL;
+}
 
-    //these threads will only stop when run == 0;
-    run = 1;
-    rc = pthread_create(&comThreads[0], NULL, &rxThread, NULL);
-    assert(!rc);
-    rc = pthread_create(&comThreads[1], NULL, &txThread, NULL);
-    assert(!rc);
+xComPortHandle xSerialPortInitFromFd(int fd, unsigned portBASE_TYPE uxQueueLength) {
 
+    serial_fd = fd;
+    start_threads(uxQueueLength);
     return NULL;
 }
 
+int xSerialDetach(xComPortHandle xPort) {
+
+    int fd = serial_fd;
+
+    if (serial_fd) {
+        //let txThread push out what is queued, it belongs to the current owner.
+        for (int i = 0; txPos && i < 100; i++) {
+            usleep(1000);
+        }
+        stop_threads();
+        serial_fd = 0;
+    }
+    return fd;
+}
+
 signed portBASE_TYPE xSerialGetChar(xComPortHandle pxPort, signed char *pcRxedChar, TickType_t xBlockTime) {
 
     if (!serial_fd) {
         errno = EBADF;
         perror("/dev/ttyUSB0 not ready. Did you call xSerialPortInitMinimal first?");
+        flightRecorderDump("serial used before init");
         exit(-1);
     }
 
     for (unsigned char d = 6; d > 0; d--) {
         if (rxPos) {
-            pthread_mutex_lock(&rxBufferLock);
+            statMutexLock(&rxBufferLock);
             *pcRxedChar = *rxBuffer;
             for (unsigned int i = 0; i < rxPos - 1; i++) {
                 rxBuffer[i] = rxBuffer[i+1];
             }
             rxPos--;
-            pthread_mutex_unlock(&rxBufferLock);
+            statMutexUnlock(&rxBufferLock);
             return 1;
         }
         usleep(10000);
@@ -105,14 +135,15 @@ signed portBASE_TYPE xSerialPutChar(xComPortHandle pxPort, signed char cOutChar,
     if (!serial_fd) {
         errno = EBADF;
         perror("/dev/ttyUSB0 not ready. Did you call xSerialPortInitMinimal first?");
+        flightRecorderDump("serial used before init");
         exit(-1);
     }
 
     if (txPos < bufferLen) {
-        pthread_mutex_lock(&txBufferLock);
+        statMutexLock(&txBufferLock);
         *(txBuffer + txPos) = cOutChar;
         txPos++;
-        pthread_mutex_unlock(&txBufferLock);
+        statMutexUnlock(&txBufferLock);
         return 1;
     }
     else {
@@ -120,78 +151,245 @@ signed portBASE_TYPE xSerialPutChar(xComPortHandle pxPort, signed char cOutChar,
     }
 }
 
+void vSerialSetRxCallback(xComPortHandle xPort, xSerialRxCallback pxCallback) {
+
+    statMutexLock(&rxBufferLock);
+    //hand over whatever arrived before the hook was registered.
+    if (pxCallback && rxPos) {
+        pxCallback(rxBuffer, rxPos);
+        rxPos = 0;
+    }
+    rxCallback = pxCallback;
+    statMutexUnlock(&rxBufferLock);
+}
+
+void vSerialSetSysfsRoot(const char *pcRoot) {
+    sysfsRoot = pcRoot;
+}
+
 void vSerialClose(xComPortHandle xPort) {
 
     int rc;
 
     if (serial_fd) {
-        //stop threads.
-        run = 0; rxPos = 0; txPos = 0;
-        //rx thread may be blocked at read...
-        //thus send \n. The esp8266 device will reply with an error unblocking the rxThread...
-        write(serial_fd, &new_line, 1);
-        rc = pthread_join(comThreads[0], NULL);
-        assert(!rc);
-        rc = pthread_join(comThreads[1], NULL);
-        assert(!rc);
-
-        //free rx and tx buffers
-        free(rxBuffer);
-        free(txBuffer);
-        bufferLen = 0;
+        stop_threads();
 
         //close serial_fd
         rc = close(serial_fd);
         assert(!rc);
+        serial_fd = 0;
     }
 
     return;
 }
 
+static int read_sysfs_int(const char *path) {
+
+    char value[16];
+    int fd, n;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    n = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    value[n] = 0;
+    return atoi(value);
+}
+
+static bool write_sysfs_int(const char *path, int value) {
+
+    char text[16];
+    int fd, n;
+    bool written;
+
+    fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd == -1) {
+        return false;
+    }
+    n = snprintf(text, sizeof(text), "%d", value);
+    written = write(fd, text, n) == n;
+    close(fd);
+    return written;
+}
+
+/* FTDI chips hold received bytes until their latency timer (16 ms by default)
+ * runs out or their buffer fills, so every small read pays up to 16 ms before
+ * rxThread sees it. ftdi_sio exposes the timer in sysfs. ASYNC_LOW_LATENCY is
+ * requested as well, ftdi_sio maps it to a 1 ms timer and other drivers (CH340
+ * has no timer to tune) accept or ignore it.
+ */
+void tune_adapter(void) {
+
+    char path[SYSFS_PATH_LEN], driver[SYSFS_PATH_LEN], *device;
+    const char *tty, *driver_name = "unknown";
+    int before, latency, n;
+    bool low_latency = false;
+    struct serial_struct ss;
+
+    device = realpath(serialPortName, NULL); //e.g. a /dev/serial/by-id link
+    if (!device) {
+        return;
+    }
+    tty = strrchr(device, '/') + 1;
+
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device/driver", sysfsRoot, tty);
+    n = readlink(path, driver, sizeof(driver) - 1);
+    if (n > 0) {
+        driver[n] = 0;
+        driver_name = strrchr(driver, '/') ? strrchr(driver, '/') + 1 : driver;
+    }
+
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device/latency_timer", sysfsRoot, tty);
+    before = latency = read_sysfs_int(path);
+    if (before > configSERIAL_LATENCY_TIMER_MS && write_sysfs_int(path, configSERIAL_LATENCY_TIMER_MS)) {
+        latency = read_sysfs_int(path);
+    }
+
+    if (!ioctl(serial_fd, TIOCGSERIAL, &ss)) {
+        ss.flags |= ASYNC_LOW_LATENCY;
+        low_latency = !ioctl(serial_fd, TIOCSSERIAL, &ss);
+    }
+
+    if (latency == -1) {
+        printf("Serial adapter %s (%s): no latency timer, low latency mode %s.\n",
+               tty, driver_name, low_latency ? "on" : "not supported");
+    }
+    else {
+        printf("Serial adapter %s (%s): latency timer %d ms (was %d ms), low latency mode %s.\n",
+               tty, driver_name, latency, before, low_latency ? "on" : "not supported");
+    }
+    flightRecordf(FR_NOTE, "%s %s latency %d ms%s", tty, driver_name, latency, low_latency ? " low_latency" : "");
+    free(device);
+}
+
+void start_threads(unsigned portBASE_TYPE uxQueueLength) {
+
+    int rc;
+    ALLOC_SCOPE(ALLOC_SERIAL); //the queues are the serial layer's whole heap
+
+    bufferLen = uxQueueLength;
+    rxBuffer = (char*) malloc(bufferLen);
+    assert(rxBuffer);
+    txBuffer = (char*) malloc(bufferLen);
+    assert(txBuffer);
+
+    //these threads will only stop when run == 0;
+    run = 1;
+    rc = pthread_create(&comThreads[0], NULL, &rxThread, NULL);
+    assert(!rc);
+    rc = pthread_create(&comThreads[1], NULL, &txThread, NULL);
+    assert(!rc);
+}
+
+void stop_threads(void) {
+
+    int rc;
+
+    //stop threads. rxThread polls, so it notices within RX_POLL_MS.
+    run = 0; rxPos = 0; txPos = 0;
+    rc = pthread_join(comThreads[0], NULL);
+    assert(!rc);
+    rc = pthread_join(comThreads[1], NULL);
+    assert(!rc);
+
+    //free rx and tx buffers
+    free(rxBuffer);
+    free(txBuffer);
+    bufferLen = 0;
+}
+
 void *rxThread(void *args) {
-    char c;
+    char chunk[RX_CHUNK_LEN];
+    ssize_t n;
+    xSerialRxCallback callback;
+    struct pollfd pfd;
+    threadStats_t *stats = threadStatsRegister("serial rx");
+    ALLOC_SCOPE(ALLOC_SERIAL);
+
+    pfd.fd = serial_fd;
+    pfd.events = POLLIN;
     while (run) {
-        if (read(serial_fd, &c, 1) == -1) { //read will block till there is something to read in serial device.
+        //wait for input, but wake up now and then to check run.
+        n = poll(&pfd, 1, RX_POLL_MS);
+        threadStatsWakeup(stats, n > 0);
+        if (n == 0 || (n == -1 && errno == EINTR)) {
+            continue;
+        }
+        if (n > 0) {
+            n = read(serial_fd, chunk, RX_CHUNK_LEN);
+        }
+        if (n == -1) {
             perror("Error trying to read from serial device.");
+            flightRecordf(FR_NOTE, "serial read failed, errno %d", errno);
             run = 0;
             break;
         }
-check_rx_buffer:
-        if (rxPos < bufferLen) {
-            pthread_mutex_lock(&rxBufferLock);
-            *(rxBuffer + rxPos) = c;
-            rxPos++;
-            pthread_mutex_unlock(&rxBufferLock);
+        if (n == 0) { //POLLHUP or end of file: the adapter is gone, nothing more to read.
+            fprintf(stderr, "Serial device hung up.\n");
+            flightRecordf(FR_NOTE, "serial hang-up, revents 0x%x", pfd.revents);
+            run = 0;
+            break;
         }
-        else {
-            usleep(10000); //block, then check for available space in rxBuffer;
-            goto check_rx_buffer;
+        flightRecord(FR_SERIAL_RX, chunk, n);
+
+        statMutexLock(&rxBufferLock);
+        callback = rxCallback;
+        statMutexUnlock(&rxBufferLock);
+        if (callback) { //consumer parses the chunk in place, no rxBuffer copy.
+            callback(chunk, n);
+            continue;
+        }
+
+        for (ssize_t i = 0; i < n; i++) {
+check_rx_buffer:
+            if (rxPos < bufferLen) {
+                statMutexLock(&rxBufferLock);
+                *(rxBuffer + rxPos) = chunk[i];
+                rxPos++;
+                statMutexUnlock(&rxBufferLock);
+            }
+            else {
+                usleep(10000); //block, then check for available space in rxBuffer;
+                goto check_rx_buffer;
+            }
         }
     }
 
+    threadStatsUnregister(stats);
     return NULL;
 }
 
 void *txThread(void *args) {
+    threadStats_t *stats = threadStatsRegister("serial tx");
+    ALLOC_SCOPE(ALLOC_SERIAL);
 
     while (run) {
+        threadStatsWakeup(stats, txPos != 0);
         if (txPos) { //bytes available to send?
-            pthread_mutex_lock(&txBufferLock);
+            statMutexLock(&txBufferLock);
             for (unsigned int i = 0; i < txPos; i++) {
                 if (write(serial_fd, &txBuffer[i], 1) == -1) {
                     perror("Error trying to write to serial device.");
+                    flightRecordf(FR_NOTE, "serial write failed, errno %d", errno);
                     run = 0;
-                    pthread_mutex_unlock(&txBufferLock);
+                    statMutexUnlock(&txBufferLock);
                     goto stop;
                 }
             }
+            flightRecord(FR_SERIAL_TX, txBuffer, txPos);
             txPos = 0;
-            pthread_mutex_unlock(&txBufferLock);
+            statMutexUnlock(&txBufferLock);
         }
         else {
             usleep(1000); //block, then check for bytes in tx_Buffer again.
         }
     }
 stop:
+    threadStatsUnregister(stats);
     return NULL;
 }
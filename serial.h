@@ -33,6 +33,11 @@
 #define portBASE_TYPE char
 typedef void * xComPortHandle;
 
+/* Receive hook, called from the serial reader thread with every chunk read
+ * from the device. While a hook is registered, received bytes bypass the rx
+ * buffer and are not available through xSerialGetChar(). */
+typedef void (*xSerialRxCallback)( const char *pcData, unsigned long ulLength );
+
 typedef enum
 {
     serCOM1,
@@ -107,6 +112,19 @@ signed portBASE_TYPE xSerialPutChar( xComPortHandle pxPort,
                                      signed char cOutChar,
                                      TickType_t xBlockTime );
 portBASE_TYPE xSerialWaitForSemaphore( xComPortHandle xPort );
+void vSerialSetRxCallback( xComPortHandle xPort,
+                           xSerialRxCallback pxCallback );
 void vSerialClose( xComPortHandle xPort );
 
+/* Hand-off support: take over a device opened elsewhere, or stop using the
+ * device without closing it and return its file descriptor. */
+xComPortHandle xSerialPortInitFromFd( int iFd,
+                                      unsigned portBASE_TYPE uxQueueLength );
+int xSerialDetach( xComPortHandle xPort );
+
+/* USB-serial adapters (FTDI, CH340) are tuned for latency when the port is
+ * opened: the latency timer is found under <root>/class/tty/<tty>/device.
+ * root is "/sys" unless changed here, before xSerialPortInitMinimal(). */
+void vSerialSetSysfsRoot( const char *pcRoot );
+
 #endif /* ifndef SERIAL_SERIAL_H */
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* tune_adapter() without an adapter: a pty stands in for the USB-serial port
+ * and a temporary directory for /sys, laid out as ftdi_sio lays it out with
+ * the latency timer at its 16 ms default. Opening the port must bring the
+ * timer down to configSERIAL_LATENCY_TIMER_MS.
+ *
+ *   serial_check       exits 0 if the timer was tuned
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pty.h>
+#include <sys/stat.h>
+#include "serial.h"
+
+//constants
+const int PATH_LEN = 256;
+const int LATENCY_TIMER_DEFAULT_MS = 16;
+#ifndef configSERIAL_LATENCY_TIMER_MS
+    #define configSERIAL_LATENCY_TIMER_MS 1
+#endif
+
+extern const char *serialPortName;
+
+static bool make_sysfs(const char *root, const char *tty);
+static int read_latency_timer(const char *root, const char *tty);
+
+int main(void) {
+
+    char root[] = "/tmp/serial_check.XXXXXX", command[PATH_LEN], tty_path[PATH_LEN];
+    const char *tty;
+    int master, slave, latency;
+
+    if (openpty(&master, &slave, tty_path, NULL, NULL) || !mkdtemp(root)) {
+        perror("serial_check: no pty or temporary directory");
+        return 1;
+    }
+    tty = strrchr(tty_path, '/') + 1;
+    if (!make_sysfs(root, tty)) {
+        perror("serial_check: could not lay out the sysfs tree");
+        return 1;
+    }
+
+    serialPortName = tty_path;
+    vSerialSetSysfsRoot(root);
+    xSerialPortInitMinimal(115200, 64);
+    vSerialClose(NULL);
+    latency = read_latency_timer(root, tty);
+
+    close(slave);
+    close(master);
+    snprintf(command, sizeof(command), "rm -rf %s", root);
+    if (system(command)) {
+        fprintf(stderr, "serial_check: %s left behind\n", root);
+    }
+
+    if (latency != configSERIAL_LATENCY_TIMER_MS) {
+        fprintf(stderr, "serial_check: latency timer %d ms, expected %d ms\n", latency, configSERIAL_LATENCY_TIMER_MS);
+        return 1;
+    }
+    printf("serial_check: latency timer %d ms -> %d ms\n", LATENCY_TIMER_DEFAULT_MS, latency);
+    return 0;
+}
+
+//<root>/class/tty/<tty>/device/{driver,latency_timer}
+bool make_sysfs(const char *root, const char *tty) {
+
+    char path[PATH_LEN];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/class", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/class/tty", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/class/tty/%s", root, tty);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device", root, tty);
+    if (mkdir(path, 0755)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device/driver", root, tty);
+    if (symlink("../../../bus/usb-serial/drivers/ftdi_sio", path)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device/latency_timer", root, tty);
+    f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    fprintf(f, "%d\n", LATENCY_TIMER_DEFAULT_MS);
+    return !fclose(f);
+}
+
+int read_latency_timer(const char *root, const char *tty) {
+
+    char path[PATH_LEN];
+    FILE *f;
+    int latency = -1;
+
+    snprintf(path, sizeof(path), "%s/class/tty/%s/device/latency_timer", root, tty);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &latency) != 1) {
+            latency = -1;
+        }
+        fclose(f);
+    }
+    return latency;
+}
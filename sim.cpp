@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Link simulator: predicts throughput and latency of a publish workload for
+ * a given link, without the hardware. The transport and coreMQTT run as in
+ * the client, on sim_link's model of the serial port, module, Wi-Fi and
+ * broker, against a virtual clock.
+ *
+ *   sim [options]      see usage() for the workload and model options
+ *
+ * The client publishes messages of one size and QoS, back to back or at a
+ * fixed interval, keeping at most a window of them unacknowledged, and by
+ * default is subscribed to its own topic. Reported: goodput, the publish to
+ * PUBACK/PUBCOMP latency and the publish to echo latency percentiles, then
+ * the transport and link counters.
+ *
+ * Only one module is simulated, the transport being a single instance. For
+ * more modules on one broker, the aggregate rate is scaled from the
+ * broker's load in this run; latencies are those of a single module.
+ *
+ * Built with ALLOC_TRACKING=1, the run fails if serial, transport or MQTT
+ * allocate once the first message has been acknowledged and echoed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include "core_mqtt.h"
+#include "transport_esp8266.h"
+#include "metrics.h"
+#include "alloc_track.h"
+#include "sim_link.h"
+
+//constants
+const uint32_t PAYLOAD_MAX = 4096;
+const uint32_t WINDOW_MAX = 64;
+const uint32_t DRAIN_TIMEOUT_US = 10000000; //after the last publish
+const char *TOPIC = "sim/load";
+
+//model, from the command line
+static simLinkParams_t link_params = { 115200, 1000, 300, 1, 5000, 0, 200 };
+
+//workload, from the command line
+static uint32_t messages = 1000, payload_len = 64, interval_us = 0, window = 8, modules = 1;
+static uint32_t linger_ms = 0, ack_hold_ms = 0, poll_us = 100;
+static MQTTQoS_t qos = MQTTQoS1;
+static bool loopback = true, framed = false, calibrate = false;
+
+//results
+static std::vector<uint64_t> sent_us;
+static std::vector<bool> echo_seen;
+static std::vector<uint32_t> ack_latency, echo_latency;
+static uint64_t packet_sent_us[65536];
+static uint32_t acked = 0, echoed = 0;
+static bool subscribed = false;
+
+static MQTTContext_t mqtt;
+static uint8_t network_buffer[PAYLOAD_MAX + 256];
+static MQTTPubAckInfo_t outgoing_records[WINDOW_MAX], incoming_records[WINDOW_MAX];
+
+static void usage(const char *name);
+static int32_t sim_recv(NetworkContext_t *pNetworkContext, void *pBuffer, size_t bytesToRecv);
+static uint32_t sim_time_ms(void);
+static void event_callback(MQTTContext_t *pContext, MQTTPacketInfo_t *pPacketInfo,
+                           MQTTDeserializedInfo_t *pDeserializedInfo);
+static void process(void);
+static void report_latency(const char *what, std::vector<uint32_t> &samples, uint32_t expected);
+
+int main(int argc, char *argv[]) {
+
+    TransportInterface_t transport;
+    MQTTFixedBuffer_t buffer = { network_buffer, sizeof(network_buffer) };
+    MQTTConnectInfo_t connect_info;
+    MQTTSubscribeInfo_t subscription;
+    MQTTPublishInfo_t publish;
+    std::vector<char> payload;
+    uint64_t start, end, deadline;
+    clock_t cpu_start;
+    bool session, marked = false;
+    double elapsed_s, load;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:q:i:w:l:k:p:fcxm:b:a:d:y:r:t:D:h")) != -1) {
+        switch (opt) {
+        case 'n': messages = strtoul(optarg, NULL, 0); break;
+        case 's': payload_len = strtoul(optarg, NULL, 0); break;
+        case 'q': qos = (MQTTQoS_t) atoi(optarg); break;
+        case 'i': interval_us = strtoul(optarg, NULL, 0); break;
+        case 'w': window = strtoul(optarg, NULL, 0); break;
+        case 'l': linger_ms = strtoul(optarg, NULL, 0); break;
+        case 'k': ack_hold_ms = strtoul(optarg, NULL, 0); break;
+        case 'p': poll_us = strtoul(optarg, NULL, 0); break;
+        case 'f': framed = true; break;
+        case 'c': calibrate = true; break;
+        case 'x': loopback = false; break;
+        case 'm': modules = strtoul(optarg, NULL, 0); break;
+        case 'b': link_params.baud = strtoul(optarg, NULL, 0); break;
+        case 'a': link_params.adapterLatencyUs = strtoul(optarg, NULL, 0); break;
+        case 'd': link_params.atDelayUs = strtoul(optarg, NULL, 0); break;
+        case 'y': link_params.sendUsPerByte = strtoul(optarg, NULL, 0); break;
+        case 'r': link_params.wifiRttUs = strtoul(optarg, NULL, 0); break;
+        case 't': link_params.tlsHandshakeUs = strtoul(optarg, NULL, 0); break;
+        case 'D': link_params.brokerDelayUs = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!messages || payload_len < sizeof(uint32_t) || payload_len > PAYLOAD_MAX || qos > MQTTQoS2 ||
+        !window || window > WINDOW_MAX || !modules || !link_params.baud) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("sim: %u x %u bytes QoS%d, %s, window %u%s, linger %u ms, ack hold %u ms%s\n", messages, payload_len,
+           (int) qos, interval_us ? "paced" : "back to back", window, loopback ? ", loopback" : "",
+           linger_ms, ack_hold_ms, framed ? ", framed recv" : "");
+    printf("link: %u baud, adapter %u us, AT %u us + %u us/byte, RTT %u us, %s, broker %u us/packet\n",
+           link_params.baud, link_params.adapterLatencyUs, link_params.atDelayUs, link_params.sendUsPerByte,
+           link_params.wifiRttUs, link_params.tlsHandshakeUs ? "SSL" : "TCP", link_params.brokerDelayUs);
+
+    simLinkInit(&link_params);
+    cpu_start = clock();
+    esp8266AT_SetSendLinger(linger_ms);
+    esp8266AT_SetAckHold(ack_hold_ms);
+    esp8266AT_SetFramedRecv(framed);
+    if (link_params.tlsHandshakeUs) {
+        esp8266AT_SetSSL(true, 4096);
+    }
+    if (esp8266AT_Connect("\"192.0.2.1\"", link_params.tlsHandshakeUs ? "8883" : "1883") != ESP8266_TRANSPORT_SUCCESS) {
+        fprintf(stderr, "sim: the transport did not connect\n");
+        return 1;
+    }
+
+    transport.pNetworkContext = NULL;
+    transport.send = esp8266AT_send;
+    transport.recv = sim_recv;
+    transport.writev = NULL;
+    if (MQTT_Init(&mqtt, &transport, sim_time_ms, event_callback, &buffer) != MQTTSuccess ||
+        MQTT_InitStatefulQoS(&mqtt, outgoing_records, WINDOW_MAX, incoming_records, WINDOW_MAX) != MQTTSuccess) {
+        fprintf(stderr, "sim: coreMQTT init failed\n");
+        return 1;
+    }
+
+    memset(&connect_info, 0, sizeof(connect_info));
+    connect_info.cleanSession = true;
+    connect_info.pClientIdentifier = "sim";
+    connect_info.clientIdentifierLength = 3;
+    connect_info.keepAliveSeconds = 60;
+    if (MQTT_Connect(&mqtt, &connect_info, NULL, 5000, &session) != MQTTSuccess) {
+        fprintf(stderr, "sim: no CONNACK\n");
+        return 1;
+    }
+    printf("connected in %u ms\n", (unsigned) (simLinkNowUs() / 1000));
+    if (calibrate) {
+        esp8266AT_Calibrate(NULL, true);
+    }
+
+    if (loopback) {
+        subscription.qos = qos;
+        subscription.pTopicFilter = TOPIC;
+        subscription.topicFilterLength = (uint16_t) strlen(TOPIC);
+        if (MQTT_Subscribe(&mqtt, &subscription, 1, MQTT_GetPacketId(&mqtt)) != MQTTSuccess) {
+            fprintf(stderr, "sim: subscribe failed\n");
+            return 1;
+        }
+        while (!subscribed) {
+            process();
+        }
+    }
+
+    sent_us.assign(messages, 0);
+    echo_seen.assign(messages, false);
+    payload.assign(payload_len, 'x');
+    memset(&publish, 0, sizeof(publish));
+    publish.qos = qos;
+    publish.pTopicName = TOPIC;
+    publish.topicNameLength = (uint16_t) strlen(TOPIC);
+    publish.pPayload = payload.data();
+    publish.payloadLength = payload_len;
+
+    start = simLinkNowUs();
+    for (uint32_t i = 0; i < messages; i++) {
+        do { //the client reads between publishes, whatever the pacing.
+            process();
+        } while (simLinkNowUs() < start + (uint64_t) i * interval_us || (qos != MQTTQoS0 && i - acked >= window));
+#if configALLOC_TRACKING
+        //one message has been all the way round, later ones must not allocate.
+        if (!marked && (qos == MQTTQoS0 || acked) && (!loopback || echoed)) {
+            allocTrackMark();
+            marked = true;
+        }
+#endif
+        uint16_t packet_id = qos != MQTTQoS0 ? MQTT_GetPacketId(&mqtt) : 0;
+        memcpy(payload.data(), &i, sizeof(i)); //the echo is matched by sequence number
+        sent_us[i] = packet_sent_us[packet_id] = simLinkNowUs();
+        ALLOC_SCOPE(ALLOC_MQTT);
+        if (MQTT_Publish(&mqtt, &publish, packet_id) != MQTTSuccess) {
+            fprintf(stderr, "sim: publish %u failed\n", i);
+            return 1;
+        }
+    }
+
+    deadline = simLinkNowUs() + DRAIN_TIMEOUT_US;
+    while (((qos != MQTTQoS0 && acked < messages) || (loopback && echoed < messages)) && simLinkNowUs() < deadline) {
+        process();
+    }
+    end = simLinkNowUs();
+    esp8266AT_Flush();
+
+    elapsed_s = (end - start) / 1e6;
+    printf("virtual %.3f s, simulated in %.3f s CPU\n", elapsed_s, (double) (clock() - cpu_start) / CLOCKS_PER_SEC);
+    printf("goodput %.0f bytes/s, %.1f msg/s\n", messages * (double) payload_len / elapsed_s, messages / elapsed_s);
+    if (qos != MQTTQoS0) {
+        report_latency(qos == MQTTQoS1 ? "PUBACK" : "PUBCOMP", ack_latency, messages);
+    }
+    if (loopback) {
+        report_latency("echo", echo_latency, messages);
+    }
+    if (modules > 1) {
+        //the modules share nothing but the broker.
+        load = simLinkBrokerLoad();
+        printf("%u modules: about %.1f msg/s together, broker load %.1f%% per module%s\n", modules,
+               messages / elapsed_s * (load * modules > 1 ? 1 / load : modules), 100 * load,
+               load * modules > 1 ? ", broker bound" : "");
+    }
+    fflush(stdout);
+    metricsDump(STDOUT_FILENO);
+
+#if configALLOC_TRACKING
+    allocTrackReport();
+    if (!marked || allocTrackSinceMark(ALLOC_SERIAL) || allocTrackSinceMark(ALLOC_TRANSPORT) ||
+        allocTrackSinceMark(ALLOC_MQTT)) {
+        printf("FAIL: %s.\n", marked ? "serial, transport or MQTT allocated after warm-up" : "no message came back");
+        return 1;
+    }
+#endif
+    (void) marked;
+
+    MQTT_Disconnect(&mqtt);
+    esp8266AT_Disconnect();
+    return 0;
+}
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "workload:\n"
+            "  -n messages (1000)      -s payload bytes (64)    -q QoS 0..2 (1)\n"
+            "  -i publish interval us, 0 back to back (0)       -w unacknowledged window (8)\n"
+            "  -l send linger ms (0)   -k ack hold ms (0)       -f framed recv\n"
+            "  -c calibrate the link   -x do not subscribe to the published topic\n"
+            "  -p client poll interval us when idle (100)       -m modules on the broker (1)\n"
+            "model:\n"
+            "  -b baud (115200)        -a adapter latency us (1000)\n"
+            "  -d module AT delay us (300)                      -y module us per sent byte (1)\n"
+            "  -r Wi-Fi round trip us (5000)                    -t TLS handshake us, SSL if set (0)\n"
+            "  -D broker us per packet (200)\n",
+            name);
+}
+
+//the client's receive loop: an empty read waits a poll interval, as the real one would spin.
+int32_t sim_recv(NetworkContext_t *pNetworkContext, void *pBuffer, size_t bytesToRecv) {
+
+    int32_t n = esp8266AT_recv(pNetworkContext, pBuffer, bytesToRecv);
+
+    if (!n) {
+        usleep(poll_us);
+    }
+    return n;
+}
+
+uint32_t sim_time_ms(void) {
+    return (uint32_t) (simLinkNowUs() / 1000);
+}
+
+void event_callback(MQTTContext_t *pContext, MQTTPacketInfo_t *pPacketInfo,
+                    MQTTDeserializedInfo_t *pDeserializedInfo) {
+
+    uint64_t now = simLinkNowUs();
+    uint32_t seq;
+
+    (void) pContext;
+    ALLOC_SCOPE(ALLOC_APP); //the run's bookkeeping, even when called from inside coreMQTT
+    if ((pPacketInfo->type & 0xF0U) == MQTT_PACKET_TYPE_PUBLISH) {
+        if (pDeserializedInfo->pPublishInfo->payloadLength < sizeof(seq)) {
+            return;
+        }
+        memcpy(&seq, pDeserializedInfo->pPublishInfo->pPayload, sizeof(seq));
+        if (seq < messages && sent_us[seq] && !echo_seen[seq]) {
+            echo_seen[seq] = true;
+            echo_latency.push_back((uint32_t) (now - sent_us[seq]));
+            echoed++;
+        }
+    }
+    else if (pPacketInfo->type == MQTT_PACKET_TYPE_SUBACK) {
+        subscribed = true;
+    }
+    else if ((qos == MQTTQoS1 && pPacketInfo->type == MQTT_PACKET_TYPE_PUBACK) ||
+             (qos == MQTTQoS2 && pPacketInfo->type == MQTT_PACKET_TYPE_PUBCOMP)) {
+        ack_latency.push_back((uint32_t) (now - packet_sent_us[pDeserializedInfo->packetIdentifier]));
+        acked++;
+    }
+}
+
+void process(void) {
+
+    MQTTStatus_t status;
+    ALLOC_SCOPE(ALLOC_MQTT);
+
+    status = MQTT_ProcessLoop(&mqtt);
+
+    if (status != MQTTSuccess && status != MQTTNeedMoreBytes) {
+        fprintf(stderr, "sim: MQTT_ProcessLoop failed, status %d\n", (int) status);
+        exit(1);
+    }
+}
+
+void report_latency(const char *what, std::vector<uint32_t> &samples, uint32_t expected) {
+
+    if (samples.empty()) {
+        printf("%s latency: no samples, %u missing\n", what, expected);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    printf("%s latency us: p50 %u p90 %u p99 %u max %u", what, samples[(samples.size() - 1) * 50 / 100],
+           samples[(samples.size() - 1) * 90 / 100], samples[(samples.size() - 1) * 99 / 100], samples.back());
+    if (samples.size() < expected) {
+        printf(", %u missing", expected - (uint32_t) samples.size());
+    }
+    printf("\n");
+}
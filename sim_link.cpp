@@ -0,0 +1,657 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "serial.h"
+#include "metrics.h"
+#include "alloc_track.h"
+#include "sim_link.h"
+
+//constants
+const size_t ADAPTER_PACKET = 62;  //payload of one USB packet from an FTDI style adapter
+const size_t IPD_SEGMENT = 1460;   //most the module hands over in one +IPD
+const uint64_t CLOCK_BASE_NS = 1000000000ULL; //keeps virtual timestamps away from 0
+const uint32_t NESTED_SLEEPS_MAX = 1000;
+
+struct simEvent {
+    uint64_t at;  //ns
+    uint64_t seq; //events due at the same time fire in the order they were scheduled
+    std::function<void()> fire;
+};
+
+struct simEventLater {
+    bool operator()(const simEvent &a, const simEvent &b) const {
+        return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+    }
+};
+
+struct simSetting {
+    const char *name;
+    std::string value;
+};
+
+struct simSubscription {
+    std::string filter;
+    int qos;
+};
+
+static simLinkParams_t params = { 115200, 1000, 300, 1, 5000, 0, 200 };
+static std::priority_queue<simEvent, std::vector<simEvent>, simEventLater> events;
+static uint64_t now_ns = 0, event_seq = 0, byte_ns = 86806;
+static bool dispatching = false;
+static uint32_t nested_sleeps = 0;
+
+//serial port and adapter
+static xSerialRxCallback rx_callback = NULL;
+static uint64_t uart_tx_free = 0, uart_rx_free = 0, last_delivery = 0;
+
+//module
+static std::string mod_line, mod_data;
+static int mod_data_expected = 0;
+static bool mod_echo = false; //as left by a previous run; ATE1 turns it on
+static bool mod_link = false;
+static uint64_t mod_busy = 0;
+static simSetting mod_settings[] = {
+    { "CWMODE_CUR", "2" }, { "CIPMUX", "0" }, { "CIPRECVMODE", "0" }, { "UART_CUR", "115200,8,1,3,1" }
+};
+static uint32_t link_epoch = 0; //packets still on the way when the link closes are lost
+
+//broker
+static std::string broker_in;
+static std::vector<simSubscription> broker_subs;
+static uint16_t broker_packet_id = 0;
+static uint64_t broker_busy = 0, broker_busy_total = 0;
+
+//counters
+static uint64_t uart_tx_bytes = 0, uart_rx_bytes = 0, cipsends = 0;
+static uint64_t broker_packets_in = 0, broker_packets_out = 0;
+
+static void schedule(uint64_t at, std::function<void()> fire);
+static void run_until(uint64_t t);
+static void module_rx(char c);
+static void module_out(const std::string &text);
+static void module_reply(uint64_t delay_ns, const std::string &text);
+static void module_command(const std::string &cmd);
+static bool module_setting(const std::string &cmd);
+static void module_send_data(void);
+static void module_ipd(const std::string &data);
+static void host_receive(const std::string &chunk);
+static void net_to_broker(uint64_t at, const std::string &data);
+static void broker_parse(void);
+static void broker_handle(const std::string &packet);
+static void broker_send(const std::string &packet);
+static void broker_publish(const std::string &topic, int qos, const std::string &payload);
+static bool topic_matches(const std::string &filter, const std::string &topic);
+static std::string mqtt_ack(unsigned char type, uint16_t packet_id);
+static void dump_sim_link(int fd);
+static const int sim_link_metrics = metricsRegister("sim link", dump_sim_link);
+
+void simLinkInit(const simLinkParams_t *pParams) {
+    params = *pParams;
+    byte_ns = 10 * 1000000000ULL / params.baud;
+}
+
+uint64_t simLinkNowUs(void) {
+    return now_ns / 1000;
+}
+
+double simLinkBrokerLoad(void) {
+    return now_ns ? (double) broker_busy_total / now_ns : 0;
+}
+
+/* Virtual clock. Sleeping runs every event due before the wake-up time. A
+ * sleep from inside an event can only come from the rx callback waiting for
+ * the client to read, and the client is this thread: time moves on but
+ * nothing else runs, and if that goes on the run is stopped. */
+
+extern "C" int usleep(useconds_t us) {
+    run_until(now_ns + (uint64_t) us * 1000);
+    return 0;
+}
+
+extern "C" int nanosleep(const struct timespec *req, struct timespec *rem) {
+    run_until(now_ns + (uint64_t) req->tv_sec * 1000000000ULL + req->tv_nsec);
+    if (rem) {
+        rem->tv_sec = rem->tv_nsec = 0;
+    }
+    return 0;
+}
+
+extern "C" int clock_nanosleep(clockid_t clock, int flags, const struct timespec *req, struct timespec *rem) {
+    uint64_t t = (uint64_t) req->tv_sec * 1000000000ULL + req->tv_nsec;
+
+    (void) clock;
+    if (flags & TIMER_ABSTIME) {
+        run_until(t > CLOCK_BASE_NS ? t - CLOCK_BASE_NS : 0);
+        return 0;
+    }
+    return nanosleep(req, rem);
+}
+
+//other clocks (thread CPU time) are real.
+extern "C" int clock_gettime(clockid_t clock, struct timespec *ts) __THROW {
+    uint64_t t = CLOCK_BASE_NS + now_ns;
+
+    if (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME) {
+        return syscall(SYS_clock_gettime, clock, ts);
+    }
+    ts->tv_sec = t / 1000000000ULL;
+    ts->tv_nsec = t % 1000000000ULL;
+    return 0;
+}
+
+//the model's heap is the application's, whoever called in.
+void schedule(uint64_t at, std::function<void()> fire) {
+    ALLOC_SCOPE(ALLOC_APP);
+    events.push(simEvent { at, event_seq++, std::move(fire) });
+}
+
+void run_until(uint64_t t) {
+
+    ALLOC_SCOPE(ALLOC_APP);
+
+    if (dispatching) {
+        if (++nested_sleeps > NESTED_SLEEPS_MAX) {
+            fprintf(stderr, "sim: rx ring full and the client is not reading, a real link would drop data here\n");
+            exit(1);
+        }
+        now_ns = t > now_ns ? t : now_ns;
+        return;
+    }
+
+    dispatching = true;
+    while (!events.empty() && events.top().at <= t) {
+        simEvent ev = events.top();
+        events.pop();
+        now_ns = ev.at > now_ns ? ev.at : now_ns;
+        nested_sleeps = 0;
+        ev.fire();
+    }
+    dispatching = false;
+    now_ns = t > now_ns ? t : now_ns;
+}
+
+/* serial.h, on the modelled UART. Writes never block: each byte reaches the
+ * module one byte time after the previous one. */
+
+xComPortHandle xSerialPortInitMinimal(unsigned long ulWantedBaud, unsigned portBASE_TYPE uxQueueLength) {
+    (void) ulWantedBaud; //the link runs at params.baud
+    (void) uxQueueLength;
+    return (xComPortHandle) &params;
+}
+
+xComPortHandle xSerialPortInit(eCOMPort ePort, eBaud eWantedBaud, eParity eWantedParity,
+                               eDataBits eWantedDataBits, eStopBits eWantedStopBits,
+                               unsigned portBASE_TYPE uxBufferLength) {
+    return xSerialPortInitMinimal(0, uxBufferLength);
+}
+
+xComPortHandle xSerialPortInitFromFd(int iFd, unsigned portBASE_TYPE uxQueueLength) {
+    return xSerialPortInitMinimal(0, uxQueueLength);
+}
+
+void vSerialPutString(xComPortHandle pxPort, const signed char * const pcString, unsigned short usStringLength) {
+    for (unsigned short i = 0; i < usStringLength; i++) {
+        xSerialPutChar(pxPort, pcString[i], 0);
+    }
+}
+
+signed portBASE_TYPE xSerialGetChar(xComPortHandle pxPort, signed char *pcRxedChar, TickType_t xBlockTime) {
+    return 0; //everything goes to the rx callback
+}
+
+signed portBASE_TYPE xSerialPutChar(xComPortHandle pxPort, signed char cOutChar, TickType_t xBlockTime) {
+
+    char c = cOutChar;
+
+    uart_tx_free = (uart_tx_free > now_ns ? uart_tx_free : now_ns) + byte_ns;
+    uart_tx_bytes++;
+    schedule(uart_tx_free, [c] { module_rx(c); });
+    return 1;
+}
+
+portBASE_TYPE xSerialWaitForSemaphore(xComPortHandle xPort) {
+    return 1;
+}
+
+void vSerialSetRxCallback(xComPortHandle xPort, xSerialRxCallback pxCallback) {
+    rx_callback = pxCallback;
+}
+
+void vSerialClose(xComPortHandle xPort) {
+    rx_callback = NULL;
+}
+
+int xSerialDetach(xComPortHandle xPort) {
+    rx_callback = NULL;
+    return -1;
+}
+
+void vSerialSetSysfsRoot(const char *pcRoot) {
+}
+
+//the adapter passes on a full USB packet at once, anything less when its latency timer runs out.
+void module_out(const std::string &text) {
+
+    uint64_t t = uart_rx_free > now_ns ? uart_rx_free : now_ns;
+    uint64_t latency_ns = params.adapterLatencyUs * 1000ULL;
+    size_t packet = ADAPTER_PACKET, n;
+
+    if (latency_ns && latency_ns / byte_ns + 1 < packet) {
+        packet = latency_ns / byte_ns + 1;
+    }
+    for (size_t i = 0; i < text.size(); i += n) {
+        n = text.size() - i < packet ? text.size() - i : packet;
+        uint64_t first = t + byte_ns, at;
+        t += n * byte_ns;
+        at = (n == ADAPTER_PACKET || !latency_ns) ? t : first + latency_ns;
+        at = at > last_delivery ? at : last_delivery; //USB packets stay in order
+        last_delivery = at;
+        schedule(at, [chunk = text.substr(i, n)] { host_receive(chunk); });
+    }
+    uart_rx_bytes += text.size();
+    uart_rx_free = t;
+}
+
+//as serial.cpp's rxThread would deliver it.
+void host_receive(const std::string &chunk) {
+    ALLOC_SCOPE(ALLOC_SERIAL);
+    if (rx_callback) {
+        rx_callback(chunk.data(), chunk.size());
+    }
+}
+
+/* Module. Commands are handled one at a time: each reply is due atDelayUs
+ * after the module is done with the previous command. A CIPSEND keeps it
+ * busy until SEND OK, which the AT firmware reports once the broker's TCP
+ * stack acknowledged the data, a round trip after it went out. */
+
+void module_rx(char c) {
+
+    if (mod_data_expected) {
+        mod_data += c;
+        if ((int) mod_data.size() == mod_data_expected) {
+            module_send_data();
+        }
+        return;
+    }
+
+    if (mod_echo) {
+        module_out(std::string(1, c));
+    }
+    if (c != '\n') {
+        mod_line += c;
+        return;
+    }
+    if (!mod_line.empty() && mod_line.back() == '\r') {
+        mod_line.pop_back();
+    }
+    std::string cmd;
+    cmd.swap(mod_line);
+    module_command(cmd);
+}
+
+void module_reply(uint64_t delay_ns, const std::string &text) {
+    mod_busy = (mod_busy > now_ns ? mod_busy : now_ns) + delay_ns;
+    schedule(mod_busy, [text] { module_out(text); });
+}
+
+void module_command(const std::string &cmd) {
+
+    uint64_t at_ns = params.atDelayUs * 1000ULL;
+
+    if (cmd.empty()) {
+        return;
+    }
+    if (cmd == "AT") {
+        module_reply(at_ns, "\r\nOK\r\n");
+    }
+    else if (cmd == "ATE0" || cmd == "ATE1") {
+        mod_echo = cmd == "ATE1";
+        module_reply(at_ns, "\r\nOK\r\n");
+    }
+    else if (cmd == "AT+CIPSTAMAC_CUR?") {
+        module_reply(at_ns, "+CIPSTAMAC_CUR:\"02:00:00:00:00:01\"\r\n\r\nOK\r\n");
+    }
+    else if (!cmd.compare(0, 14, "AT+CIPSSLSIZE=")) {
+        module_reply(at_ns, "\r\nOK\r\n");
+    }
+    else if (cmd == "AT+CIPCLOSE") {
+        if (mod_link) {
+            mod_link = false;
+            link_epoch++;
+            module_reply(at_ns, "CLOSED\r\n\r\nOK\r\n");
+        }
+        else {
+            module_reply(at_ns, "\r\nERROR\r\n");
+        }
+    }
+    else if (!cmd.compare(0, 12, "AT+CIPSTART=")) {
+        if (mod_link) {
+            module_reply(at_ns, "ALREADY CONNECTED\r\n\r\nERROR\r\n");
+            return;
+        }
+        //a clean session on a new broker connection.
+        mod_link = true;
+        link_epoch++;
+        broker_in.clear();
+        broker_subs.clear();
+        module_reply(at_ns + params.wifiRttUs * 1000ULL +
+                     (cmd.find("\"SSL\"") != std::string::npos ? params.tlsHandshakeUs * 1000ULL : 0),
+                     "CONNECT\r\n\r\nOK\r\n");
+    }
+    else if (!cmd.compare(0, 11, "AT+CIPSEND=")) {
+        int n = atoi(cmd.c_str() + 11);
+        if (!mod_link) {
+            module_reply(at_ns, "link is not valid\r\n\r\nERROR\r\n");
+        }
+        else if (n <= 0 || n > 2048) {
+            module_reply(at_ns, "\r\nERROR\r\n");
+        }
+        else {
+            cipsends++;
+            mod_data.clear();
+            mod_data_expected = n;
+            module_reply(at_ns, "\r\nOK\r\n> ");
+        }
+    }
+    else if (!module_setting(cmd)) {
+        module_reply(at_ns, "\r\nERROR\r\n");
+    }
+}
+
+//AT+<name>? and AT+<name>=<value> for the settings the transport configures.
+bool module_setting(const std::string &cmd) {
+
+    uint64_t at_ns = params.atDelayUs * 1000ULL;
+
+    for (simSetting &s : mod_settings) {
+        std::string name = std::string("AT+") + s.name;
+        if (cmd == name + "?") {
+            module_reply(at_ns, "+" + std::string(s.name) + ":" + s.value + "\r\n\r\nOK\r\n");
+            return true;
+        }
+        if (!cmd.compare(0, name.size() + 1, name + "=")) {
+            s.value = cmd.substr(name.size() + 1);
+            module_reply(at_ns, "\r\nOK\r\n");
+            return true;
+        }
+    }
+    return false;
+}
+
+void module_send_data(void) {
+
+    uint64_t rtt_ns = params.wifiRttUs * 1000ULL;
+    uint64_t out_ns = (uint64_t) params.sendUsPerByte * 1000ULL * mod_data_expected;
+    std::string data;
+
+    data.swap(mod_data);
+    module_reply(params.atDelayUs * 1000ULL, "\r\nRecv " + std::to_string(mod_data_expected) + " bytes\r\n");
+    mod_data_expected = 0;
+    net_to_broker(mod_busy + out_ns + rtt_ns / 2, data);
+    module_reply(out_ns + rtt_ns, "\r\nSEND OK\r\n");
+}
+
+void module_ipd(const std::string &data) {
+    for (size_t i = 0; i < data.size(); i += IPD_SEGMENT) {
+        std::string segment = data.substr(i, IPD_SEGMENT);
+        module_out("\r\n+IPD," + std::to_string(segment.size()) + ":" + segment);
+    }
+}
+
+/* Broker. Packets are served one at a time, brokerDelayUs each, and
+ * replies travel half a round trip back to the module. Publishes are
+ * routed to matching subscriptions of this client, so a client subscribed
+ * to its own topics sees its messages come back. */
+
+void net_to_broker(uint64_t at, const std::string &data) {
+
+    uint32_t epoch = link_epoch;
+
+    schedule(at, [data, epoch] {
+        if (epoch == link_epoch) {
+            broker_in += data;
+            broker_parse();
+        }
+    });
+}
+
+void broker_parse(void) {
+
+    uint32_t epoch = link_epoch;
+
+    while (broker_in.size() >= 2) {
+        size_t remaining = 0, header = 1;
+        uint32_t multiplier = 1;
+        unsigned char b;
+        do {
+            if (header >= broker_in.size()) {
+                return;
+            }
+            b = broker_in[header++];
+            remaining += (b & 0x7F) * multiplier;
+            multiplier *= 128;
+        } while (b & 0x80);
+        if (broker_in.size() < header + remaining) {
+            return;
+        }
+
+        std::string packet = broker_in.substr(0, header + remaining);
+        broker_in.erase(0, header + remaining);
+        broker_packets_in++;
+        broker_busy = (broker_busy > now_ns ? broker_busy : now_ns) + params.brokerDelayUs * 1000ULL;
+        broker_busy_total += params.brokerDelayUs * 1000ULL;
+        schedule(broker_busy, [packet, epoch] {
+            if (epoch == link_epoch) {
+                broker_handle(packet);
+            }
+        });
+    }
+}
+
+void broker_handle(const std::string &packet) {
+
+    const unsigned char *p = (const unsigned char *) packet.data();
+    size_t header = 2, len;
+    uint16_t packet_id = 0;
+
+    while (p[header - 1] & 0x80) {
+        header++;
+    }
+    len = packet.size() - header;
+    p += header;
+    if (len >= 2) {
+        packet_id = (uint16_t) (p[0] << 8 | p[1]);
+    }
+
+    switch (packet[0] & 0xF0) {
+    case 0x10: //CONNECT
+        broker_send(std::string("\x20\x02\x00\x00", 4));
+        break;
+
+    case 0x80: { //SUBSCRIBE
+        std::string suback;
+        for (size_t i = 2; i + 3 <= len;) {
+            size_t n = p[i] << 8 | p[i + 1];
+            if (i + 3 + n > len) {
+                break;
+            }
+            broker_subs.push_back(simSubscription { std::string((const char *) &p[i + 2], n), p[i + 2 + n] & 3 });
+            suback += (char) (p[i + 2 + n] & 3);
+            i += 3 + n;
+        }
+        broker_send(std::string { (char) 0x90, (char) (2 + suback.size()), (char) (packet_id >> 8),
+                                  (char) (packet_id & 0xFF) } + suback);
+        break;
+    }
+
+    case 0xA0: //UNSUBSCRIBE
+        for (size_t i = 2; i + 2 <= len;) {
+            size_t n = p[i] << 8 | p[i + 1];
+            std::string filter((const char *) &p[i + 2], n < len - i - 2 ? n : len - i - 2);
+            for (size_t k = 0; k < broker_subs.size();) {
+                if (broker_subs[k].filter == filter) {
+                    broker_subs.erase(broker_subs.begin() + k);
+                }
+                else {
+                    k++;
+                }
+            }
+            i += 2 + n;
+        }
+        broker_send(mqtt_ack(0xB0, packet_id));
+        break;
+
+    case 0x30: { //PUBLISH
+        int qos = (packet[0] >> 1) & 3;
+        size_t n = len >= 2 ? (p[0] << 8 | p[1]) : 0;
+        size_t payload = 2 + n + (qos ? 2 : 0);
+        if (payload > len) {
+            break;
+        }
+        if (qos) {
+            packet_id = (uint16_t) (p[2 + n] << 8 | p[3 + n]);
+            broker_send(mqtt_ack(qos == 1 ? 0x40 : 0x50, packet_id));
+        }
+        broker_publish(std::string((const char *) &p[2], n), qos,
+                       std::string((const char *) &p[payload], len - payload));
+        break;
+    }
+
+    case 0x60: //PUBREL
+        broker_send(mqtt_ack(0x70, packet_id));
+        break;
+
+    case 0x50: //PUBREC, for a QoS 2 publish to the client
+        broker_send(mqtt_ack(0x62, packet_id));
+        break;
+
+    case 0xC0: //PINGREQ
+        broker_send(std::string("\xD0\x00", 2));
+        break;
+
+    case 0xE0: //DISCONNECT
+        mod_link = false;
+        link_epoch++;
+        module_out("CLOSED\r\n");
+        break;
+
+    default: //PUBACK, PUBCOMP
+        break;
+    }
+}
+
+void broker_send(const std::string &packet) {
+
+    uint32_t epoch = link_epoch;
+
+    broker_packets_out++;
+    schedule(now_ns + params.wifiRttUs * 1000ULL / 2, [packet, epoch] {
+        if (epoch == link_epoch) {
+            module_ipd(packet);
+        }
+    });
+}
+
+//one copy per client, at the highest QoS granted among the matching subscriptions.
+void broker_publish(const std::string &topic, int qos, const std::string &payload) {
+
+    int granted = -1;
+    std::string packet, body;
+    size_t remaining;
+
+    for (const simSubscription &s : broker_subs) {
+        if (topic_matches(s.filter, topic) && s.qos > granted) {
+            granted = s.qos;
+        }
+    }
+    if (granted < 0) {
+        return;
+    }
+    qos = qos < granted ? qos : granted;
+
+    body = std::string { (char) (topic.size() >> 8), (char) (topic.size() & 0xFF) } + topic;
+    if (qos) {
+        if (++broker_packet_id == 0) {
+            broker_packet_id = 1;
+        }
+        body += std::string { (char) (broker_packet_id >> 8), (char) (broker_packet_id & 0xFF) };
+    }
+    body += payload;
+
+    packet += (char) (0x30 | qos << 1);
+    remaining = body.size();
+    do {
+        packet += (char) ((remaining & 0x7F) | (remaining > 0x7F ? 0x80 : 0));
+        remaining >>= 7;
+    } while (remaining);
+    broker_send(packet + body);
+}
+
+bool topic_matches(const std::string &filter, const std::string &topic) {
+
+    size_t f = 0, t = 0;
+
+    while (f < filter.size()) {
+        if (filter[f] == '#') {
+            return true;
+        }
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') {
+                t++;
+            }
+            f++;
+            continue;
+        }
+        if (t >= topic.size() || filter[f] != topic[t]) {
+            return false;
+        }
+        f++;
+        t++;
+    }
+    return t == topic.size();
+}
+
+std::string mqtt_ack(unsigned char type, uint16_t packet_id) {
+    return std::string { (char) type, 2, (char) (packet_id >> 8), (char) (packet_id & 0xFF) };
+}
+
+void dump_sim_link(int fd) {
+    (void) sim_link_metrics;
+    dprintf(fd, "virtual time %llu us, uart bytes to module %llu, from module %llu, cipsend %llu\n",
+            (unsigned long long) now_ns / 1000, (unsigned long long) uart_tx_bytes,
+            (unsigned long long) uart_rx_bytes, (unsigned long long) cipsends);
+    dprintf(fd, "broker packets in %llu, out %llu, load %.1f%%\n", (unsigned long long) broker_packets_in,
+            (unsigned long long) broker_packets_out, 100 * simLinkBrokerLoad());
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef SIM_LINK_H
+#define SIM_LINK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* Link simulator.
+ * Linked instead of serial.cpp, this models the whole path behind the
+ * serial port: the UART and USB-serial adapter, the module's AT command
+ * processing, the Wi-Fi round trip and an MQTT broker. The transport and
+ * coreMQTT run unchanged on top of it, single threaded, against a virtual
+ * clock: usleep(), nanosleep() and clock_gettime() on CLOCK_MONOTONIC and
+ * CLOCK_REALTIME are replaced, and sleeping runs the simulation up to the
+ * wake-up time instead of waiting. Listed under "sim link" in metricsDump().
+ */
+
+typedef struct simLinkParams {
+    uint32_t baud;               //UART speed, 10 bits per byte
+    uint32_t adapterLatencyUs;   //USB-serial latency timer, 0 for a native UART
+    uint32_t atDelayUs;          //module: command to reply
+    uint32_t sendUsPerByte;      //module: per CIPSEND data byte, before it goes out
+    uint32_t wifiRttUs;          //module to broker and back
+    uint32_t tlsHandshakeUs;     //added to CIPSTART "SSL"
+    uint32_t brokerDelayUs;      //broker: service time per packet, one at a time
+} simLinkParams_t;
+
+//Set the model up. Call before the transport opens the port.
+void simLinkInit(const simLinkParams_t *pParams);
+
+//Virtual time since simLinkInit(), in us.
+uint64_t simLinkNowUs(void);
+
+//Share of the virtual time the broker was busy, 0..1.
+double simLinkBrokerLoad(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SIM_LINK_H
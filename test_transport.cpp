@@ -22,49 +22,364 @@
  *
  */
 
+/* Raw transport benchmark: esp8266AT_send()/esp8266AT_recv() against a TCP
+ * echo server, no MQTT involved. Run echo_server on a host the module can
+ * reach, then
+ *
+ *   test [options]     see usage()
+ *
+ * For every message size of the sweep:
+ *   flood   messages sent back to back, the maximum sustained send goodput.
+ *           Whatever comes back is read and thrown away; run the server
+ *           with -d to keep the module's receive side quiet.
+ *   ping    one message at a time, each waits for its echo: round trip.
+ *   mixed   up to a window of messages in flight while echoes stream back,
+ *           both directions busy at once.
+ * Reported per size: goodput (payload bytes one way per second), msg/s,
+ * round trip percentiles and errors: short sends, echo timeouts and bytes
+ * that came back wrong. The transport counters follow at the end.
+ *
+ * Each message starts with its sequence number, the rest is a pattern
+ * derived from it, so the echo stream is checked byte by byte.
+ */
+
 #include <cstdio>
-#include <string>
-#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
 #include <unistd.h>
 #include "transport_esp8266.h"
+#include "alloc_track.h"
+#include "metrics.h"
+
+//constants
+const int SIZES_MAX = 16;
+const int MESSAGE_MAX = 8192;
+const uint32_t WINDOW_MAX = 64;
 
-const int buffer_len = 128;
+enum benchMode {
+    MODE_FLOOD = 0,
+    MODE_PING,
+    MODE_MIXED
+};
+
+struct benchResult {
+    uint32_t messages;    //messages sent in full
+    uint64_t bytes;       //payload bytes, sent (flood) or echoed (ping, mixed)
+    uint64_t elapsed_us;
+    uint32_t send_errors; //esp8266AT_send() took less than the message
+    uint32_t timeouts;    //echoes not complete within the timeout
+    uint32_t corrupt;     //echoed bytes that differ from what was sent
+    std::vector<uint32_t> rtt_us;
+};
+
+//options, from the command line
+static const char *address = "192.168.0.235";
+static const char *port = "7007";
+static benchMode mode = MODE_PING;
+static int sizes[SIZES_MAX] = { 16, 64, 256, 1024, 2048 };
+static int size_count = 5;
+static uint32_t messages = 200, window = 4, timeout_ms = 2000, linger_ms = 0, poll_us = 100;
+
+//echo checker state: the next expected byte of the echo stream.
+static uint32_t rx_seq, rx_offset;
+static uint64_t sent_at_us[WINDOW_MAX];
+static char tx_message[MESSAGE_MAX], rx_buffer[MESSAGE_MAX];
+
+static void usage(const char *name);
+static bool parse_sizes(char *list);
+static uint64_t now_us(void);
+static void fill_message(uint32_t seq, int size);
+static int32_t poll_echo(int size, benchResult *result);
+static void discard_rx(uint32_t ms);
+static void run_flood(int size, benchResult *result);
+static void run_ping(int size, benchResult *result);
+static void run_mixed(int size, benchResult *result);
+static void report(int size, benchResult *result);
 
 int main(int argc, char * argv[]) {
 
-    char c = 0;
     esp8266TransportStatus_t rc;
-    const char *address = "192.168.0.235";
-    const char *port = "1883";
-    std::string line;
+    benchResult result;
+    bool marked = false;
+    int opt;
 
-    rc = esp8266AT_Connect(address, port);
-    std::cout << "esp8266AT_Connect: " << rc << std::endl;
+    while ((opt = getopt(argc, argv, "m:a:p:s:n:w:t:l:P:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "flood")) mode = MODE_FLOOD;
+            else if (!strcmp(optarg, "ping")) mode = MODE_PING;
+            else if (!strcmp(optarg, "mixed")) mode = MODE_MIXED;
+            else { usage(argv[0]); return 1; }
+            break;
+        case 'a': address = optarg; break;
+        case 'p': port = optarg; break;
+        case 's': if (!parse_sizes(optarg)) { usage(argv[0]); return 1; } break;
+        case 'n': messages = strtoul(optarg, NULL, 0); break;
+        case 'w': window = strtoul(optarg, NULL, 0); break;
+        case 't': timeout_ms = strtoul(optarg, NULL, 0); break;
+        case 'l': linger_ms = strtoul(optarg, NULL, 0); break;
+        case 'P': poll_us = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!messages || !window || window > WINDOW_MAX || !timeout_ms) {
+        usage(argv[0]);
+        return 1;
+    }
 
+    esp8266AT_SetSendLinger(linger_ms);
+    rc = esp8266AT_Connect(address, port);
     if (rc != ESP8266_TRANSPORT_SUCCESS) {
+        fprintf(stderr, "esp8266AT_Connect: %d\n", (int) rc);
         return -1;
     }
+    printf("%s:%s connected in %u ms, mode %s, %u messages per size%s", address, port,
+           esp8266AT_ConnectTime(), mode == MODE_FLOOD ? "flood" : mode == MODE_PING ? "ping" : "mixed",
+           messages, mode == MODE_MIXED ? ", window " : "");
+    if (mode == MODE_MIXED) {
+        printf("%u", window);
+    }
+    printf("\n%6s %8s %12s %9s %9s %9s %9s %9s %6s %6s %7s\n", "size", "msgs", "goodput B/s", "msg/s",
+           "rtt p50", "p90", "p99", "max us", "short", "tmo", "corrupt");
 
-    char buffer[buffer_len];
-    int32_t bytes_sent;
-    int32_t bytes_read;
-    while (c != '1') {
-        std::cout << "Enter bytes to send: " << std::endl;
-        std::getline(std::cin, line);
-        std::cout << "Got " << line.size() << " bytes to send." << std::endl;
-        bytes_sent = esp8266AT_send(NULL, line.c_str(), line.size());
-        std::cout << "Sent: " << bytes_sent << " bytes." << std::endl;
-        bytes_read = esp8266AT_recv(NULL, buffer, buffer_len - 1);
-        std::cout << "Read: " << bytes_read << " bytes." << std::endl;
-        if (bytes_read) {
-            buffer[bytes_read] = 0;
-            std::cout << "Bytes read: " << buffer << std::endl;
+    for (int i = 0; i < size_count; i++) {
+        result = benchResult();
+        result.rtt_us.reserve(messages);
+        if (mode == MODE_FLOOD) {
+            run_flood(sizes[i], &result);
+        }
+        else if (mode == MODE_PING) {
+            run_ping(sizes[i], &result);
         }
-        std::cout << "Press enter to try again or 1 + enter to exit." << std::endl;
-        c = getchar();
+        else {
+            run_mixed(sizes[i], &result);
+        }
+        report(sizes[i], &result);
+#if configALLOC_TRACKING
+        //the first size warms everything up, later ones must not allocate.
+        if (!marked) {
+            allocTrackMark();
+            marked = true;
+        }
+#endif
+    }
+    fflush(stdout);
+    metricsDump(STDOUT_FILENO);
+
+#if configALLOC_TRACKING
+    allocTrackReport();
+    if (allocTrackSinceMark(ALLOC_SERIAL) || allocTrackSinceMark(ALLOC_TRANSPORT)) {
+        printf("FAIL: serial or transport allocated after the first size.\n");
+        esp8266AT_Disconnect();
+        return -1;
     }
+#endif
+    (void) marked;
 
     esp8266AT_Disconnect();
 
     return 0;
 }
+
+void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -m flood|ping|mixed (ping)\n"
+            "  -a echo server address (192.168.0.235)           -p echo server port (7007)\n"
+            "  -s message sizes, comma separated, 4..%d (16,64,256,1024,2048)\n"
+            "  -n messages per size (200)                       -w mixed mode window, 1..%u (4)\n"
+            "  -t echo timeout ms (2000)                        -l send linger ms (0)\n"
+            "  -P poll interval us when nothing was received (100)\n",
+            name, MESSAGE_MAX, WINDOW_MAX);
+}
+
+bool parse_sizes(char *list) {
+
+    char *token, *save = NULL;
+
+    size_count = 0;
+    for (token = strtok_r(list, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        if (size_count == SIZES_MAX) {
+            return false;
+        }
+        sizes[size_count] = atoi(token);
+        if (sizes[size_count] < (int) sizeof(uint32_t) || sizes[size_count] > MESSAGE_MAX) {
+            return false;
+        }
+        size_count++;
+    }
+    return size_count > 0;
+}
+
+uint64_t now_us(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+//the message body is a function of the sequence number, see poll_echo().
+void fill_message(uint32_t seq, int size) {
+
+    memcpy(tx_message, &seq, sizeof(seq));
+    for (int k = sizeof(seq); k < size; k++) {
+        tx_message[k] = (char) (seq + k);
+    }
+}
+
+//Reads what the transport has and checks it against the expected echo
+//stream. Completed messages get their round trip recorded. Returns the
+//number of messages completed, or -1 if nothing was there.
+int32_t poll_echo(int size, benchResult *result) {
+
+    int32_t n, done = 0;
+    char expected;
+
+    n = esp8266AT_recv(NULL, rx_buffer, sizeof(rx_buffer));
+    if (!n) {
+        usleep(poll_us);
+        return -1;
+    }
+    for (int32_t k = 0; k < n; k++) {
+        if (rx_offset < sizeof(rx_seq)) {
+            expected = (char) (rx_seq >> (8 * rx_offset)); //little endian, as fill_message() copies it
+        }
+        else {
+            expected = (char) (rx_seq + rx_offset);
+        }
+        if (rx_buffer[k] != expected) {
+            result->corrupt++;
+        }
+        if (++rx_offset == (uint32_t) size) {
+            result->rtt_us.push_back((uint32_t) (now_us() - sent_at_us[rx_seq % WINDOW_MAX]));
+            result->bytes += size;
+            rx_seq++;
+            rx_offset = 0;
+            done++;
+        }
+    }
+    return done;
+}
+
+//after a timeout, late echoes would throw the checker off: wait them out.
+void discard_rx(uint32_t ms) {
+
+    uint64_t end = now_us() + (uint64_t) ms * 1000;
+
+    while (now_us() < end) {
+        if (!esp8266AT_recv(NULL, rx_buffer, sizeof(rx_buffer))) {
+            usleep(poll_us);
+        }
+    }
+}
+
+void run_flood(int size, benchResult *result) {
+
+    uint64_t start = now_us();
+
+    for (uint32_t seq = 0; seq < messages; seq++) {
+        fill_message(seq, size);
+        if (esp8266AT_send(NULL, tx_message, size) == size) {
+            result->messages++;
+            result->bytes += size;
+        }
+        else {
+            result->send_errors++;
+        }
+        //keep the rx ring from filling up if the server echoes.
+        while (esp8266AT_recv(NULL, rx_buffer, sizeof(rx_buffer)) > 0) {
+        }
+    }
+    esp8266AT_Flush();
+    result->elapsed_us = now_us() - start;
+}
+
+void run_ping(int size, benchResult *result) {
+
+    uint64_t start = now_us(), deadline;
+
+    rx_seq = rx_offset = 0;
+    for (uint32_t seq = 0; seq < messages; seq++) {
+        fill_message(seq, size);
+        sent_at_us[seq % WINDOW_MAX] = now_us();
+        if (esp8266AT_send(NULL, tx_message, size) != size) {
+            result->send_errors++;
+            //part of it may be out: start the checker afresh after the next message.
+            discard_rx(timeout_ms);
+            rx_seq = seq + 1;
+            rx_offset = 0;
+            continue;
+        }
+        result->messages++;
+        esp8266AT_Flush();
+        deadline = sent_at_us[seq % WINDOW_MAX] + (uint64_t) timeout_ms * 1000;
+        while (rx_seq == seq && now_us() < deadline) {
+            (void) poll_echo(size, result);
+        }
+        if (rx_seq == seq) {
+            result->timeouts++;
+            discard_rx(timeout_ms);
+            rx_seq = seq + 1;
+            rx_offset = 0;
+        }
+    }
+    result->elapsed_us = now_us() - start;
+}
+
+void run_mixed(int size, benchResult *result) {
+
+    uint64_t start = now_us(), progress = start;
+    uint32_t seq = 0;
+
+    rx_seq = rx_offset = 0;
+    while (rx_seq < messages) {
+        //refill the window, reading in between so echoes are not held up.
+        if (seq < messages && seq - rx_seq < window) {
+            fill_message(seq, size);
+            sent_at_us[seq % WINDOW_MAX] = now_us();
+            if (esp8266AT_send(NULL, tx_message, size) == size) {
+                result->messages++;
+            }
+            else {
+                //an incomplete message would desynchronise the stream, stop here.
+                result->send_errors++;
+                break;
+            }
+            seq++;
+        }
+        if (poll_echo(size, result) > 0) {
+            progress = now_us();
+        }
+        else if (now_us() - progress > (uint64_t) timeout_ms * 1000) {
+            result->timeouts += seq - rx_seq;
+            break;
+        }
+    }
+    esp8266AT_Flush();
+    result->elapsed_us = now_us() - start;
+    if (rx_seq < messages) {
+        discard_rx(timeout_ms);
+    }
+}
+
+void report(int size, benchResult *result) {
+
+    std::vector<uint32_t> &rtt = result->rtt_us;
+    double elapsed_s = result->elapsed_us ? result->elapsed_us / 1e6 : 1e-6;
+
+    printf("%6d %8u %12.0f %9.1f", size, result->messages, result->bytes / elapsed_s,
+           result->bytes / size / elapsed_s);
+    if (rtt.empty()) {
+        printf(" %9s %9s %9s %9s", "-", "-", "-", "-");
+    }
+    else {
+        std::sort(rtt.begin(), rtt.end());
+        printf(" %9u %9u %9u %9u", rtt[(rtt.size() - 1) * 50 / 100], rtt[(rtt.size() - 1) * 90 / 100],
+               rtt[(rtt.size() - 1) * 99 / 100], rtt.back());
+    }
+    printf(" %6u %6u %7u\n", result->send_errors, result->timeouts, result->corrupt);
+}
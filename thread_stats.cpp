@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
+#include "thread_stats.h"
+#include "metrics.h"
+
+//constants
+const int THREAD_STATS_MAX = 8;
+
+struct threadStats {
+    const char *name;
+    bool live;
+    clockid_t cpu_clock; //valid while live
+    uint64_t cpu_ns;     //CPU time of the threads that already exited
+    std::atomic<uint64_t> useful;
+    std::atomic<uint64_t> idle;
+};
+
+static struct threadStats threads[THREAD_STATS_MAX];
+static int thread_count = 0;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dump_threads(int fd);
+static const int provider_registered = metricsRegister("threads", dump_threads);
+
+static uint64_t cpu_time_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts)) {
+        return 0;
+    }
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+threadStats_t *threadStatsRegister(const char *name) {
+
+    threadStats_t *t = NULL;
+
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < thread_count; i++) {
+        if (!strcmp(threads[i].name, name)) {
+            t = &threads[i];
+        }
+    }
+    if (!t && thread_count < THREAD_STATS_MAX) {
+        t = &threads[thread_count++];
+        t->name = name;
+    }
+    if (t && !pthread_getcpuclockid(pthread_self(), &t->cpu_clock)) {
+        t->live = true;
+    }
+    pthread_mutex_unlock(&threads_lock);
+    return t;
+}
+
+void threadStatsUnregister(threadStats_t *t) {
+
+    if (!t) {
+        return;
+    }
+    pthread_mutex_lock(&threads_lock);
+    if (t->live) {
+        t->cpu_ns += cpu_time_ns(t->cpu_clock);
+        t->live = false;
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
+
+void threadStatsWakeup(threadStats_t *t, bool useful) {
+
+    if (t) {
+        (useful ? t->useful : t->idle).fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void dump_threads(int fd) {
+
+    uint64_t cpu, useful, idle;
+
+    (void) provider_registered;
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < thread_count; i++) {
+        cpu = threads[i].cpu_ns + (threads[i].live ? cpu_time_ns(threads[i].cpu_clock) : 0);
+        useful = threads[i].useful.load(std::memory_order_relaxed);
+        idle = threads[i].idle.load(std::memory_order_relaxed);
+        dprintf(fd, "%s cpu %llu.%03llu ms wakeups %llu useful %llu idle %llu (%llu%% idle)%s\n",
+                threads[i].name, (unsigned long long) (cpu / 1000000), (unsigned long long) (cpu / 1000 % 1000),
+                (unsigned long long) (useful + idle), (unsigned long long) useful, (unsigned long long) idle,
+                (unsigned long long) (useful + idle ? idle * 100 / (useful + idle) : 0),
+                threads[i].live ? "" : " exited");
+    }
+    pthread_mutex_unlock(&threads_lock);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef THREAD_STATS_H
+#define THREAD_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+/* Per thread CPU time and wakeup accounting.
+ * A thread registers itself once and then reports every pass of its
+ * polling loop as a wakeup, useful if it found work and idle otherwise.
+ * CPU time is read from the thread's CPU clock. Everything is listed
+ * under "threads" in metricsDump(). Threads registering under the same
+ * name share a slot, so a restarted thread keeps adding to its totals.
+ */
+
+typedef struct threadStats threadStats_t;
+
+//Start accounting for the calling thread. NULL when the table is full.
+threadStats_t *threadStatsRegister(const char *name);
+
+//The calling thread is about to exit, keep the CPU time it used.
+void threadStatsUnregister(threadStats_t *stats);
+
+//One pass of a polling loop. stats may be NULL.
+void threadStatsWakeup(threadStats_t *stats, bool useful);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //THREAD_STATS_H
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <pthread.h>
+#include "topic_table.h"
+#include "metrics.h"
+
+//sizes, overridable at build time (see footprint.sh).
+#ifndef configTOPIC_TABLE_LEN
+    #define configTOPIC_TABLE_LEN 32
+#endif
+#ifndef configTOPIC_POOL_LEN
+    #define configTOPIC_POOL_LEN 1024
+#endif
+
+//constants
+const int TOPIC_SLOTS = 2 * configTOPIC_TABLE_LEN; //keeps the hash at most half full
+static_assert((TOPIC_SLOTS & (TOPIC_SLOTS - 1)) == 0, "configTOPIC_TABLE_LEN must be a power of two");
+static_assert(configTOPIC_TABLE_LEN < TOPIC_ID_NONE, "topic ids are 16 bit");
+
+struct topicEntry {
+    uint32_t hash;
+    uint16_t offset; //of the name in the pool
+    uint16_t len;
+    uint8_t qos;
+    std::atomic<uint32_t> messages_out, messages_in;
+    std::atomic<uint64_t> bytes_out, bytes_in;
+};
+
+static struct topicEntry topics[configTOPIC_TABLE_LEN];
+static char pool[configTOPIC_POOL_LEN];
+static size_t pool_used = 0;
+//id + 1 per hash slot, 0 when free. Written once, after the entry is complete.
+static std::atomic<uint16_t> slots[TOPIC_SLOTS];
+static std::atomic<uint16_t> topic_count(0);
+static std::atomic<uint32_t> misses(0);
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_name(const char *name, size_t len);
+static topicId_t find(const char *name, size_t len, uint32_t hash, int *pSlot);
+static void dump_topics(int fd);
+static const int topic_metrics = metricsRegister("topics", dump_topics);
+
+topicId_t topicIntern(const char *name, size_t len) {
+
+    uint32_t hash;
+    topicId_t id;
+    int slot;
+
+    if (!name || !len || len > UINT16_MAX) {
+        return TOPIC_ID_NONE;
+    }
+    hash = hash_name(name, len);
+    id = find(name, len, hash, &slot);
+    if (id != TOPIC_ID_NONE) {
+        return id;
+    }
+
+    pthread_mutex_lock(&intern_lock);
+    id = find(name, len, hash, &slot); //someone else may have added it meanwhile
+    if (id == TOPIC_ID_NONE && topic_count < configTOPIC_TABLE_LEN && len < sizeof(pool) - pool_used) {
+        id = topic_count;
+        topics[id].hash = hash;
+        topics[id].offset = (uint16_t) pool_used;
+        topics[id].len = (uint16_t) len;
+        memcpy(&pool[pool_used], name, len);
+        pool[pool_used + len] = 0;
+        pool_used += len + 1;
+        topic_count.store(id + 1);
+        slots[slot].store(id + 1); //publishes the entry to lookups
+    }
+    pthread_mutex_unlock(&intern_lock);
+    return id;
+}
+
+topicId_t topicLookup(const char *name, size_t len) {
+
+    int slot;
+    topicId_t id = name ? find(name, len, hash_name(name, len), &slot) : TOPIC_ID_NONE;
+
+    if (id == TOPIC_ID_NONE) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return id;
+}
+
+const char *topicName(topicId_t id, uint16_t *pLen) {
+
+    if (id >= topic_count) {
+        if (pLen) {
+            *pLen = 0;
+        }
+        return "";
+    }
+    if (pLen) {
+        *pLen = topics[id].len;
+    }
+    return &pool[topics[id].offset];
+}
+
+void topicSetQoS(topicId_t id, uint8_t qos) {
+    if (id < topic_count) {
+        topics[id].qos = qos;
+    }
+}
+
+uint8_t topicQoS(topicId_t id) {
+    return id < topic_count ? topics[id].qos : 0;
+}
+
+void topicCountOut(topicId_t id, size_t len) {
+    if (id < topic_count) {
+        topics[id].messages_out.fetch_add(1, std::memory_order_relaxed);
+        topics[id].bytes_out.fetch_add(len, std::memory_order_relaxed);
+    }
+}
+
+void topicCountIn(topicId_t id, size_t len) {
+    if (id < topic_count) {
+        topics[id].messages_in.fetch_add(1, std::memory_order_relaxed);
+        topics[id].bytes_in.fetch_add(len, std::memory_order_relaxed);
+    }
+}
+
+//FNV-1a.
+uint32_t hash_name(const char *name, size_t len) {
+
+    uint32_t hash = 2166136261U;
+
+    for (size_t k = 0; k < len; k++) {
+        hash = (hash ^ (uint8_t) name[k]) * 16777619U;
+    }
+    return hash;
+}
+
+//Linear probing; entries are never removed. *pSlot is where the probe ended,
+//the free slot the name would go to if it is not there.
+topicId_t find(const char *name, size_t len, uint32_t hash, int *pSlot) {
+
+    int i = (int) (hash & (TOPIC_SLOTS - 1));
+    uint16_t entry;
+
+    while ((entry = slots[i].load()) != 0) {
+        struct topicEntry *topic = &topics[entry - 1];
+        if (topic->hash == hash && topic->len == len && !memcmp(&pool[topic->offset], name, len)) {
+            *pSlot = i;
+            return entry - 1;
+        }
+        i = (i + 1) & (TOPIC_SLOTS - 1);
+    }
+    *pSlot = i;
+    return TOPIC_ID_NONE;
+}
+
+void dump_topics(int fd) {
+
+    uint16_t count = topic_count;
+
+    (void) topic_metrics;
+    dprintf(fd, "%u of %d topics, pool %zu of %d bytes, lookups of unknown topics %u\n", count, configTOPIC_TABLE_LEN,
+            pool_used, configTOPIC_POOL_LEN, misses.load());
+    for (topicId_t id = 0; id < count; id++) {
+        dprintf(fd, "%u %s QoS%u out %u msgs %llu bytes, in %u msgs %llu bytes\n", id, &pool[topics[id].offset],
+                topics[id].qos, topics[id].messages_out.load(), (unsigned long long) topics[id].bytes_out.load(),
+                topics[id].messages_in.load(), (unsigned long long) topics[id].bytes_in.load());
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 silva.viniciusr@gmail.com,  all rights reserved.
+ *
+ * SPDX-License-Identifier: MIT
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef TOPIC_TABLE_H
+#define TOPIC_TABLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Topic interning.
+ * Every topic the client knows is stored once, in a fixed name pool, and
+ * gets a compact id: 0, 1, 2, ... in the order topics are interned. The
+ * string is hashed and compared only where one comes off the wire; from
+ * there on the client routes, counts and picks the QoS by id, and arrays
+ * can be indexed by it. Lookups take no lock and may run on the receive
+ * thread while topics are interned; interning itself is serialised.
+ * Per topic message and byte counts in each direction are listed under
+ * "topics" in metricsDump().
+ */
+
+typedef uint16_t topicId_t;
+
+#define TOPIC_ID_NONE ((topicId_t) 0xffff)
+
+//Id of the topic, adding it if it is new. TOPIC_ID_NONE when the table or
+//the name pool is full. The name need not be NUL terminated.
+topicId_t topicIntern(const char *name, size_t len);
+
+//Id of a known topic, TOPIC_ID_NONE (and counted) if it was never interned.
+topicId_t topicLookup(const char *name, size_t len);
+
+//The interned name, NUL terminated, and its length in *pLen if not NULL.
+const char *topicName(topicId_t id, uint16_t *pLen);
+
+//QoS used when publishing and subscribing to the topic, 0 until set.
+void topicSetQoS(topicId_t id, uint8_t qos);
+uint8_t topicQoS(topicId_t id);
+
+//Account for a message of len payload bytes sent to or received on the topic.
+void topicCountOut(topicId_t id, size_t len);
+void topicCountIn(topicId_t id, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TOPIC_TABLE_H
@@ -25,6 +25,10 @@
 #include <string.h>
 #include "transport_esp8266.h"
 #include "serial.h"
+#include "flight_recorder.h"
+#include "alloc_track.h"
+#include "lock_stats.h"
+#include "metrics.h"
 
 //Below includes will change in FreeRTOS implementation
 #include <cstdlib> //exit()
@@ -33,49 +37,260 @@
 #include <unistd.h> //usleep()
 #include <mqueue.h>
 #include <pthread.h>
+#include <time.h> //clock_gettime()
 #define SLEEP usleep(200000)
 
 /* As networking data and control data all comes from
- * same UART interface, rxThread will be responsible to
- * collect them all and populate in two different queues
- * accordingly. dataQueue and controlQueue. The transport
+ * same UART interface, rx_parser will be responsible to
+ * split them and populate two different buffers
+ * accordingly. rx_ring and controlQueue. The transport
  * program shall consume data from these buffers.
+ * rx_parser is registered as the serial rx callback, so it
+ * runs on the serial reader thread, right after read().
  */
-static pthread_t thread_id; //in FreeRTOS this will be an high priority task.
-static void *rxThread(void *args);
-static mqd_t controlQTx, controlQRx, dataQTx, dataQRx;
+static void rx_parser(const char *data, unsigned long len);
+static mqd_t controlQTx, controlQRx;
 static const char *control_mq_name = "/esp8266_control";
-static const char *data_mq_name = "/esp8266_data";
+
+//buffer sizes, overridable at build time (see footprint.sh).
+#ifndef configTRANSPORT_SERIAL_QUEUE_LEN
+    #define configTRANSPORT_SERIAL_QUEUE_LEN 128
+#endif
+#ifndef configTRANSPORT_CIPSEND_MAX
+    #define configTRANSPORT_CIPSEND_MAX 2048
+#endif
+#ifndef configTRANSPORT_RX_RING_LEN
+    #define configTRANSPORT_RX_RING_LEN 2048
+#endif
 
 //constants
-const int BUFFER_LEN = 128; //rx is double buffered;
+const int BUFFER_LEN = configTRANSPORT_SERIAL_QUEUE_LEN; //rx is double buffered;
 const unsigned long BAUD_RATE = 115200;
 const TickType_t RX_BLOCK = 0xff;
 const TickType_t TX_BLOCK = 0x00;
 const TickType_t NO_BLOCK = 0x00;
 const int AT_REPLY_LEN = 7;
+const uint32_t AT_TIMEOUT_MS = 1000; //for at_command(), configuration commands answer quickly
+const uint32_t TCP_CONNECT_TIMEOUT_MS = 10000;
+const uint32_t SSL_CONNECT_TIMEOUT_MS = 30000; //the module's TLS handshake alone takes seconds
+const int AT_LINE_LEN = 64;
+const unsigned long UART_BAUD_TOLERANCE_PCT = 2; //AT+UART_CUR? reports the rate the module measured
+const int CIPSEND_MAX = configTRANSPORT_CIPSEND_MAX; //In a single ATSEND command, we can send up to 2048 bytes at a time;
+const int RX_RING_LEN = configTRANSPORT_RX_RING_LEN; //holds at least one full +IPD segment
+static_assert(configTRANSPORT_CIPSEND_MAX <= 2048, "AT+CIPSEND takes at most 2048 bytes");
 
 enum transportStatus {
     AT_UNINITIALIZED = 0,
     MQUEUE_UNINITIALIZED,
-    RX_THREAD_UNINITIALIZED,
+    PARSER_UNREGISTERED,
     AT_READY,
     CONNECTED,
     ERROR
 };
 
+enum parserState {
+    PARSE_CONTROL = 0, //control bytes, looking for "+IPD,"
+    PARSE_IPD_LINK,    //with CIPMUX=1, reading the +IPD link id, up to ','
+    PARSE_IPD_LENGTH,  //reading +IPD data length, up to ':'
+    PARSE_IPD_DATA     //forwarding ipd_remaining bytes to rx_ring
+};
+
+enum frameState {
+    FRAME_TYPE = 0, //next data byte starts an MQTT packet
+    FRAME_LENGTH,   //reading the remaining length varint
+    FRAME_BODY      //frame_remaining bytes until the packet is complete
+};
+
+/* What the module is known to be configured to, as the value strings the
+ * AT queries return; "" is unknown and "-" not supported by the firmware
+ * (the query got ERROR; one that timed out leaves the setting unknown).
+ * Only the _CUR (RAM) variants are used, so nothing is written to flash and
+ * all of it is lost on a module reset. check_AT() notices a reset by the
+ * command echo coming back, and then forgets everything.
+ */
+struct moduleConfig {
+    bool echo_off;        //ATE0
+    char cwmode[4];       //AT+CWMODE_CUR
+    char cipmux[4];       //AT+CIPMUX
+    char ciprecvmode[4];  //AT+CIPRECVMODE
+    char uart[24];        //AT+UART_CUR
+    char sslsize[8];      //AT+CIPSSLSIZE, write only: known once set
+};
+
 static char esp8266_status = AT_UNINITIALIZED;
+static struct moduleConfig module_known = { false, "", "", "", "", "" };
+
+/* Link type for the next connect. "SSL" links are TLS between the module and
+ * the broker; the Ai-Thinker AT firmware does not check the broker's
+ * certificate and has no TLS session resumption, every connect is a full
+ * handshake. link_connect_ms is how long the last CIPSTART took.
+ */
+static bool link_ssl = false;
+static uint16_t ssl_buffer_size = 4096;
+static uint32_t link_connect_ms = 0;
+static bool at_echoed = false; //the last at_command() saw its own command echoed
+static bool at_refused = false; //the last at_command() got ERROR or FAIL, not a timeout
+static const char ipd_header[] = "+IPD,";
+static char parser_state = PARSE_CONTROL;
+static unsigned char ipd_matched = 0; //ipd_header bytes matched so far
+static int32_t ipd_remaining = 0;
+static int ipd_link = 0; //link the current +IPD data belongs to
+
+/* Standby link, see esp8266AT_SetStandby(). With link_mux the module runs
+ * with CIPMUX=1: the connection is on link_id and standby_id, -1 if there
+ * is none, is a second TCP link opened but never written to. links_closed
+ * has a bit per link id the peer closed, from the module's "<id>,CLOSED"
+ * ("CLOSED" with a single link) lines, tracked by control_track().
+ */
+const int LINKS_MAX = 5; //ids 0..4, CIPCLOSE=5 closes all
+static bool link_mux = false;
+static int link_id = 0;
+static int standby_id = -1;
+static volatile unsigned char links_closed = 0;
+static bool links_idle = false; //esp8266AT_CloseLink() left no link open, the next connect skips close_TCP()
+static char control_line[12]; //current control line, up to what a CLOSED line takes
+static int control_line_len = 0;
+static uint32_t standby_opens = 0, standby_lost = 0, failovers = 0;
+static uint64_t standby_discarded = 0; //bytes the peer sent on the standby link
+
+/* Received TCP data. rx_complete counts the bytes at the front of the
+ * ring that belong to complete MQTT packets, kept up to date by
+ * frame_track() as data is written. In framed mode esp8266AT_recv() hands
+ * out only those bytes, so coreMQTT gets whole packets in one call.
+ */
+static char rx_ring[RX_RING_LEN];
+static int rx_head = 0, rx_tail = 0, rx_count = 0;
+static int rx_complete = 0;
+static bool rx_framed = false;
+static statMutex_t rx_lock = STAT_MUTEX_INITIALIZER("transport rx_lock");
+static char frame_state = FRAME_TYPE;
+static unsigned char frame_length_bytes;
+static uint32_t frame_multiplier;
+static uint32_t frame_remaining;
+
+/* Send coalescing. With tx_linger_ms > 0, esp8266AT_send() only copies
+ * bytes into tx_stage; they go out as one CIPSEND when the stage is full,
+ * or on the first send/recv call after the linger window expires.
+ * Bytes staged while a CIPSEND is in progress ride on the next one.
+ * With tx_ack_hold_ms > 0, a stage holding nothing but MQTT acks may wait
+ * up to tx_ack_hold_ms, so acks leave together or with the next publish.
+ */
+static uint32_t tx_linger_ms = 0;
+static uint32_t tx_ack_hold_ms = 0;
+static char tx_stage[CIPSEND_MAX];
+static int tx_staged = 0;
+static bool tx_stage_acks_only; //valid while tx_staged > 0
+static uint32_t tx_stage_deadline; //ms, valid while tx_staged > 0
+//staged bytes are reported sent before they go out: a flush that fails
+//after that sticks here, and the next send/recv returns -1 for it.
+static volatile bool tx_stage_failed = false;
+static statMutex_t tx_stage_lock = STAT_MUTEX_INITIALIZER("transport tx_stage_lock");
+static statMutex_t cipsend_lock = STAT_MUTEX_INITIALIZER("transport cipsend_lock"); //one CIPSEND at a time on the UART
+
+/* Link tuning, set by esp8266AT_Calibrate(). cipsend() goes on as soon as
+ * the '>' prompt and SEND OK arrive; the timeouts only bound the wait, and
+ * default to the SLEEP the transport used to wait unconditionally. tx_chunk
+ * caps the bytes per CIPSEND, tx_pace_us spaces CIPSEND starts. All of it
+ * is only touched with cipsend_lock held.
+ */
+static uint32_t tx_prompt_timeout_ms = 200;
+static uint32_t tx_send_ok_timeout_ms = 200; //plus the time the data takes on the wire
+static int tx_chunk = CIPSEND_MAX;
+static uint32_t tx_pace_us = 0;
+static uint64_t tx_last_cipsend_us = 0;
+static uint32_t tx_last_prompt_us, tx_last_send_ok_us; //measured by the last cipsend()
+
+/* Chunk size control, AIMD like TCP's window: every clean SEND OK grows
+ * tx_chunk by CHUNK_STEP, SEND FAIL and busy replies halve it, and a SEND OK
+ * far slower than the link's usual fixed cost cuts it by a quarter. Failed
+ * and refused chunks are sent again at the smaller size.
+ */
+const int CHUNK_MIN = 64;
+const int CHUNK_STEP = 64;
+const int CHUNK_RETRIES = 3;
+static uint32_t tx_fixed_us = 0; //lowest SEND OK latency beyond wire time seen, 0 until known
+static uint32_t chunk_increases = 0, chunk_decreases = 0;
+static uint32_t cipsend_fails = 0, cipsend_busy = 0, cipsend_timeouts = 0;
+
+/* Link counters for monitors, which take per-second rates as differences
+ * between two dumps. CIPSEND round trips (prompt plus SEND OK) go into a
+ * log-linear histogram: four buckets per power of two of microseconds, so
+ * a percentile read from it is within 25% of the true value.
+ */
+const int RTT_BUCKETS = 100;
+static uint64_t tx_bytes = 0, rx_bytes = 0; //taken by the module, handed to the ring
+static uint32_t cipsend_count = 0;
+static uint32_t cipsend_rtt[RTT_BUCKETS];
+static int rx_count_max = 0;
+
+enum cipsendResult {
+    CIPSEND_OK = 0,
+    CIPSEND_FAIL,    //SEND FAIL or ERROR
+    CIPSEND_BUSY,    //"busy p..." / "busy s...", the module is still working
+    CIPSEND_TIMEOUT
+};
 
 static void check_AT(void);
-static void start_TCP(const char *pHostName, const char *port);
+static void configure_module(void);
+static bool apply_setting(const char *name, char *known, size_t known_len, const char *wanted, bool query);
+static bool setting_matches(const char *name, const char *value, const char *wanted);
+static bool at_command(const char *command, char *reply, size_t reply_len, uint32_t timeout_ms);
+static void close_TCP(void);
+static void start_TCP(const char *pHostName, const char *port, int id);
 static void send_to_controlQ(int n, const char *c);
+static char cipsend(const char *data, int len);
+static int32_t send_chunked(const char *data, int len);
+static void adapt_chunk(char result, int len);
+static void dump_transport(int fd);
+static const int transport_metrics = metricsRegister("transport", dump_transport);
+static int wait_control(const char *const *tokens, int count, uint32_t timeout_ms);
+static uint64_t now_us(void);
+static int32_t flush_stage(bool only_if_due);
+static uint32_t now_ms(void);
+static bool is_mqtt_ack(const char *data, size_t len);
+static void ring_write(const char *data, int len);
+static void ring_reset(void);
+static void control_track(char c);
+static int rtt_bucket(uint32_t us);
+static uint32_t rtt_bucket_floor(int bucket);
+static void frame_track(const char *data, int len);
+static void open_controlQ(void);
+static void set_status(char status);
 
-esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *port) {
+/* Everything esp8266AT_Detach() hands to the next process. */
+struct handoffState {
+    uint32_t magic;
+    char status;
+    unsigned long baud;
+    char parser_state;
+    unsigned char ipd_matched;
+    int32_t ipd_remaining;
+    int ipd_link;
+    bool link_mux;
+    int link_id;
+    int standby_id;
+    unsigned char links_closed;
+    char frame_state;
+    unsigned char frame_length_bytes;
+    uint32_t frame_multiplier;
+    uint32_t frame_remaining;
+    uint32_t tx_linger_ms;
+    uint32_t tx_ack_hold_ms;
+    uint32_t tx_prompt_timeout_ms;
+    uint32_t tx_send_ok_timeout_ms;
+    int tx_chunk;
+    uint32_t tx_pace_us;
+    bool rx_framed;
+    bool link_ssl;
+    int rx_count;
+    int rx_complete;
+    struct moduleConfig module;
+    char rx_data[RX_RING_LEN]; //unread data, oldest first
+};
+const uint32_t HANDOFF_MAGIC = 0x45535031; //"ESP1"
+static_assert(sizeof(struct handoffState) <= ESP8266_HANDOFF_STATE_LEN, "ESP8266_HANDOFF_STATE_LEN too small");
 
-    struct mq_attr mqstat;
-    memset(&mqstat, 0, sizeof(struct mq_attr));
-    mqstat.mq_maxmsg = BUFFER_LEN / 2;
-    mqstat.mq_msgsize = 1;
+esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *port) {
 
     if (esp8266_status == CONNECTED) {
         return ESP8266_TRANSPORT_SUCCESS;
@@ -83,37 +298,43 @@ esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *po
 
     if (esp8266_status == AT_UNINITIALIZED) {
         xSerialPortInitMinimal(BAUD_RATE, BUFFER_LEN);
-        esp8266_status = MQUEUE_UNINITIALIZED;
+        set_status(MQUEUE_UNINITIALIZED);
     }
 
     if (esp8266_status == MQUEUE_UNINITIALIZED) {
-        controlQTx = mq_open(control_mq_name, O_WRONLY | O_CREAT , S_IRUSR | S_IWUSR, &mqstat);
-        controlQRx = mq_open(control_mq_name, O_RDONLY | O_NONBLOCK);
-        mqstat.mq_maxmsg = BUFFER_LEN;
-        dataQTx = mq_open(data_mq_name, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR, &mqstat);
-        dataQRx = mq_open(data_mq_name, O_RDONLY | O_NONBLOCK);
-        if ((controlQTx == (mqd_t) -1) || (controlQRx == (mqd_t) -1) || 
-            (dataQTx == (mqd_t) -1)    || (dataQRx == (mqd_t) -1)) {
-            perror("Error creating mqueues.");
-            exit(errno);
-        }
-        esp8266_status = RX_THREAD_UNINITIALIZED;
+        open_controlQ();
+        set_status(PARSER_UNREGISTERED);
     }
 
-    if (esp8266_status == RX_THREAD_UNINITIALIZED) {
-        if (pthread_create(&thread_id, NULL, &rxThread, NULL)) {
-            return ESP8266_TRANSPORT_CONNECT_FAILURE;
-        }
-        esp8266_status = AT_READY;
+    if (esp8266_status == PARSER_UNREGISTERED) {
+        parser_state = PARSE_CONTROL;
+        ipd_matched = 0;
+        ring_reset();
+        vSerialSetRxCallback(NULL, &rx_parser);
+        set_status(AT_READY);
     }
 
-    if (esp8266_status > RX_THREAD_UNINITIALIZED) {
+    if (esp8266_status > PARSER_UNREGISTERED) {
         check_AT();
         if (esp8266_status == ERROR) {
             return ESP8266_TRANSPORT_CONNECT_FAILURE;
         }
 
-        start_TCP(pHostName, port);
+        if (!links_idle) {
+            close_TCP(); //CIPMUX can only change without a link
+        }
+        links_idle = false;
+        configure_module();
+        if (esp8266_status == ERROR) {
+            return ESP8266_TRANSPORT_CONNECT_FAILURE;
+        }
+
+        //a fresh connection always starts on link 0.
+        link_id = 0;
+        standby_id = -1;
+        links_closed = 0;
+        tx_stage_failed = false;
+        start_TCP(pHostName, port, link_id);
         if (esp8266_status == ERROR) {
             return ESP8266_TRANSPORT_CONNECT_FAILURE;
         }
@@ -124,87 +345,844 @@ esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *po
     return ESP8266_TRANSPORT_CONNECT_FAILURE;
 }
 
+esp8266TransportStatus_t esp8266AT_CloseLink(void) {
+
+    char command[AT_LINE_LEN];
+
+    if (esp8266_status != CONNECTED) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+
+    flush_stage(false);
+    statMutexLock(&cipsend_lock);
+    statMutexLock(&tx_stage_lock);
+    tx_staged = 0;
+    tx_stage_failed = false;
+    statMutexUnlock(&tx_stage_lock);
+    //ERROR for a link the peer closed already, it is gone either way.
+    if (link_mux) {
+        for (int id = 0; id < LINKS_MAX; id++) {
+            if (id == link_id || id == standby_id) {
+                snprintf(command, sizeof(command), "AT+CIPCLOSE=%d", id);
+                (void) at_command(command, NULL, 0, AT_TIMEOUT_MS);
+            }
+        }
+    }
+    else {
+        (void) at_command("AT+CIPCLOSE", NULL, 0, AT_TIMEOUT_MS);
+    }
+    standby_id = -1;
+    links_closed = 0;
+    ring_reset();
+    links_idle = true;
+    set_status(AT_READY);
+    statMutexUnlock(&cipsend_lock);
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
 esp8266TransportStatus_t esp8266AT_Disconnect(void) {
-    esp8266_status = AT_UNINITIALIZED;
-    pthread_join(thread_id, NULL);
+    flush_stage(false);
+    links_idle = false;
+    set_status(AT_UNINITIALIZED);
+    //stop the serial reader first, so rx_parser won't touch closed queues.
+    vSerialClose(NULL);
     mq_close(controlQTx);
     mq_close(controlQRx);
-    mq_close(dataQTx);
-    mq_close(dataQRx);
-    vSerialClose(NULL);
     mq_unlink(control_mq_name);
-    mq_unlink(data_mq_name);
+    ring_reset();
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
+int esp8266AT_Detach(void *pState, size_t *pStateLen) {
+
+    struct handoffState *state = (struct handoffState*) pState;
+    int fd, n;
+
+    if (esp8266_status != CONNECTED) {
+        return -1;
+    }
+
+    flush_stage(false);
+    //once the serial threads are gone, nothing touches parser or ring anymore.
+    fd = xSerialDetach(NULL);
+    mq_close(controlQTx);
+    mq_close(controlQRx);
+    mq_unlink(control_mq_name); //before the new owner creates it again.
+
+    memset(state, 0, sizeof(*state));
+    state->magic = HANDOFF_MAGIC;
+    state->status = esp8266_status;
+    state->baud = BAUD_RATE;
+    state->parser_state = parser_state;
+    state->ipd_matched = ipd_matched;
+    state->ipd_remaining = ipd_remaining;
+    state->ipd_link = ipd_link;
+    state->link_mux = link_mux;
+    state->link_id = link_id;
+    state->standby_id = standby_id;
+    state->links_closed = links_closed;
+    state->frame_state = frame_state;
+    state->frame_length_bytes = frame_length_bytes;
+    state->frame_multiplier = frame_multiplier;
+    state->frame_remaining = frame_remaining;
+    state->tx_linger_ms = tx_linger_ms;
+    state->tx_ack_hold_ms = tx_ack_hold_ms;
+    state->tx_prompt_timeout_ms = tx_prompt_timeout_ms;
+    state->tx_send_ok_timeout_ms = tx_send_ok_timeout_ms;
+    state->tx_chunk = tx_chunk;
+    state->tx_pace_us = tx_pace_us;
+    state->rx_framed = rx_framed;
+    state->link_ssl = link_ssl;
+    state->rx_count = rx_count;
+    state->rx_complete = rx_complete;
+    state->module = module_known;
+    n = RX_RING_LEN - rx_tail < rx_count ? RX_RING_LEN - rx_tail : rx_count;
+    memcpy(state->rx_data, &rx_ring[rx_tail], n);
+    memcpy(&state->rx_data[n], rx_ring, rx_count - n);
+    *pStateLen = sizeof(*state);
+
+    ring_reset();
+    set_status(AT_UNINITIALIZED);
+    return fd;
+}
+
+esp8266TransportStatus_t esp8266AT_Attach(int serialFd, const void *pState, size_t stateLen) {
+
+    const struct handoffState *state = (const struct handoffState*) pState;
+
+    if (esp8266_status != AT_UNINITIALIZED || serialFd < 0 || stateLen != sizeof(*state) ||
+        state->magic != HANDOFF_MAGIC || state->baud != BAUD_RATE || state->status != CONNECTED) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+
+    open_controlQ();
+    parser_state = state->parser_state;
+    ipd_matched = state->ipd_matched;
+    ipd_remaining = state->ipd_remaining;
+    ipd_link = state->ipd_link;
+    link_mux = state->link_mux;
+    link_id = state->link_id;
+    standby_id = state->standby_id;
+    links_closed = state->links_closed;
+    tx_linger_ms = state->tx_linger_ms;
+    tx_ack_hold_ms = state->tx_ack_hold_ms;
+    tx_prompt_timeout_ms = state->tx_prompt_timeout_ms;
+    tx_send_ok_timeout_ms = state->tx_send_ok_timeout_ms;
+    tx_chunk = state->tx_chunk;
+    tx_pace_us = state->tx_pace_us;
+    rx_framed = state->rx_framed;
+    link_ssl = state->link_ssl;
+    module_known = state->module;
+
+    statMutexLock(&rx_lock);
+    memcpy(rx_ring, state->rx_data, state->rx_count);
+    rx_tail = 0;
+    rx_head = rx_count = state->rx_count;
+    rx_complete = state->rx_complete;
+    frame_state = state->frame_state;
+    frame_length_bytes = state->frame_length_bytes;
+    frame_multiplier = state->frame_multiplier;
+    frame_remaining = state->frame_remaining;
+    statMutexUnlock(&rx_lock);
+
+    //bytes that arrived in between are still waiting in the tty buffer.
+    xSerialPortInitFromFd(serialFd, BUFFER_LEN);
+    vSerialSetRxCallback(NULL, &rx_parser);
+    set_status(CONNECTED);
     return ESP8266_TRANSPORT_SUCCESS;
 }
 
 int32_t esp8266AT_recv(NetworkContext_t *pNetworkContext, void *pBuffer, size_t bytesToRecv) {
-    int32_t bytes_read = 0;
-    char byte;
+    int32_t bytes_read;
+    int n;
+    ALLOC_SCOPE(ALLOC_TRANSPORT);
 
-    while(bytes_read < (int32_t) bytesToRecv) {
-        if ((mq_receive(dataQRx, &byte, 1, NULL) > 0)) {
-            *((char*) pBuffer + bytes_read) = byte;
-            bytes_read++;
-        }
-        else {
-            break;
-        }
+    //coreMQTT polls recv constantly, so this is where an expired linger window is noticed.
+    flush_stage(true);
+    if (tx_stage_failed) {
+        return -1;
     }
 
+    statMutexLock(&rx_lock);
+    bytes_read = rx_framed ? rx_complete : rx_count;
+    if (rx_framed && !bytes_read && (rx_count >= (int) bytesToRecv || rx_count == RX_RING_LEN)) {
+        bytes_read = rx_count; //packet larger than the caller's buffer or the ring, let coreMQTT see it.
+    }
+    if ((size_t) bytes_read > bytesToRecv) {
+        bytes_read = (int32_t) bytesToRecv;
+    }
+    n = RX_RING_LEN - rx_tail < bytes_read ? RX_RING_LEN - rx_tail : bytes_read;
+    memcpy(pBuffer, &rx_ring[rx_tail], n);
+    memcpy((char*) pBuffer + n, rx_ring, bytes_read - n);
+    rx_tail = (rx_tail + bytes_read) % RX_RING_LEN;
+    rx_count -= bytes_read;
+    rx_complete = rx_complete > bytes_read ? rx_complete - bytes_read : 0;
+    statMutexUnlock(&rx_lock);
+
+    //everything the peer sent before closing has been read.
+    if (!bytes_read && (links_closed & (1 << link_id))) {
+        return -1;
+    }
     return bytes_read;
 }
 
+esp8266TransportStatus_t esp8266AT_SetSSL(bool enable, uint16_t bufferSize) {
+
+    //a standby link means CIPMUX=1, where the AT firmware has no SSL link to offer.
+    if (esp8266_status == CONNECTED || (enable && (link_mux || bufferSize < 2048 || bufferSize > 4096))) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+    link_ssl = enable;
+    ssl_buffer_size = bufferSize;
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
+uint32_t esp8266AT_ConnectTime(void) {
+    return link_connect_ms;
+}
+
+esp8266TransportStatus_t esp8266AT_SetStandby(bool enable) {
+
+    //the AT firmware has a single SSL link, and CIPMUX only changes without links.
+    if (esp8266_status == CONNECTED || (enable && link_ssl)) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+    link_mux = enable;
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
+esp8266TransportStatus_t esp8266AT_OpenStandby(const char *pHostName, const char *port) {
+
+    char command[AT_LINE_LEN + 64];
+    int id;
+    uint32_t start;
+    bool up;
+
+    if (!link_mux || esp8266_status != CONNECTED) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+
+    statMutexLock(&cipsend_lock); //the UART is ours until the module answers
+    if (standby_id >= 0) { //replace it, closed or not
+        snprintf(command, sizeof(command), "AT+CIPCLOSE=%d", standby_id);
+        (void) at_command(command, NULL, 0, AT_TIMEOUT_MS);
+        standby_id = -1;
+    }
+    id = link_id ? 0 : 1;
+    links_closed &= ~(1 << id);
+    snprintf(command, sizeof(command), "AT+CIPSTART=%d,\"TCP\",\"%s\",%s", id, pHostName, port);
+    start = now_ms();
+    up = at_command(command, NULL, 0, TCP_CONNECT_TIMEOUT_MS);
+    if (up) {
+        standby_id = id;
+        standby_opens++;
+    }
+    flightRecordf(FR_AT_EVENT, "standby link %d %s in %u ms", id, up ? "up" : "failed", now_ms() - start);
+    statMutexUnlock(&cipsend_lock);
+    return up ? ESP8266_TRANSPORT_SUCCESS : ESP8266_TRANSPORT_CONNECT_FAILURE;
+}
+
+bool esp8266AT_LinkUp(void) {
+    return esp8266_status == CONNECTED && !(links_closed & (1 << link_id));
+}
+
+bool esp8266AT_StandbyUp(void) {
+    if (standby_id >= 0 && (links_closed & (1 << standby_id))) {
+        flightRecordf(FR_AT_EVENT, "standby link %d closed by the peer", standby_id);
+        standby_id = -1;
+        standby_lost++;
+    }
+    return standby_id >= 0;
+}
+
+esp8266TransportStatus_t esp8266AT_Failover(void) {
+
+    char command[AT_LINE_LEN];
+    int old;
+
+    if (esp8266_status != CONNECTED || !esp8266AT_StandbyUp()) {
+        return ESP8266_TRANSPORT_CONNECT_FAILURE;
+    }
+
+    statMutexLock(&cipsend_lock);
+    //nothing staged or received for the old link means anything to the new one.
+    statMutexLock(&tx_stage_lock);
+    tx_staged = 0;
+    tx_stage_failed = false;
+    statMutexUnlock(&tx_stage_lock);
+    old = link_id;
+    link_id = standby_id;
+    standby_id = -1;
+    ring_reset();
+    snprintf(command, sizeof(command), "AT+CIPCLOSE=%d", old);
+    (void) at_command(command, NULL, 0, AT_TIMEOUT_MS); //ERROR if the peer closed it already
+    statMutexUnlock(&cipsend_lock);
+
+    failovers++;
+    flightRecordf(FR_AT_EVENT, "failover link %d -> %d", old, link_id);
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
+void esp8266AT_SetFramedRecv(bool enable) {
+    rx_framed = enable;
+}
+
+size_t esp8266AT_RecvNeeded(void) {
+    size_t needed;
+
+    statMutexLock(&rx_lock);
+    if (rx_complete) {
+        needed = 0;
+    }
+    else if (frame_state == FRAME_BODY) {
+        needed = frame_remaining;
+    }
+    else { //type or remaining length still incomplete, at least one more byte.
+        needed = 1;
+    }
+    statMutexUnlock(&rx_lock);
+    return needed;
+}
+
 int32_t esp8266AT_send(NetworkContext_t *pNetworkContext, const void *pBuffer, size_t bytesToSend) {
 
-    //In a single ATSEND command, we can send up to 2048 bytes at a time;
     int32_t bytes_sent = 0;
-    char command[] = "AT+CIPSEND=2048";
-    char c;
+    int n;
+    bool full, ack;
+    ALLOC_SCOPE(ALLOC_TRANSPORT);
+
+    if (bytesToSend) {
+        flightRecordf(FR_MQTT_PACKET, "tx type 0x%02x len %u",
+                      (unsigned char) *(const char*) pBuffer, (unsigned int) bytesToSend);
+    }
+    if ((links_closed & (1 << link_id)) || tx_stage_failed) {
+        return -1;
+    }
+
+    if (!tx_linger_ms && !tx_ack_hold_ms) {
+        for (; bytesToSend > 0; bytesToSend -= n) {
+            n = bytesToSend < (size_t) CIPSEND_MAX ? (int) bytesToSend : CIPSEND_MAX;
+            statMutexLock(&cipsend_lock);
+            n = send_chunked((const char*) pBuffer + bytes_sent, n);
+            statMutexUnlock(&cipsend_lock);
+            if (!n) { //the module refused it every time, let coreMQTT deal with it.
+                break;
+            }
+            bytes_sent += n;
+        }
+        return bytes_sent;
+    }
+
+    ack = is_mqtt_ack((const char*) pBuffer, bytesToSend);
+    flush_stage(true);
+    for (; bytesToSend > 0; bytesToSend -= n) {
+        statMutexLock(&tx_stage_lock);
+        n = CIPSEND_MAX - tx_staged;
+        if (bytesToSend < (size_t) n) {
+            n = (int) bytesToSend;
+        }
+        if (!tx_staged) {
+            tx_stage_deadline = now_ms() + (ack ? tx_ack_hold_ms : tx_linger_ms);
+            tx_stage_acks_only = ack;
+        }
+        else if (tx_stage_acks_only && !ack) {
+            //held acks now ride with this data, on the data's deadline.
+            if ((int32_t) (now_ms() + tx_linger_ms - tx_stage_deadline) < 0) {
+                tx_stage_deadline = now_ms() + tx_linger_ms;
+            }
+            tx_stage_acks_only = false;
+        }
+        memcpy(&tx_stage[tx_staged], (const char*) pBuffer + bytes_sent, n);
+        tx_staged += n;
+        full = tx_staged >= tx_chunk;
+        statMutexUnlock(&tx_stage_lock);
+        bytes_sent += n;
+        if (full) {
+            flush_stage(false);
+        }
+    }
+
+    if (!ack && !tx_linger_ms) { //only acks are being held, don't hold up data.
+        flush_stage(false);
+    }
+
+    return bytes_sent;
+}
+
+void esp8266AT_SetSendLinger(uint32_t lingerMs) {
+    flush_stage(false);
+    tx_linger_ms = lingerMs;
+}
+
+void esp8266AT_SetAckHold(uint32_t holdMs) {
+    flush_stage(false);
+    tx_ack_hold_ms = holdMs;
+}
+
+int32_t esp8266AT_Flush(void) {
+    return flush_stage(false);
+}
+
+/* One line per module: "<mac> <chunk> <linger ms> <pace us> <prompt timeout ms> <send ok timeout ms>". */
+static bool calibration_load(const char *path, const char *mac) {
+
+    char line[128], id[32];
+    int chunk;
+    unsigned int linger, pace, prompt, send_ok;
+    bool found = false;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return false;
+    }
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s %d %u %u %u %u", id, &chunk, &linger, &pace, &prompt, &send_ok) == 6 &&
+            !strcmp(id, mac) && chunk > 0 && chunk <= CIPSEND_MAX) {
+            tx_chunk = chunk;
+            tx_linger_ms = linger;
+            tx_pace_us = pace;
+            tx_prompt_timeout_ms = prompt;
+            tx_send_ok_timeout_ms = send_ok;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+static void calibration_save(const char *path, const char *mac) {
+
+    char line[128], id[32], tmp_path[256];
+    FILE *in = fopen(path, "r"), *out;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    out = fopen(tmp_path, "w");
+    if (!out) {
+        perror("Could not write the calibration cache");
+        if (in) {
+            fclose(in);
+        }
+        return;
+    }
+    while (in && fgets(line, sizeof(line), in)) { //keep the other modules
+        if (sscanf(line, "%31s", id) != 1 || strcmp(id, mac)) {
+            fputs(line, out);
+        }
+    }
+    fprintf(out, "%s %d %u %u %u %u\n", mac, tx_chunk, tx_linger_ms, tx_pace_us,
+            tx_prompt_timeout_ms, tx_send_ok_timeout_ms);
+    if (in) {
+        fclose(in);
+    }
+    fclose(out);
+    rename(tmp_path, path);
+}
+
+esp8266TransportStatus_t esp8266AT_Calibrate(const char *cachePath, bool force) {
+
+    static const int sizes[] = { 64, 256, 1024, 2048 };
+    const int size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const int repeats = 3;
+    static char pings[CIPSEND_MAX];
+    char mac[32] = "unknown", drain[64];
+    uint64_t prompt_sum = 0, cycle_us[size_count] = {0}, send_ok_us[size_count] = {0}, deadline;
+    int failures[size_count] = {0}, busy = 0, best = -1, pending, n;
+    double best_rate = 0, rate, slope, wire_us_per_byte = 10e6 / BAUD_RATE;
+    double mean_x = 0, mean_y = 0, sxx = 0, sxy = 0;
+    int used = 0;
+
+    if (esp8266_status != CONNECTED) {
+        return ESP8266_TRANSPORT_INVALID_PARAMETER;
+    }
+    flush_stage(false);
+    statMutexLock(&cipsend_lock);
+
+    if (at_command("AT+CIPSTAMAC_CUR?", mac, sizeof(mac), AT_TIMEOUT_MS)) {
+        for (char *p = mac; *p; p++) { //"aa:bb:..." with the quotes dropped
+            if (*p == '"') {
+                memmove(p, p + 1, strlen(p));
+            }
+        }
+    }
+    if (cachePath && !force && calibration_load(cachePath, mac)) {
+        statMutexUnlock(&cipsend_lock);
+        printf("Link calibration for %s (cached): chunk %d bytes, linger %u ms, pacing %u us.\n",
+               mac, tx_chunk, tx_linger_ms, tx_pace_us);
+        return ESP8266_TRANSPORT_SUCCESS;
+    }
+
+    //PINGREQ is the only packet a broker answers at any time without side effects.
+    for (int i = 0; i < CIPSEND_MAX; i += 2) {
+        pings[i] = (char) 0xc0;
+        pings[i + 1] = 0x00;
+    }
+    for (int s = 0; s < size_count && sizes[s] <= CIPSEND_MAX; s++, used++) {
+        for (int r = 0; r < repeats; r++) {
+            switch (cipsend(pings, sizes[s])) {
+            case CIPSEND_OK:
+                break;
+            case CIPSEND_BUSY:
+                busy++;
+                //fall through
+            default:
+                failures[s]++;
+            }
+            prompt_sum += tx_last_prompt_us;
+            send_ok_us[s] += tx_last_send_ok_us;
+            cycle_us[s] += tx_last_prompt_us + tx_last_send_ok_us;
+
+            //one 2 byte PINGRESP comes back per PINGREQ, keep them away from coreMQTT.
+            deadline = now_us() + 2000000;
+            for (pending = sizes[s]; pending > 0 && now_us() < deadline; pending -= n) {
+                n = esp8266AT_recv(NULL, drain, pending < (int) sizeof(drain) ? pending : sizeof(drain));
+                if (n < 0) { //the link is gone, nothing measured from here on means anything.
+                    statMutexUnlock(&cipsend_lock);
+                    printf("Link calibration for %s: link closed, keeping chunk %d bytes.\n", mac, tx_chunk);
+                    flightRecordf(FR_NOTE, "calibration aborted, link closed");
+                    return ESP8266_TRANSPORT_CONNECT_FAILURE;
+                }
+                if (!n) {
+                    usleep(1000);
+                }
+            }
+        }
+        send_ok_us[s] /= repeats;
+        cycle_us[s] /= repeats;
+        rate = failures[s] ? 0 : sizes[s] * 1e6 / cycle_us[s];
+        if (rate > best_rate) {
+            best_rate = rate;
+            best = s;
+        }
+        mean_x += sizes[s];
+        mean_y += send_ok_us[s];
+    }
+
+    //SEND OK latency ~ fixed part + slope * bytes; the slope beyond wire time is the module's.
+    mean_x /= used;
+    mean_y /= used;
+    for (int s = 0; s < used; s++) {
+        sxx += (sizes[s] - mean_x) * (sizes[s] - mean_x);
+        sxy += (sizes[s] - mean_x) * (send_ok_us[s] - mean_y);
+    }
+    slope = sxx ? sxy / sxx : 0;
+    prompt_sum /= used * repeats;
+
+    if (best >= 0) {
+        tx_chunk = sizes[best];
+        //waiting up to one CIPSEND's fixed cost to share it with more data breaks even.
+        tx_linger_ms = (uint32_t) ((prompt_sum + (mean_y - slope * mean_x)) / 1000) + 1;
+        if (tx_linger_ms > 50) {
+            tx_linger_ms = 50;
+        }
+        //the module said busy when sends came back to back, leave it the room it needed.
+        tx_pace_us = busy ? (uint32_t) (cycle_us[best] * 5 / 4) : 0;
+        tx_prompt_timeout_ms = (uint32_t) (prompt_sum * 10 / 1000) + 20;
+        tx_send_ok_timeout_ms = (uint32_t) (send_ok_us[best] * 4 / 1000) + 20;
+    }
+    statMutexUnlock(&cipsend_lock);
+
+    printf("Link calibration for %s: prompt %llu us, module %.1f us/KB beyond the wire, %d busy.\n",
+           mac, (unsigned long long) prompt_sum, (slope - wire_us_per_byte) * 1024, busy);
+    for (int s = 0; s < used; s++) {
+        printf("  %4d bytes: SEND OK %llu us, %.1f KB/s%s\n", sizes[s], (unsigned long long) send_ok_us[s],
+               failures[s] ? 0 : sizes[s] * 1e6 / cycle_us[s] / 1024, failures[s] ? ", failed" : "");
+    }
+    if (best < 0) {
+        printf("  every size failed, keeping chunk %d bytes.\n", tx_chunk);
+        return ESP8266_TRANSPORT_CONNECT_FAILURE;
+    }
+    printf("  chose chunk %d bytes, linger %u ms, pacing %u us.\n", tx_chunk, tx_linger_ms, tx_pace_us);
+    flightRecordf(FR_NOTE, "calibrated chunk %d linger %u pace %u", tx_chunk, tx_linger_ms, tx_pace_us);
+    if (cachePath) {
+        calibration_save(cachePath, mac);
+    }
+    return ESP8266_TRANSPORT_SUCCESS;
+}
+
+int32_t flush_stage(bool only_if_due) {
+
+    static char tx_inflight[CIPSEND_MAX]; //only touched with cipsend_lock held
+    int n;
+
+    if (only_if_due) {
+        //never wait behind a CIPSEND just to check the deadline.
+        if (statMutexTrylock(&cipsend_lock)) {
+            return 0;
+        }
+    }
+    else {
+        statMutexLock(&cipsend_lock);
+    }
+    statMutexLock(&tx_stage_lock);
+    n = tx_staged;
+    if (only_if_due && (int32_t) (now_ms() - tx_stage_deadline) < 0) {
+        n = 0;
+    }
+    if (n) {
+        memcpy(tx_inflight, tx_stage, n);
+        tx_staged = 0;
+    }
+    statMutexUnlock(&tx_stage_lock);
+
+    //sends may keep staging while this CIPSEND is in progress.
+    if (n && send_chunked(tx_inflight, n) < n) {
+        flightRecordf(FR_AT_EVENT, "staged send failed, %d bytes lost", n);
+        tx_stage_failed = true;
+        n = -1;
+    }
+    statMutexUnlock(&cipsend_lock);
+    return n;
+}
+
+//caller must hold cipsend_lock. Returns the bytes the module took.
+int32_t send_chunked(const char *data, int len) {
+
+    int sent = 0, n, retries = 0;
+    char result;
+
+    while (sent < len) {
+        n = len - sent < tx_chunk ? len - sent : tx_chunk;
+        result = cipsend(&data[sent], n);
+        if (result != CIPSEND_OK && (links_closed & (1 << link_id))) {
+            //the peer is gone, not the radio struggling: leave the chunk size alone.
+            flightRecordf(FR_AT_EVENT, "CIPSEND on closed link %d, %d bytes unsent", link_id, len - sent);
+            break;
+        }
+        adapt_chunk(result, n);
+        cipsend_count++;
+        if (result == CIPSEND_OK) {
+            cipsend_rtt[rtt_bucket(tx_last_prompt_us + tx_last_send_ok_us)]++;
+        }
+        if (result == CIPSEND_OK || result == CIPSEND_TIMEOUT) {
+            //after a timeout the data may well be out, sending it again could duplicate it.
+            sent += n;
+            tx_bytes += n;
+            retries = 0;
+        }
+        else if (++retries > CHUNK_RETRIES) {
+            flightRecordf(FR_AT_EVENT, "CIPSEND gave up, %d bytes unsent", len - sent);
+            break;
+        }
+    }
+    return sent;
+}
 
-    while (bytesToSend / 2048) {
-        //Send AT command
-        for(int i = 0; command[i]; i++) {
-            xSerialPutChar(NULL, command[i], TX_BLOCK);
+void adapt_chunk(char result, int len) {
+
+    uint32_t wire_us = (uint32_t) (len * 10000000ULL / BAUD_RATE);
+    uint32_t excess_us = tx_last_send_ok_us > wire_us ? tx_last_send_ok_us - wire_us : 0;
+    int chunk = tx_chunk;
+
+    switch (result) {
+    case CIPSEND_OK:
+        if (!tx_fixed_us || excess_us < tx_fixed_us) {
+            tx_fixed_us = excess_us ? excess_us : 1;
         }
-        xSerialPutChar(NULL, '\r', TX_BLOCK);
-        xSerialPutChar(NULL, '\n', TX_BLOCK);
-        //Should check for errors here, but for now, just send the data.
-        SLEEP; //so ESP8266 can process the AT COMMAND;
-        for (int i = 0; i < 2048; i++) {
-            while(!xSerialPutChar(NULL, *((signed char*) pBuffer + bytes_sent), TX_BLOCK));
-            bytes_sent++;
-            bytesToSend--;
+        if (excess_us > tx_fixed_us * 4 + 20000) { //the radio is struggling
+            chunk = chunk * 3 / 4;
         }
-        SLEEP;
-        //Should check for errors here... but for now, only clear control buffer.
-        while (mq_receive(controlQRx, &c, 1, NULL) > 0);
+        else if (len == tx_chunk) { //only full chunks say the size is fine
+            chunk += CHUNK_STEP;
+        }
+        break;
+    case CIPSEND_TIMEOUT:
+        cipsend_timeouts++;
+        chunk /= 2;
+        break;
+    case CIPSEND_BUSY:
+        cipsend_busy++;
+        chunk /= 2;
+        usleep(tx_fixed_us + 1000); //let it finish what it is doing
+        break;
+    default:
+        cipsend_fails++;
+        chunk /= 2;
     }
 
-    snprintf(&command[11], 5, "%d", (int) bytesToSend);
+    chunk = chunk < CHUNK_MIN ? CHUNK_MIN : chunk > CIPSEND_MAX ? CIPSEND_MAX : chunk;
+    if (chunk > tx_chunk) {
+        chunk_increases++;
+    }
+    else if (chunk < tx_chunk) {
+        chunk_decreases++;
+        flightRecordf(FR_AT_EVENT, "chunk %d -> %d", tx_chunk, chunk);
+    }
+    tx_chunk = chunk;
+}
+
+void dump_transport(int fd) {
+    (void) transport_metrics;
+    dprintf(fd, "chunk %d bytes (up %u, down %u), send fail %u, busy %u, timeout %u, linger %u ms, pacing %u us\n",
+            tx_chunk, chunk_increases, chunk_decreases, cipsend_fails, cipsend_busy, cipsend_timeouts,
+            tx_linger_ms, tx_pace_us);
+    dprintf(fd, "%s link, connected in %u ms\n", link_ssl ? "SSL" : "TCP", link_connect_ms);
+    dprintf(fd, "bytes tx %llu rx %llu, cipsend %u, rx ring %d (max %d) of %d, staged %d\n",
+            (unsigned long long) tx_bytes, (unsigned long long) rx_bytes, cipsend_count,
+            rx_count, rx_count_max, RX_RING_LEN, tx_staged);
+    if (link_mux) {
+        dprintf(fd, "link %d, standby %d, standby opened %u lost %u, failovers %u, standby bytes dropped %llu\n",
+                link_id, standby_id, standby_opens, standby_lost, failovers, (unsigned long long) standby_discarded);
+    }
+    //non-empty buckets as <floor us>:<count>
+    dprintf(fd, "cipsend rtt us");
+    for (int i = 0; i < RTT_BUCKETS; i++) {
+        if (cipsend_rtt[i]) {
+            dprintf(fd, " %u:%u", rtt_bucket_floor(i), cipsend_rtt[i]);
+        }
+    }
+    dprintf(fd, "\n");
+}
+
+int rtt_bucket(uint32_t us) {
+
+    int e, bucket;
+
+    if (us < 4) {
+        return (int) us;
+    }
+    e = 31 - __builtin_clz(us);
+    bucket = 4 * (e - 1) + (int) ((us >> (e - 2)) & 3);
+    return bucket < RTT_BUCKETS ? bucket : RTT_BUCKETS - 1;
+}
+
+uint32_t rtt_bucket_floor(int bucket) {
+    if (bucket < 4) {
+        return (uint32_t) bucket;
+    }
+    return (uint32_t) (4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+//caller must hold cipsend_lock.
+char cipsend(const char *data, int len) {
+
+    static const char *const prompt_replies[] = { ">", "ERROR", "busy" };
+    static const char *const send_replies[] = { "SEND OK", "SEND FAIL", "ERROR", "busy" };
+    char command[24];
+    char c;
+    uint64_t start;
+    int reply;
+
+    if (tx_pace_us) {
+        while (now_us() - tx_last_cipsend_us < tx_pace_us) {
+            usleep(100);
+        }
+    }
+    while (mq_receive(controlQRx, &c, 1, NULL) > 0); //leftovers of earlier replies
+    tx_last_cipsend_us = start = now_us();
+
+    if (link_mux) {
+        snprintf(command, sizeof(command), "AT+CIPSEND=%d,%d", link_id, len);
+    }
+    else {
+        snprintf(command, sizeof(command), "AT+CIPSEND=%d", len);
+    }
+    flightRecord(FR_AT_EVENT, command, strlen(command));
     //Send AT command
     for(int i = 0; command[i]; i++) {
-        xSerialPutChar(NULL, command[i], TX_BLOCK);
+        while (!xSerialPutChar(NULL, command[i], TX_BLOCK));
     }
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
-    SLEEP; //so ESP8266 can process the AT COMMAND;
-    //Should check for errors here, but for now, just send the data.
-    for (; bytesToSend > 0; bytesToSend--) {
-        while(!xSerialPutChar(NULL, *((signed char*) pBuffer + bytes_sent), TX_BLOCK));
-        bytes_sent++;
+    while (!xSerialPutChar(NULL, '\r', TX_BLOCK));
+    while (!xSerialPutChar(NULL, '\n', TX_BLOCK));
+    reply = wait_control(prompt_replies, 3, tx_prompt_timeout_ms);
+    tx_last_prompt_us = (uint32_t) (now_us() - start);
+    if (reply) {
+        //no prompt: the module may still take the data, so the old behaviour
+        //of sending it anyway is kept unless it said no.
+        flightRecordf(FR_AT_EVENT, "CIPSEND no prompt (%d)", reply);
+        if (reply == 1) {
+            return CIPSEND_FAIL;
+        }
+        if (reply == 2) {
+            return CIPSEND_BUSY;
+        }
     }
 
-    SLEEP;
-    //Should check for errors here... but for now, only clear control buffer.
-    while (mq_receive(controlQRx, &c, 1, NULL) > 0);
+    start = now_us();
+    for (int i = 0; i < len; i++) {
+        while(!xSerialPutChar(NULL, data[i], TX_BLOCK));
+    }
+    reply = wait_control(send_replies, 4, tx_send_ok_timeout_ms + (uint32_t) (len * 10000ULL / BAUD_RATE));
+    tx_last_send_ok_us = (uint32_t) (now_us() - start);
+    switch (reply) {
+    case 0:
+        return CIPSEND_OK;
+    case 3:
+        flightRecordf(FR_AT_EVENT, "CIPSEND busy");
+        return CIPSEND_BUSY;
+    case -1:
+        flightRecordf(FR_AT_EVENT, "CIPSEND no SEND OK after %u us", tx_last_send_ok_us);
+        return CIPSEND_TIMEOUT;
+    default:
+        flightRecordf(FR_AT_EVENT, "SEND FAIL");
+        return CIPSEND_FAIL;
+    }
+}
 
-    return bytes_sent;
+/* Read control bytes until one of tokens arrived, return its index, or -1
+ * after timeout_ms. Tokens are matched anywhere, not only on line starts.
+ */
+int wait_control(const char *const *tokens, int count, uint32_t timeout_ms) {
+
+    char window[16] = {0}; //the last bytes received, newest last
+    const int window_len = sizeof(window) - 1;
+    uint64_t deadline = now_us() + timeout_ms * 1000ULL;
+    char c;
+    int len;
+
+    while (now_us() < deadline) {
+        if (mq_receive(controlQRx, &c, 1, NULL) <= 0) {
+            usleep(100);
+            continue;
+        }
+        memmove(window, &window[1], window_len - 1);
+        window[window_len - 1] = c;
+        for (int i = 0; i < count; i++) {
+            len = strlen(tokens[i]);
+            if (!memcmp(&window[window_len - len], tokens[i], len)) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+//PUBACK, PUBREC, PUBREL and PUBCOMP are all 4 bytes: type, remaining length 2, packet id.
+bool is_mqtt_ack(const char *data, size_t len) {
+    unsigned char type;
+
+    if (len != 4 || data[1] != 2) {
+        return false;
+    }
+    type = (unsigned char) data[0];
+    return type == 0x40 || type == 0x50 || type == 0x62 || type == 0x70;
+}
+
+uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
 void check_AT(void) {
 
     char at_cmd_response[AT_REPLY_LEN] = {0};
 
+    if (module_known.echo_off) {
+        //echo is off already, a plain AT will do. If it echoes, the module was reset.
+        if (at_command("AT", NULL, 0, AT_TIMEOUT_MS) && !at_echoed) {
+            set_status(AT_READY);
+            return;
+        }
+        flightRecordf(FR_AT_EVENT, "module reset, configuration forgotten");
+        memset(&module_known, 0, sizeof(module_known));
+    }
+
     //Send AT command
     xSerialPutChar(NULL, 'A', TX_BLOCK);
     xSerialPutChar(NULL, 'T', TX_BLOCK);
@@ -227,18 +1205,143 @@ void check_AT(void) {
     }
 
     if(strcmp(at_cmd_response, "\r\nOK\r\n")) {
-        esp8266_status = ERROR;
+        set_status(ERROR);
     }
     else {
-        esp8266_status = AT_READY;
+        module_known.echo_off = true;
+        set_status(AT_READY);
     }
     return;
 }
 
-void start_TCP(const char *pHostName, const char *port) {
+/* Bring the module to the configuration this transport expects, sending
+ * only what differs from module_known. Settings are queried once when
+ * unknown; on a warm connect nothing is sent at all.
+ */
+void configure_module(void) {
+
+    char uart[sizeof(module_known.uart)];
+
+    snprintf(uart, sizeof(uart), "%lu,8,1,0,0", BAUD_RATE); //8N1, no flow control
+    if (!apply_setting("CWMODE_CUR", module_known.cwmode, sizeof(module_known.cwmode), "1", true) || //station
+        !apply_setting("CIPMUX", module_known.cipmux, sizeof(module_known.cipmux), link_mux ? "1" : "0", true) ||
+        !apply_setting("CIPRECVMODE", module_known.ciprecvmode, sizeof(module_known.ciprecvmode), "0", true) || //+IPD
+        !apply_setting("UART_CUR", module_known.uart, sizeof(module_known.uart), uart, true)) {
+        set_status(ERROR);
+    }
+}
+
+//query is false for settings the firmware cannot report; they are set when unknown.
+bool apply_setting(const char *name, char *known, size_t known_len, const char *wanted, bool query) {
 
+    char command[AT_LINE_LEN], reply[AT_LINE_LEN];
+
+    if (!strcmp(known, wanted) || !strcmp(known, "-")) {
+        return true;
+    }
+    if (!known[0] && query) {
+        snprintf(command, sizeof(command), "AT+%s?", name);
+        if (!at_command(command, reply, sizeof(reply), AT_TIMEOUT_MS)) {
+            if (at_refused) { //older firmware, leave it alone.
+                snprintf(known, known_len, "-");
+                return true;
+            }
+            //no answer in time: still unknown, set it anyway.
+        }
+        else if (setting_matches(name, reply, wanted)) {
+            snprintf(known, known_len, "%s", wanted);
+            return true;
+        }
+    }
+    snprintf(command, sizeof(command), "AT+%s=%s", name, wanted);
+    if (!at_command(command, NULL, 0, AT_TIMEOUT_MS)) {
+        known[0] = 0;
+        return false;
+    }
+    snprintf(known, known_len, "%s", wanted);
+    return true;
+}
+
+//UART_CUR reads back the measured baud rate, e.g. 115273 for 115200; the other fields must match.
+bool setting_matches(const char *name, const char *value, const char *wanted) {
+
+    unsigned long baud, wanted_baud;
+    char *rest, *wanted_rest;
+
+    if (strcmp(name, "UART_CUR")) {
+        return !strcmp(value, wanted);
+    }
+    baud = strtoul(value, &rest, 10);
+    wanted_baud = strtoul(wanted, &wanted_rest, 10);
+    return !strcmp(rest, wanted_rest) &&
+           (baud > wanted_baud ? baud - wanted_baud : wanted_baud - baud) * 100 <= wanted_baud * UART_BAUD_TOLERANCE_PCT;
+}
+
+/* Send command and wait for its final OK, ERROR or FAIL line, at most
+ * timeout_ms. A "+NAME:value" line is copied to reply, without the
+ * "+NAME:" part. Returns true on OK.
+ */
+bool at_command(const char *command, char *reply, size_t reply_len, uint32_t timeout_ms) {
+
+    char line[AT_LINE_LEN];
+    int line_len = 0;
+    uint32_t deadline;
     char c;
 
+    flightRecord(FR_AT_EVENT, command, strlen(command));
+    while (mq_receive(controlQRx, &c, 1, NULL) > 0); //drop leftovers
+    for (int i = 0; command[i]; i++) {
+        while (!xSerialPutChar(NULL, command[i], TX_BLOCK));
+    }
+    while (!xSerialPutChar(NULL, '\r', TX_BLOCK));
+    while (!xSerialPutChar(NULL, '\n', TX_BLOCK));
+
+    at_echoed = false;
+    at_refused = false;
+    deadline = now_ms() + timeout_ms;
+    while ((int32_t) (deadline - now_ms()) > 0) {
+        if (mq_receive(controlQRx, &c, 1, NULL) <= 0) {
+            usleep(1000);
+            continue;
+        }
+        if (c == '\r') {
+            continue;
+        }
+        if (c != '\n') {
+            if (line_len < AT_LINE_LEN - 1) {
+                line[line_len++] = c;
+            }
+            continue;
+        }
+        line[line_len] = 0;
+        line_len = 0;
+        if (!strcmp(line, "OK")) {
+            return true;
+        }
+        if (!strcmp(line, "ERROR") || !strcmp(line, "FAIL")) {
+            at_refused = true;
+            return false;
+        }
+        if (!strcmp(line, command)) {
+            at_echoed = true;
+        }
+        else if (reply && line[0] == '+' && strchr(line, ':')) {
+            snprintf(reply, reply_len, "%s", strchr(line, ':') + 1);
+        }
+    }
+    flightRecordf(FR_AT_EVENT, "%s timed out", command);
+    return false;
+}
+
+void close_TCP(void) {
+
+    char c;
+
+    //with CIPMUX=1, or not known to be 0, every link goes: a plain CIPCLOSE is refused then.
+    if (strcmp(module_known.cipmux, "0")) {
+        (void) at_command("AT+CIPCLOSE=5", NULL, 0, AT_TIMEOUT_MS);
+    }
+
     //Close existing TCP connection, if any
     xSerialPutChar(NULL, 'A', TX_BLOCK);
     xSerialPutChar(NULL, 'T', TX_BLOCK);
@@ -256,123 +1359,251 @@ void start_TCP(const char *pHostName, const char *port) {
     SLEEP;
     //Clear rx control buffer
     while (mq_receive(controlQRx, &c, 1, NULL) > 0);
+}
 
-    //AT header to start TCP connection
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, '+', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'I', TX_BLOCK);
-    xSerialPutChar(NULL, 'P', TX_BLOCK);
-    xSerialPutChar(NULL, 'S', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'R', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, '=', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'P', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, ',', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-
-    //Target IP
-    for (int i = 0; *(pHostName + i); i++) {
-        xSerialPutChar(NULL, *(pHostName + i), TX_BLOCK);
-    }
+void start_TCP(const char *pHostName, const char *port, int id) {
 
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, ',', TX_BLOCK);
+    char command[AT_LINE_LEN + 64];
+    char size[8];
+    uint32_t start;
 
-    //Target TCP Port
-    for (int i = 0; *(port + i); i++) {
-        xSerialPutChar(NULL, *(port + i), TX_BLOCK);
+    //the TLS buffer must be set before the link opens, and only once per module reset.
+    if (link_ssl) {
+        snprintf(size, sizeof(size), "%u", ssl_buffer_size);
+        if (!apply_setting("CIPSSLSIZE", module_known.sslsize, sizeof(module_known.sslsize), size, false)) {
+            set_status(ERROR);
+            return;
+        }
     }
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
 
-    SLEEP; //so esp8266 has enough time to reply us.
-    mq_receive(controlQRx, &c, 1, NULL); //C, if success
-
-    if (c != 'C') {
-        esp8266_status = ERROR;
+    if (link_mux) {
+        snprintf(command, sizeof(command), "AT+CIPSTART=%d,\"TCP\",\"%s\",%s", id, pHostName, port);
     }
     else {
-        esp8266_status = CONNECTED;
+        snprintf(command, sizeof(command), "AT+CIPSTART=\"%s\",\"%s\",%s", link_ssl ? "SSL" : "TCP", pHostName, port);
+    }
+    links_closed &= ~(1 << id);
+    start = now_ms();
+    if (at_command(command, NULL, 0, link_ssl ? SSL_CONNECT_TIMEOUT_MS : TCP_CONNECT_TIMEOUT_MS)) {
+        link_connect_ms = now_ms() - start;
+        flightRecordf(FR_AT_EVENT, "%s link up in %u ms", link_ssl ? "SSL" : "TCP", link_connect_ms);
+        set_status(CONNECTED);
+    }
+    else {
+        set_status(ERROR);
     }
-    //Clear rx control buffer
-    while (mq_receive(controlQRx, &c, 1, NULL) > 0);
     return;
 }
 
-void *rxThread(void *args) {
-
-    char c[10]; //convert up to 9 decimal digits to int32_t;
-    int32_t data_lenght; //in bytes.... that can count a lot of data....
-    unsigned char index;
-
-    //Block until we update esp8266_status in the main therad to AT_READY;
-    while(esp8266_status == RX_THREAD_UNINITIALIZED);
-
-    //Very ugly code, but it works...
-    //Keep running till esp8266AT_Disconnect() is called;
-    while(esp8266_status > RX_THREAD_UNINITIALIZED) {
-        if (xSerialGetChar(NULL, (signed char*) &c[0], RX_BLOCK)) {
-            if (c[0] == '+') {
-                while(!xSerialGetChar(NULL, (signed char*) &c[1], RX_BLOCK));
-                if (c[1] == 'I') {
-                    while(!xSerialGetChar(NULL, (signed char*) &c[2], RX_BLOCK));
-                    if (c[2] == 'P') {
-                        while(!xSerialGetChar(NULL, (signed char*) &c[3], RX_BLOCK));
-                        if (c[3] == 'D') {
-                            while(!xSerialGetChar(NULL, (signed char*) &c[4], RX_BLOCK));
-                            if (c[4] == ',') { //Hit Magic header!! We got data!!
-                                c[9] = 0;
-                                index = 0;
-                                while(index < 9) {
-                                    while(!xSerialGetChar(NULL, (signed char*) &c[9], RX_BLOCK));
-                                    if (c[9] == ':') {
-                                        c[++index] = 0;
-                                        break;
-                                    }
-                                    c[index++] = c[9];
-                                }
-                                data_lenght = atoi(c);
-                                for (; data_lenght > 0; data_lenght--) {
-                                    while(!xSerialGetChar(NULL, (signed char*) c, RX_BLOCK));
-                                    mq_send(dataQTx, c, 1, 0);
-                                }
-                            }
-                            else {
-                                send_to_controlQ(5, c);
-                            }
-                        }
-                        else {
-                            send_to_controlQ(4, c);
-                        }
-                    }
-                    else {
-                        send_to_controlQ(3, c);
-                    }
-                }
-                else {
-                    send_to_controlQ(2, c);
+void rx_parser(const char *data, unsigned long len) {
+
+    int32_t n;
+    ALLOC_SCOPE(ALLOC_TRANSPORT);
+
+    for (unsigned long i = 0; i < len; i++) {
+        switch (parser_state) {
+        case PARSE_IPD_DATA:
+            n = len - i < (unsigned long) ipd_remaining ? (int32_t) (len - i) : ipd_remaining;
+            if (ipd_link == link_id) {
+                ring_write(&data[i], n);
+            }
+            else { //the standby link is not in use yet, nothing on it is for us.
+                standby_discarded += n;
+            }
+            i += n - 1;
+            ipd_remaining -= n;
+            if (ipd_remaining == 0) {
+                parser_state = PARSE_CONTROL;
+            }
+            break;
+
+        case PARSE_IPD_LINK:
+            if (data[i] >= '0' && data[i] < '0' + LINKS_MAX) {
+                ipd_link = data[i] - '0';
+            }
+            else if (data[i] == ',') {
+                parser_state = PARSE_IPD_LENGTH;
+            }
+            else {
+                parser_state = PARSE_CONTROL;
+            }
+            break;
+
+        case PARSE_IPD_LENGTH:
+            if (data[i] >= '0' && data[i] <= '9' && ipd_remaining < 100000000) {
+                ipd_remaining = ipd_remaining * 10 + (data[i] - '0');
+            }
+            else if (data[i] == ':' && ipd_remaining > 0) { //Hit Magic header!! We got data!!
+                flightRecordf(FR_AT_EVENT, "+IPD,%d", (int) ipd_remaining);
+                parser_state = PARSE_IPD_DATA;
+            }
+            else { //not a valid header after all, resync on control data.
+                parser_state = PARSE_CONTROL;
+            }
+            break;
+
+        default:
+            if (data[i] == ipd_header[ipd_matched]) {
+                if (!ipd_header[++ipd_matched]) {
+                    ipd_matched = 0;
+                    ipd_remaining = 0;
+                    ipd_link = link_id;
+                    parser_state = link_mux ? PARSE_IPD_LINK : PARSE_IPD_LENGTH;
                 }
+                break;
+            }
+            //partial match, give back what was held.
+            send_to_controlQ(ipd_matched, ipd_header);
+            ipd_matched = 0;
+            if (data[i] == ipd_header[0]) {
+                ipd_matched = 1;
             }
             else {
-                mq_send(controlQTx, c, 1, 0);
+                mq_send(controlQTx, &data[i], 1, 0);
+                control_track(data[i]);
+            }
+            break;
+        }
+    }
+}
+
+//called on the serial reader thread; waits for recv to make room if the ring is full.
+void ring_write(const char *data, int len) {
+
+    int n, k;
+
+    while (len > 0) {
+        statMutexLock(&rx_lock);
+        n = RX_RING_LEN - rx_count < len ? RX_RING_LEN - rx_count : len;
+        k = RX_RING_LEN - rx_head < n ? RX_RING_LEN - rx_head : n;
+        memcpy(&rx_ring[rx_head], data, k);
+        memcpy(rx_ring, data + k, n - k);
+        rx_head = (rx_head + n) % RX_RING_LEN;
+        rx_count += n;
+        rx_bytes += n;
+        if (rx_count > rx_count_max) {
+            rx_count_max = rx_count;
+        }
+        frame_track(data, n);
+        statMutexUnlock(&rx_lock);
+        data += n;
+        len -= n;
+        if (len) {
+            usleep(1000); //block, then check for available space in rx_ring;
+        }
+    }
+}
+
+void ring_reset(void) {
+    statMutexLock(&rx_lock);
+    rx_head = rx_tail = rx_count = rx_complete = 0;
+    frame_state = FRAME_TYPE;
+    statMutexUnlock(&rx_lock);
+}
+
+//caller must hold rx_lock. data has just been appended to rx_ring.
+void frame_track(const char *data, int len) {
+
+    uint32_t n;
+
+    for (int i = 0; i < len; i++) {
+        switch (frame_state) {
+        case FRAME_TYPE:
+            frame_state = FRAME_LENGTH;
+            frame_length_bytes = 0;
+            frame_multiplier = 1;
+            frame_remaining = 0;
+            break;
+
+        case FRAME_LENGTH:
+            frame_remaining += (data[i] & 0x7f) * frame_multiplier;
+            frame_multiplier *= 128;
+            frame_length_bytes++;
+            if (!(data[i] & 0x80)) {
+                frame_state = frame_remaining ? FRAME_BODY : FRAME_TYPE;
+            }
+            else if (frame_length_bytes == 4) { //malformed, let coreMQTT deal with it.
+                frame_state = FRAME_TYPE;
+            }
+            break;
+
+        default:
+            n = (uint32_t) (len - i) < frame_remaining ? (uint32_t) (len - i) : frame_remaining;
+            i += n - 1;
+            frame_remaining -= n;
+            if (!frame_remaining) {
+                frame_state = FRAME_TYPE;
             }
+            break;
+        }
+        if (frame_state == FRAME_TYPE) { //everything up to here is whole packets.
+            rx_complete = rx_count - (len - i - 1);
         }
     }
+}
 
-    return NULL;
+void set_status(char status) {
+    static const char *names[] = { "AT_UNINITIALIZED", "MQUEUE_UNINITIALIZED", "PARSER_UNREGISTERED",
+                                   "AT_READY", "CONNECTED", "ERROR" };
+    if (status != esp8266_status) {
+        flightRecordf(FR_TRANSPORT_STATE, "%s -> %s", names[(int) esp8266_status], names[(int) status]);
+    }
+    esp8266_status = status;
+}
+
+void open_controlQ(void) {
+
+    struct mq_attr mqstat;
+    memset(&mqstat, 0, sizeof(struct mq_attr));
+    mqstat.mq_maxmsg = BUFFER_LEN / 2;
+    mqstat.mq_msgsize = 1;
+
+    //control writes must not block: the parser runs on the serial reader thread,
+    //and unsolicited control chatter must not stall +IPD data behind it.
+    controlQTx = mq_open(control_mq_name, O_WRONLY | O_CREAT | O_NONBLOCK, S_IRUSR | S_IWUSR, &mqstat);
+    controlQRx = mq_open(control_mq_name, O_RDONLY | O_NONBLOCK);
+    if ((controlQTx == (mqd_t) -1) || (controlQRx == (mqd_t) -1)) {
+        perror("Error creating mqueues.");
+        flightRecorderDump("mqueue creation failed");
+        exit(errno);
+    }
 }
 
 void send_to_controlQ(int n, const char *c) {
     for(int i = 0; i < n; i++) {
         mq_send(controlQTx, c + i, 1, 0);
+        control_track(c[i]);
     }
     return;
 }
+
+/* Watch control lines for links the peer closed: "CLOSED" with a single
+ * link, "<id>,CLOSED" with CIPMUX=1. Runs on the serial reader thread;
+ * longer lines are not looked at.
+ */
+void control_track(char c) {
+
+    const int line_max = sizeof(control_line) - 1;
+
+    if (c == '\r') {
+        return;
+    }
+    if (c != '\n') {
+        if (control_line_len < line_max) {
+            control_line[control_line_len] = c;
+        }
+        control_line_len += control_line_len <= line_max;
+        return;
+    }
+    if (control_line_len <= line_max) {
+        control_line[control_line_len] = 0;
+        if (!link_mux && !strcmp(control_line, "CLOSED")) {
+            links_closed |= 1 << link_id;
+        }
+        else if (link_mux && control_line[0] >= '0' && control_line[0] < '0' + LINKS_MAX &&
+                 !strcmp(&control_line[1], ",CLOSED")) {
+            links_closed |= 1 << (control_line[0] - '0');
+        }
+    }
+    control_line_len = 0;
+}
@@ -29,6 +29,7 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include "transport_interface.h"
 
 typedef enum esp8266TransportStatus {
@@ -42,14 +43,99 @@ typedef enum esp8266TransportStatus {
 esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *port);
 esp8266TransportStatus_t esp8266AT_Disconnect(void);
 
+//Close the connection (and the standby link) but keep the serial port and
+//the module set up, so the next esp8266AT_Connect() only opens a link.
+esp8266TransportStatus_t esp8266AT_CloseLink(void);
+
+//TLS links, disabled by default. Call before esp8266AT_Connect(): the link
+//then opens as "SSL" with a module TLS buffer of bufferSize (2048..4096)
+//bytes. The module does not verify the broker certificate and cannot
+//resume TLS sessions, so every connect is a full handshake. Not with a
+//standby link, see esp8266AT_SetStandby().
+esp8266TransportStatus_t esp8266AT_SetSSL(bool enable, uint16_t bufferSize);
+
+//How long the last link open (CIPSTART, incl. the TLS handshake) took, in ms.
+uint32_t esp8266AT_ConnectTime(void);
+
+//false once the peer closed the connection, or without one.
+bool esp8266AT_LinkUp(void);
+
+//Standby link, disabled by default; TCP links only. Call before
+//esp8266AT_Connect(): the module then runs with CIPMUX=1 and, once
+//connected, esp8266AT_OpenStandby() opens a second TCP link that nothing
+//is sent on. esp8266AT_Failover() makes it the connection, so a broker
+//failover skips the TCP connect. Brokers may close a link that sends no
+//MQTT CONNECT for a while; esp8266AT_StandbyUp() tells if it is still open.
+esp8266TransportStatus_t esp8266AT_SetStandby(bool enable);
+esp8266TransportStatus_t esp8266AT_OpenStandby(const char *pHostName, const char *port);
+bool esp8266AT_StandbyUp(void);
+
+//Switch to the standby link. The current link is closed, and whatever was
+//staged for or received on it is dropped. Fails without an open standby.
+esp8266TransportStatus_t esp8266AT_Failover(void);
+
+//Process hand-off (see handoff.h). Buffer size for the transport state.
+#define ESP8266_HANDOFF_STATE_LEN 2304
+
+//Stop using the module without closing the TCP link or the serial device.
+//Staged sends are flushed first. The transport state (link status, baud,
+//unread rx data, settings) is written to pState, up to
+//ESP8266_HANDOFF_STATE_LEN bytes, and its length to pStateLen.
+//Returns the serial fd, or -1 if there is no connected link to hand off.
+int esp8266AT_Detach(void *pState, size_t *pStateLen);
+
+//Resume a link detached by another process, on its serial fd and state.
+esp8266TransportStatus_t esp8266AT_Attach(int serialFd, const void *pState, size_t stateLen);
+
+//Once the peer closed the link, recv returns -1 after the last received
+//byte, and send returns -1.
 int32_t esp8266AT_recv(NetworkContext_t *pNetworkContext,
                         void *pBuffer,
                         size_t bytesToRecv);
 
+//MQTT framed receive, disabled by default.
+//When enabled, esp8266AT_recv() returns only bytes of complete MQTT packets
+//(or a partial packet that would not fit the caller's buffer or the receive
+//ring anyway), so coreMQTT gets each packet in one call instead of piecing
+//it together.
+void esp8266AT_SetFramedRecv(bool enable);
+
+//Bytes still missing before the next MQTT packet is complete; 0 if one
+//is ready. While the fixed header is incomplete this is 1.
+size_t esp8266AT_RecvNeeded(void);
+
 int32_t esp8266AT_send(NetworkContext_t *pNetworkContext,
                         const void *pBuffer,
                         size_t bytesToSend);
 
+//Send coalescing, disabled by default (lingerMs = 0).
+//With lingerMs > 0, esp8266AT_send() stages bytes instead of issuing one
+//CIPSEND per call. Staged bytes go out together, up to 2048 per CIPSEND,
+//when the stage fills or on the first send/recv call after lingerMs.
+void esp8266AT_SetSendLinger(uint32_t lingerMs);
+
+//Ack piggy-backing, disabled by default (holdMs = 0).
+//With holdMs > 0, outgoing PUBACK/PUBREC/PUBREL/PUBCOMP packets are held
+//for up to holdMs. They leave together, or with the next non-ack send.
+//Keep holdMs well below the broker's retransmission interval.
+void esp8266AT_SetAckHold(uint32_t holdMs);
+
+//Push out staged bytes now. Returns the number of bytes sent, or -1 if
+//the module did not take them all. Staged bytes were already reported
+//sent, so after such a failure send and recv return -1 until the next
+//connect.
+int32_t esp8266AT_Flush(void);
+
+//Link calibration, optional. Call on a connected link right after the MQTT
+//CONNACK, before subscribing: the link is measured with batches of
+//PINGREQs and their PINGRESPs are consumed here. Measures the CIPSEND
+//prompt round trip and the SEND OK latency per chunk size, then sets the
+//chunk size, send linger and CIPSEND pacing, and prints them. Results are
+//cached per module (station MAC) in cachePath, if not NULL; a cached
+//module is not measured again unless force is set. Fails, keeping the
+//current settings, if the link closes while measuring.
+esp8266TransportStatus_t esp8266AT_Calibrate(const char *cachePath, bool force);
+
 
 #ifdef __cplusplus
 }